@@ -1061,6 +1061,13 @@ gpt_params_context gpt_params_parser_init(gpt_params & params, llama_example ex,
             params.cache = x;
         }
     ));
+    add_opt(llama_arg(
+        {"--cache-percent"}, "N",
+        "percent of the model to load before the first request, overrides --cache",
+        [](gpt_params & params, int value) {
+            params.cache_percent = value;
+        }
+    ));
     add_opt(llama_arg(
         {"--tee-shm-paddr"}, "PADDR",
         "tee-shm-paddr)",
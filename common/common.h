@@ -205,6 +205,7 @@ struct gpt_params {
     std::string io_model_path        = "";
 
     int cache                        = 0;
+    int cache_percent                = -1; // overrides cache when set
     unsigned long tee_shm_paddr      = 0;
 
     std::vector<std::string> in_files;   // all input files
@@ -0,0 +1,154 @@
+// Packs random weights into NPU tiles with the vectorized relayout and with the
+// element by element loops it replaced, checks both agree and times them.
+// Plain C with NEON or SSE paths, so it runs on the build host too.
+
+#include "ggml.h"
+#include "npu_relayout.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+struct relayout_params {
+    int k = 4096;
+    int n = 11008;
+    int n_iterations = 5;
+};
+
+static void print_usage(char ** argv, const relayout_params & params) {
+    fprintf(stderr, "usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -h, --help            show this help message and exit\n");
+    fprintf(stderr, "  -k N                  columns of the weight (default: %d)\n", params.k);
+    fprintf(stderr, "  -n N                  rows of the weight (default: %d)\n", params.n);
+    fprintf(stderr, "  -i N, --iter N        number of iterations (default: %d)\n", params.n_iterations);
+    fprintf(stderr, "\n");
+}
+
+// tile shape of matmul_kernel in ggml-rknpu-re.cpp, for three NPU cores
+static int partition(int num, int max, int align) {
+    int div = (num + max - 1) / max;
+    return ((num + div - 1) / div + align - 1) / align * align;
+}
+
+template <typename F>
+static double time_us(int n_iterations, F && fn) {
+    double best = 1e30;
+    for (int i = 0; i < n_iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::micro> us = std::chrono::steady_clock::now() - start;
+        best = std::min(best, us.count());
+    }
+    return best;
+}
+
+int main(int argc, char ** argv) {
+    relayout_params params;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv, params);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            print_usage(argv, params);
+            return 1;
+        }
+        if (arg == "-k") {
+            params.k = atoi(argv[++i]);
+        } else if (arg == "-n") {
+            params.n = atoi(argv[++i]);
+        } else if (arg == "-i" || arg == "--iter") {
+            params.n_iterations = atoi(argv[++i]);
+        } else {
+            print_usage(argv, params);
+            return 1;
+        }
+    }
+    const int k = params.k;
+    const int n = params.n;
+    if (k <= 0 || n <= 0 || k % 32 || n % 32 || params.n_iterations <= 0) {
+        fprintf(stderr, "error: k and n must be positive multiples of 32\n");
+        return 1;
+    }
+    const int N = partition(n / 3, 4096, 32);
+    const int K = partition(k, 4096, 32);
+    const int tiles_n = (n + N - 1) / N;
+    const int tiles_k = (k + K - 1) / K;
+    printf("weight %d x %d in %d x %d tiles of %d x %d\n", n, k, tiles_n, tiles_k, N, K);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<ggml_fp16_t> f16((size_t)n * k);
+    for (auto & x : f16) {
+        x = ggml_fp32_to_fp16(dist(rng));
+    }
+    // q8_0 blocks: a delta then 32 quants
+    const size_t block_size = sizeof(ggml_fp16_t) + 32;
+    std::vector<uint8_t> q8((size_t)n * k / 32 * block_size);
+    for (size_t b = 0; b < q8.size() / block_size; b++) {
+        ggml_fp16_t d = ggml_fp32_to_fp16(dist(rng) * 0.01f);
+        memcpy(&q8[b * block_size], &d, sizeof(d));
+        for (int t = 0; t < 32; t++) {
+            q8[b * block_size + sizeof(d) + t] = (uint8_t)(int8_t)(rng() % 255 - 127);
+        }
+    }
+
+    std::vector<float> scales(tiles_n * tiles_k);
+    for (int t = 0; t < tiles_n * tiles_k; t++) {
+        float absmax = npu_q8_0_tile_absmax(q8.data(), k, n, K, N, t % tiles_k * K, t / tiles_k * N);
+        scales[t] = std::max(1e-9f, absmax / 127.f);
+    }
+
+    std::vector<uint16_t> f16_ref((size_t)N * K), f16_out((size_t)N * K);
+    std::vector<int8_t> q8_ref((size_t)N * K), q8_out((size_t)N * K);
+    for (int t = 0; t < tiles_n * tiles_k; t++) {
+        const int kk = t % tiles_k * K;
+        const int nn = t / tiles_k * N;
+        npu_pack_fp16_tile_ref(f16_ref.data(), (const uint16_t *)f16.data(), k, n, K, N, kk, nn);
+        npu_pack_fp16_tile(f16_out.data(), (const uint16_t *)f16.data(), k, n, K, N, kk, nn);
+        npu_pack_q8_0_tile_ref(q8_ref.data(), q8.data(), k, n, K, N, kk, nn, scales[t]);
+        npu_pack_q8_0_tile(q8_out.data(), q8.data(), k, n, K, N, kk, nn, scales[t]);
+        if (f16_ref != f16_out || q8_ref != q8_out) {
+            fprintf(stderr, "error: tile %d differs from the reference (%s)\n", t, f16_ref != f16_out ? "fp16" : "q8_0");
+            return 1;
+        }
+    }
+
+    auto pack_all = [&](auto && pack) {
+        return time_us(params.n_iterations, [&] {
+            for (int t = 0; t < tiles_n * tiles_k; t++) {
+                pack(t % tiles_k * K, t / tiles_k * N, t);
+            }
+        });
+    };
+    const double f16_ref_us = pack_all([&](int kk, int nn, int) {
+        npu_pack_fp16_tile_ref(f16_ref.data(), (const uint16_t *)f16.data(), k, n, K, N, kk, nn);
+    });
+    const double f16_us = pack_all([&](int kk, int nn, int) {
+        npu_pack_fp16_tile(f16_out.data(), (const uint16_t *)f16.data(), k, n, K, N, kk, nn);
+    });
+    const double q8_ref_us = pack_all([&](int kk, int nn, int t) {
+        npu_pack_q8_0_tile_ref(q8_ref.data(), q8.data(), k, n, K, N, kk, nn, scales[t]);
+    });
+    const double q8_us = pack_all([&](int kk, int nn, int t) {
+        npu_pack_q8_0_tile(q8_out.data(), q8.data(), k, n, K, N, kk, nn, scales[t]);
+    });
+
+    // bytes per us / 1e3 is GB/s
+    const double f16_kb = f16.size() * sizeof(ggml_fp16_t) / 1e3;
+    const double q8_kb = q8.size() / 1e3;
+    printf("fp16 reference %9.0f us %7.2f GB/s\n", f16_ref_us, f16_kb / f16_ref_us);
+    printf("fp16 packed    %9.0f us %7.2f GB/s %6.1fx\n", f16_us, f16_kb / f16_us, f16_ref_us / f16_us);
+    printf("q8_0 reference %9.0f us %7.2f GB/s\n", q8_ref_us, q8_kb / q8_ref_us);
+    printf("q8_0 packed    %9.0f us %7.2f GB/s %6.1fx\n", q8_us, q8_kb / q8_us, q8_ref_us / q8_us);
+    return 0;
+}
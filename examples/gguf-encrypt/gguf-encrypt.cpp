@@ -0,0 +1,219 @@
+#include "ggml.h"
+#include "crypto.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+struct encrypt_params {
+    size_t chunk_size = CRYPTO_CHUNK_DEFAULT;
+    bool verify = false;
+    std::string input;
+    std::string output;
+};
+
+static void encrypt_print_usage(const char * executable) {
+    const encrypt_params default_params;
+    printf("\n");
+    printf("usage: %s [options] GGUF_IN GGUF_OUT\n", executable);
+    printf("\n");
+    printf("Encrypt the tensor data of IN into an authenticated container OUT.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help              show this help message and exit\n");
+    printf("  --chunk-size N(K|M)     bytes per authenticated chunk (default: %luK)\n", default_params.chunk_size >> 10);
+    printf("  --verify                decrypt OUT again and compare it with IN\n");
+    printf("\n");
+}
+
+static size_t encrypt_str_to_n_bytes(std::string str) {
+    size_t n_bytes = 0;
+    int n;
+    if (str.back() == 'K') {
+        sscanf(str.c_str(), "%d", &n);
+        n_bytes = (size_t)n * 1024;
+    } else if (str.back() == 'M') {
+        sscanf(str.c_str(), "%d", &n);
+        n_bytes = (size_t)n * 1024 * 1024;
+    } else {
+        throw std::invalid_argument("error: supported units are K (kilobytes) and M (megabytes), but got: " + std::string(1, str.back()));
+    }
+    if (n <= 0) {
+        throw std::invalid_argument("error: size must be a positive value");
+    }
+    return n_bytes;
+}
+
+static void encrypt_params_parse(int argc, const char ** argv, encrypt_params & params) {
+    int arg_idx = 1;
+    for (; arg_idx < argc && strncmp(argv[arg_idx], "--", 2) == 0; arg_idx++) {
+        std::string arg = argv[arg_idx];
+        if (arg == "-h" || arg == "--help") {
+            encrypt_print_usage(argv[0]);
+            exit(0);
+        } else if (arg == "--chunk-size") {
+            if (++arg_idx >= argc) {
+                break;
+            }
+            params.chunk_size = encrypt_str_to_n_bytes(argv[arg_idx]);
+        } else if (arg == "--verify") {
+            params.verify = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            encrypt_print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - arg_idx != 2) {
+        encrypt_print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (params.chunk_size < CRYPTO_CHUNK_MIN || params.chunk_size > CRYPTO_CHUNK_MAX || params.chunk_size % 4096) {
+        fprintf(stderr, "error: chunk size must be a multiple of 4K between 64K and 1M\n");
+        exit(EXIT_FAILURE);
+    }
+    params.input = argv[arg_idx++];
+    params.output = argv[arg_idx++];
+}
+
+static size_t n_chunks(size_t n_bytes, size_t chunk_size) {
+    return (n_bytes + chunk_size - 1) / chunk_size;
+}
+
+static void read_at(FILE * f, void * buf, size_t len, size_t off) {
+    if (fseek(f, off, SEEK_SET) != 0 || fread(buf, 1, len, f) != len) {
+        fprintf(stderr, "error: failed to read %zu bytes at offset %zu\n", len, off);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void write_at(FILE * f, const void * buf, size_t len, size_t off) {
+    if (fseek(f, off, SEEK_SET) != 0 || fwrite(buf, 1, len, f) != len) {
+        fprintf(stderr, "error: failed to write %zu bytes at offset %zu\n", len, off);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void gguf_encrypt(const encrypt_params & params) {
+    struct ggml_context * ctx_meta = NULL;
+    struct gguf_init_params init_params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx_meta,
+    };
+    struct gguf_context * ctx_in = gguf_init_from_file(params.input.c_str(), init_params);
+    if (!ctx_in) {
+        fprintf(stderr, "%s: failed to load input GGUF from %s\n", __func__, params.input.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (gguf_find_key(ctx_in, CRYPTO_KV_CIPHER) >= 0) {
+        fprintf(stderr, "%s: %s is already encrypted\n", __func__, params.input.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (gguf_find_key(ctx_in, "split.count") >= 0) {
+        fprintf(stderr, "%s: merge split models with llama-gguf-split --merge first\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char salt[CRYPTO_KEY_SALT_SIZE];
+    crypto_new_key_salt(salt);
+    const int n_tensors = gguf_get_n_tensors(ctx_in);
+
+    // Lay out the header with zeroed tags first: the data offsets feed the
+    // nonces, and filling in the real tags later does not change the size.
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx_in);
+    gguf_set_val_str(ctx_out, CRYPTO_KV_CIPHER, CRYPTO_CIPHER_NAME);
+    gguf_set_val_u32(ctx_out, CRYPTO_KV_CHUNK_SIZE, params.chunk_size);
+    gguf_set_arr_data(ctx_out, CRYPTO_KV_KEY_SALT, GGUF_TYPE_UINT8, salt, sizeof(salt));
+
+    std::vector<std::vector<unsigned char>> tags(n_tensors);
+    for (int i = 0; i < n_tensors; i++) {
+        const char * name = gguf_get_tensor_name(ctx_in, i);
+        struct ggml_tensor * t = ggml_get_tensor(ctx_meta, name);
+        gguf_add_tensor(ctx_out, t);
+        tags[i].resize(n_chunks(ggml_nbytes(t), params.chunk_size) * CRYPTO_GCM_TAG_SIZE);
+        std::string key = std::string(CRYPTO_KV_TAGS) + name;
+        gguf_set_arr_data(ctx_out, key.c_str(), GGUF_TYPE_UINT8, tags[i].data(), tags[i].size());
+    }
+    const size_t meta_size = gguf_get_meta_size(ctx_out);
+
+    FILE * f_in = fopen(params.input.c_str(), "rb");
+    FILE * f_out = fopen(params.output.c_str(), "wb");
+    if (!f_in || !f_out) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, !f_in ? params.input.c_str() : params.output.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    const size_t in_data_off = gguf_get_data_offset(ctx_in);
+    std::vector<unsigned char> plain(params.chunk_size);
+    std::vector<unsigned char> cipher(params.chunk_size);
+    size_t total = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        const char * name = gguf_get_tensor_name(ctx_in, i);
+        const size_t n_bytes = ggml_nbytes(ggml_get_tensor(ctx_meta, name));
+        const size_t src_off = in_data_off + gguf_get_tensor_offset(ctx_in, i);
+        const size_t dst_off = meta_size + gguf_get_tensor_offset(ctx_out, i);
+        for (size_t off = 0; off < n_bytes; off += params.chunk_size) {
+            size_t len = std::min(params.chunk_size, n_bytes - off);
+            read_at(f_in, plain.data(), len, src_off + off);
+            aes_256_gcm_encrypt(cipher.data(), plain.data(), len, dst_off + off, salt,
+                                tags[i].data() + off / params.chunk_size * CRYPTO_GCM_TAG_SIZE);
+            write_at(f_out, cipher.data(), len, dst_off + off);
+        }
+        std::string key = std::string(CRYPTO_KV_TAGS) + name;
+        gguf_set_arr_data(ctx_out, key.c_str(), GGUF_TYPE_UINT8, tags[i].data(), tags[i].size());
+        total += n_bytes;
+        printf("\r%s: encrypted %d/%d tensors", __func__, i + 1, n_tensors);
+        fflush(stdout);
+    }
+    printf("\n");
+
+    GGML_ASSERT(gguf_get_meta_size(ctx_out) == meta_size);
+    std::vector<unsigned char> meta(meta_size);
+    gguf_get_meta_data(ctx_out, meta.data());
+    write_at(f_out, meta.data(), meta_size, 0);
+    fclose(f_out);
+
+    printf("%s: %zu MB in %zu KB chunks written to %s\n", __func__, total >> 20, params.chunk_size >> 10, params.output.c_str());
+
+    if (params.verify) {
+        f_out = fopen(params.output.c_str(), "rb");
+        for (int i = 0; i < n_tensors; i++) {
+            const char * name = gguf_get_tensor_name(ctx_in, i);
+            const size_t n_bytes = ggml_nbytes(ggml_get_tensor(ctx_meta, name));
+            const size_t src_off = in_data_off + gguf_get_tensor_offset(ctx_in, i);
+            const size_t dst_off = meta_size + gguf_get_tensor_offset(ctx_out, i);
+            for (size_t off = 0; off < n_bytes; off += params.chunk_size) {
+                size_t len = std::min(params.chunk_size, n_bytes - off);
+                read_at(f_in, plain.data(), len, src_off + off);
+                read_at(f_out, cipher.data(), len, dst_off + off);
+                const unsigned char * tag = tags[i].data() + off / params.chunk_size * CRYPTO_GCM_TAG_SIZE;
+                if (!aes_256_gcm_decrypt(cipher.data(), cipher.data(), len, dst_off + off, salt, tag) ||
+                    memcmp(cipher.data(), plain.data(), len) != 0) {
+                    fprintf(stderr, "%s: verification failed for %s at offset %zu\n", __func__, name, off);
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        fclose(f_out);
+        printf("%s: verified\n", __func__);
+    }
+
+    fclose(f_in);
+    gguf_free(ctx_out);
+    gguf_free(ctx_in);
+    ggml_free(ctx_meta);
+}
+
+int main(int argc, const char ** argv) {
+    encrypt_params params;
+    encrypt_params_parse(argc, argv, params);
+    gguf_encrypt(params);
+    return 0;
+}
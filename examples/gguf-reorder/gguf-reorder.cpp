@@ -0,0 +1,253 @@
+#include "ggml.h"
+#include "crypto.h"
+#include "stream-order.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+struct reorder_params {
+    // O_DIRECT reads and secure memory both work in whole pages
+    size_t alignment = 4096;
+    bool dry_run = false;
+    std::string order;
+    std::string input;
+    std::string output;
+};
+
+static void reorder_print_usage(const char * executable) {
+    const reorder_params default_params;
+    printf("\n");
+    printf("usage: %s [options] GGUF_IN GGUF_OUT\n", executable);
+    printf("\n");
+    printf("Rewrite IN so its tensors are stored in the order inference first uses them.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help              show this help message and exit\n");
+    printf("  --alignment N(K|M)      alignment of every tensor's data (default: %luK)\n", default_params.alignment >> 10);
+    printf("  --order FILE            tensor names, one per line, stored first in that order\n");
+    printf("  --dry-run               only report how many tensors would move\n");
+    printf("\n");
+}
+
+static size_t reorder_str_to_n_bytes(std::string str) {
+    size_t n_bytes = 0;
+    int n;
+    if (str.back() == 'K') {
+        sscanf(str.c_str(), "%d", &n);
+        n_bytes = (size_t)n * 1024;
+    } else if (str.back() == 'M') {
+        sscanf(str.c_str(), "%d", &n);
+        n_bytes = (size_t)n * 1024 * 1024;
+    } else {
+        throw std::invalid_argument("error: supported units are K (kilobytes) and M (megabytes), but got: " + std::string(1, str.back()));
+    }
+    if (n <= 0) {
+        throw std::invalid_argument("error: size must be a positive value");
+    }
+    return n_bytes;
+}
+
+static void reorder_params_parse(int argc, const char ** argv, reorder_params & params) {
+    int arg_idx = 1;
+    for (; arg_idx < argc && strncmp(argv[arg_idx], "--", 2) == 0; arg_idx++) {
+        std::string arg = argv[arg_idx];
+        if (arg == "-h" || arg == "--help") {
+            reorder_print_usage(argv[0]);
+            exit(0);
+        } else if (arg == "--alignment") {
+            if (++arg_idx >= argc) {
+                break;
+            }
+            params.alignment = reorder_str_to_n_bytes(argv[arg_idx]);
+        } else if (arg == "--order") {
+            if (++arg_idx >= argc) {
+                break;
+            }
+            params.order = argv[arg_idx];
+        } else if (arg == "--dry-run") {
+            params.dry_run = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            reorder_print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - arg_idx != 2) {
+        reorder_print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (params.alignment & (params.alignment - 1)) {
+        fprintf(stderr, "error: alignment must be a power of two\n");
+        exit(EXIT_FAILURE);
+    }
+    params.input = argv[arg_idx++];
+    params.output = argv[arg_idx++];
+}
+
+static void read_at(FILE * f, void * buf, size_t len, size_t off) {
+    if (fseek(f, off, SEEK_SET) != 0 || fread(buf, 1, len, f) != len) {
+        fprintf(stderr, "error: failed to read %zu bytes at offset %zu\n", len, off);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void write_at(FILE * f, const void * buf, size_t len, size_t off) {
+    if (fseek(f, off, SEEK_SET) != 0 || fwrite(buf, 1, len, f) != len) {
+        fprintf(stderr, "error: failed to write %zu bytes at offset %zu\n", len, off);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// tensor indices of ctx_in in the order they should be stored
+static std::vector<int> reorder_plan(const reorder_params & params, struct gguf_context * ctx_in) {
+    const int n_tensors = gguf_get_n_tensors(ctx_in);
+
+    // names from --order go first, the rest by first use
+    std::map<std::string, int> listed;
+    if (!params.order.empty()) {
+        std::ifstream f(params.order);
+        if (!f) {
+            fprintf(stderr, "%s: failed to open %s\n", __func__, params.order.c_str());
+            exit(EXIT_FAILURE);
+        }
+        std::string name;
+        while (std::getline(f, name)) {
+            if (name.empty() || listed.count(name)) {
+                continue;
+            }
+            if (gguf_find_tensor(ctx_in, name.c_str()) < 0) {
+                fprintf(stderr, "%s: %s is not a tensor of %s\n", __func__, name.c_str(), params.input.c_str());
+                exit(EXIT_FAILURE);
+            }
+            const int pos = listed.size();
+            listed[name] = pos;
+        }
+    }
+
+    std::vector<std::pair<int64_t, int>> ranks;
+    for (int i = 0; i < n_tensors; i++) {
+        const char * name = gguf_get_tensor_name(ctx_in, i);
+        auto it = listed.find(name);
+        ranks.emplace_back(it != listed.end() ? INT64_MIN + it->second : stream_order_rank(name), i);
+    }
+    std::stable_sort(ranks.begin(), ranks.end(), [](const auto & a, const auto & b) { return a.first < b.first; });
+
+    std::vector<int> order;
+    for (auto & rank : ranks) {
+        order.push_back(rank.second);
+    }
+    return order;
+}
+
+static void gguf_reorder(const reorder_params & params) {
+    struct ggml_context * ctx_meta = NULL;
+    struct gguf_init_params init_params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx_meta,
+    };
+    struct gguf_context * ctx_in = gguf_init_from_file(params.input.c_str(), init_params);
+    if (!ctx_in) {
+        fprintf(stderr, "%s: failed to load input GGUF from %s\n", __func__, params.input.c_str());
+        exit(EXIT_FAILURE);
+    }
+    // chunk nonces are bound to file offsets, so moving data breaks them
+    if (gguf_find_key(ctx_in, CRYPTO_KV_CIPHER) >= 0) {
+        fprintf(stderr, "%s: %s is encrypted, reorder the plain model before llama-gguf-encrypt\n", __func__, params.input.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (gguf_find_key(ctx_in, "split.count") >= 0) {
+        fprintf(stderr, "%s: merge split models with llama-gguf-split --merge first\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+
+    const int n_tensors = gguf_get_n_tensors(ctx_in);
+    const std::vector<int> order = reorder_plan(params, ctx_in);
+    int n_moved = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        n_moved += order[i] != i;
+    }
+    printf("%s: %d of %d tensors move\n", __func__, n_moved, n_tensors);
+    if (params.dry_run) {
+        for (int i = 0; i < n_tensors; i++) {
+            printf("%5d %5d %s\n", i, order[i], gguf_get_tensor_name(ctx_in, order[i]));
+        }
+        gguf_free(ctx_in);
+        ggml_free(ctx_meta);
+        return;
+    }
+
+    struct gguf_context * ctx_out = gguf_init_empty();
+    gguf_set_kv(ctx_out, ctx_in);
+    // before any tensor is added, the offsets follow it
+    gguf_set_val_u32(ctx_out, "general.alignment", params.alignment);
+    for (int i : order) {
+        gguf_add_tensor(ctx_out, ggml_get_tensor(ctx_meta, gguf_get_tensor_name(ctx_in, i)));
+    }
+    // the data section starts on the alignment too, and so does the file
+    const size_t meta_size = gguf_get_meta_size(ctx_out);
+
+    FILE * f_in = fopen(params.input.c_str(), "rb");
+    FILE * f_out = fopen(params.output.c_str(), "wb");
+    if (!f_in || !f_out) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, !f_in ? params.input.c_str() : params.output.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    const size_t in_data_off = gguf_get_data_offset(ctx_in);
+    const size_t copy_size = 4 * 1024 * 1024;
+    std::vector<unsigned char> buf(copy_size);
+    size_t total = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        const int src = order[i];
+        const size_t n_bytes = ggml_nbytes(ggml_get_tensor(ctx_meta, gguf_get_tensor_name(ctx_in, src)));
+        const size_t src_off = in_data_off + gguf_get_tensor_offset(ctx_in, src);
+        const size_t dst_off = meta_size + gguf_get_tensor_offset(ctx_out, i);
+        for (size_t off = 0; off < n_bytes; off += copy_size) {
+            size_t len = std::min(copy_size, n_bytes - off);
+            read_at(f_in, buf.data(), len, src_off + off);
+            write_at(f_out, buf.data(), len, dst_off + off);
+        }
+        total += n_bytes;
+        printf("\r%s: copied %d/%d tensors", __func__, i + 1, n_tensors);
+        fflush(stdout);
+    }
+    printf("\n");
+
+    std::vector<unsigned char> meta(meta_size);
+    gguf_get_meta_data(ctx_out, meta.data());
+    write_at(f_out, meta.data(), meta_size, 0);
+    // pad the last tensor so the file ends on the alignment as well
+    if (n_tensors > 0) {
+        const size_t end = meta_size + gguf_get_tensor_offset(ctx_out, n_tensors - 1) +
+                           ggml_nbytes(ggml_get_tensor(ctx_meta, gguf_get_tensor_name(ctx_in, order.back())));
+        const size_t padded = GGML_PAD(end, params.alignment);
+        if (padded > end) {
+            std::vector<unsigned char> zero(padded - end, 0);
+            write_at(f_out, zero.data(), zero.size(), end);
+        }
+    }
+    fclose(f_out);
+    fclose(f_in);
+
+    printf("%s: %zu MB aligned to %zu KB written to %s\n", __func__, total >> 20, params.alignment >> 10, params.output.c_str());
+
+    gguf_free(ctx_out);
+    gguf_free(ctx_in);
+    ggml_free(ctx_meta);
+}
+
+int main(int argc, const char ** argv) {
+    reorder_params params;
+    reorder_params_parse(argc, argv, params);
+    gguf_reorder(params);
+    return 0;
+}
@@ -32,6 +32,10 @@
 #pragma warning(disable : 4244 4267) // possible loss of data
 #endif
 
+// live in libllama, declared here with C++ linkage
+void reset_param_tensor(void);
+void trace_export(void);
+
 static llama_context **g_ctx;
 static llama_model **g_model;
 static gpt_sampler **g_smpl;
@@ -1154,6 +1158,7 @@ ret:
   gpt_perf_print(ctx, smpl);
   write_logfile(ctx, params, model, input_tokens, output_ss.str(),
                 output_tokens);
+  trace_export();
 
   gpt_sampler_free(smpl);
 
@@ -1168,6 +1173,250 @@ ret:
   return __LINE__;
 }
 
+// A session keeps everything infer() builds and tears down per call: the
+// model, the context with its KV cache, the threadpools and the sampler.
+// Tokens already in the KV cache are remembered, so a run only evaluates the
+// part of its prompt after the prefix it shares with the previous run.
+struct infer_session {
+  gpt_params params;
+  llama_model *model = nullptr;
+  llama_context *ctx = nullptr;
+  gpt_sampler *smpl = nullptr;
+  struct ggml_threadpool *threadpool = nullptr;
+  struct ggml_threadpool *threadpool_batch = nullptr;
+
+  // tokens whose KV entries are in ctx, in position order
+  std::vector<llama_token> cached;
+
+  int64_t create_us = 0;
+  int n_run = 0;
+  int64_t cold_ttft_us = 0;
+  int64_t warm_ttft_us = 0;
+  size_t reused_nr = 0;
+  size_t prompt_nr = 0;
+};
+
+static void infer_session_free(infer_session *s) {
+  if (s->smpl)
+    gpt_sampler_free(s->smpl);
+  if (s->ctx)
+    llama_free(s->ctx);
+  if (s->model)
+    llama_free_model(s->model);
+  llama_backend_free();
+  if (s->threadpool)
+    ggml_threadpool_free(s->threadpool);
+  if (s->threadpool_batch)
+    ggml_threadpool_free(s->threadpool_batch);
+  delete s;
+}
+
+struct infer_session *infer_session_create(int argc, char **argv) {
+  const int64_t start = ggml_time_us();
+  infer_session *s = new infer_session;
+  gpt_params &params = s->params;
+  g_params = &params;
+  if (!gpt_params_parse(argc, argv, params, LLAMA_EXAMPLE_MAIN, print_usage)) {
+    delete s;
+    return nullptr;
+  }
+
+  gpt_init();
+
+  if (params.n_ctx != 0 && params.n_ctx < 8) {
+    LOG_WRN("%s: warning: minimum context size is 8, using minimum size.\n",
+            __func__);
+    params.n_ctx = 8;
+  }
+
+  llama_backend_init();
+  llama_numa_init(params.numa);
+
+  llama_init_result llama_init = llama_init_from_gpt_params(params);
+  s->model = llama_init.model;
+  s->ctx = llama_init.context;
+  if (s->model == NULL) {
+    LOG_ERR("%s: error: unable to load model\n", __func__);
+    infer_session_free(s);
+    return nullptr;
+  }
+  if (llama_model_has_encoder(s->model)) {
+    // the encoder output depends on the whole prompt, nothing to reuse
+    LOG_ERR("%s: encoder-decoder models are not supported\n", __func__);
+    infer_session_free(s);
+    return nullptr;
+  }
+
+  struct ggml_threadpool_params tpp_batch =
+      ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+  struct ggml_threadpool_params tpp =
+      ggml_threadpool_params_from_cpu_params(params.cpuparams);
+
+  set_process_priority(params.cpuparams.priority);
+
+  if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
+    s->threadpool_batch = ggml_threadpool_new(&tpp_batch);
+    if (!s->threadpool_batch) {
+      LOG_ERR("%s: batch threadpool create failed : n_threads %d\n", __func__,
+              tpp_batch.n_threads);
+      infer_session_free(s);
+      return nullptr;
+    }
+    tpp.paused = true;
+  }
+  s->threadpool = ggml_threadpool_new(&tpp);
+  if (!s->threadpool) {
+    LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__,
+            tpp.n_threads);
+    infer_session_free(s);
+    return nullptr;
+  }
+  llama_attach_threadpool(s->ctx, s->threadpool, s->threadpool_batch);
+
+  s->smpl = gpt_sampler_init(s->model, params.sparams);
+  if (!s->smpl) {
+    LOG_ERR("%s: failed to initialize sampling subsystem\n", __func__);
+    infer_session_free(s);
+    return nullptr;
+  }
+
+  s->create_us = ggml_time_us() - start;
+  LOG_INF("%s: session ready in %ld us, n_ctx = %d\n", __func__, s->create_us,
+          llama_n_ctx(s->ctx));
+  return s;
+}
+
+// the prompt of one run: the system prompt and the input as a single turn
+static std::vector<llama_token> session_prompt(infer_session *s,
+                                               const std::string &input) {
+  const gpt_params &params = s->params;
+  bool format_chat = params.conversation && params.enable_chat_template;
+  if (format_chat) {
+    std::vector<llama_chat_msg> msgs;
+    if (!params.prompt.empty())
+      msgs.push_back({"system", params.prompt});
+    msgs.push_back({"user", input});
+    auto formatted = llama_chat_apply_template(s->model, params.chat_template,
+                                               msgs, true);
+    return ::llama_tokenize(s->ctx, formatted, true, true);
+  }
+  auto tokens = ::llama_tokenize(s->ctx, params.prompt, true, true);
+  auto line_pfx = ::llama_tokenize(s->ctx, params.input_prefix, false, true);
+  auto line_inp = ::llama_tokenize(s->ctx, input, false, false);
+  auto line_sfx = ::llama_tokenize(s->ctx, params.input_suffix, false, true);
+  tokens.insert(tokens.end(), line_pfx.begin(), line_pfx.end());
+  tokens.insert(tokens.end(), line_inp.begin(), line_inp.end());
+  tokens.insert(tokens.end(), line_sfx.begin(), line_sfx.end());
+  return tokens;
+}
+
+int infer_session_run(struct infer_session *s, char *input, size_t input_len,
+                      char *output, size_t output_len) {
+  const gpt_params &params = s->params;
+  const int n_ctx = llama_n_ctx(s->ctx);
+  const int64_t ttft_start = ggml_time_us();
+
+  // let the weights stream again for the next request, whichever way this
+  // one ends
+  struct reset_guard {
+    ~reset_guard() { reset_param_tensor(); }
+  } reset;
+
+  std::string buffer(input, strnlen(input, input_len));
+  if (params.escape)
+    string_process_escapes(buffer);
+  auto prompt = session_prompt(s, buffer);
+  if (prompt.empty() || (int)prompt.size() > n_ctx - 4) {
+    LOG_ERR("%s: prompt is empty or too long (%zu tokens, max %d)\n", __func__,
+            prompt.size(), n_ctx - 4);
+    return 1;
+  }
+
+  // keep the shared prefix, but always evaluate the last prompt token so
+  // there are logits to sample from
+  size_t n_reuse = 0;
+  while (n_reuse < s->cached.size() && n_reuse < prompt.size() &&
+         s->cached[n_reuse] == prompt[n_reuse])
+    n_reuse++;
+  n_reuse = std::min(n_reuse, prompt.size() - 1);
+  llama_kv_cache_seq_rm(s->ctx, 0, n_reuse, -1);
+  s->cached.resize(n_reuse);
+
+  gpt_sampler_reset(s->smpl);
+  for (auto id : prompt)
+    gpt_sampler_accept(s->smpl, id, /* accept_grammar= */ false);
+
+  for (size_t i = n_reuse; i < prompt.size(); i += params.n_batch) {
+    int n_eval = std::min((int)(prompt.size() - i), params.n_batch);
+    if (llama_decode(s->ctx, llama_batch_get_one(&prompt[i], n_eval,
+                                                 s->cached.size(), 0))) {
+      LOG_ERR("%s : failed to eval\n", __func__);
+      // the cache may hold part of the batch, start over next time
+      llama_kv_cache_clear(s->ctx);
+      s->cached.clear();
+      return 1;
+    }
+    s->cached.insert(s->cached.end(), &prompt[i], &prompt[i] + n_eval);
+  }
+
+  std::string out;
+  int n_remain = params.n_predict;
+  int64_t ttft = -1;
+  while (n_remain != 0 && (int)s->cached.size() < n_ctx) {
+    llama_token id = gpt_sampler_sample(s->smpl, s->ctx, -1);
+    gpt_sampler_accept(s->smpl, id, /* accept_grammar= */ true);
+    if (ttft < 0)
+      ttft = ggml_time_us() - ttft_start;
+    if (llama_token_is_eog(s->model, id))
+      break;
+    out += llama_token_to_piece(s->ctx, id, params.special);
+    n_remain--;
+
+    if (llama_decode(s->ctx,
+                     llama_batch_get_one(&id, 1, s->cached.size(), 0))) {
+      LOG_ERR("%s : failed to eval\n", __func__);
+      llama_kv_cache_clear(s->ctx);
+      s->cached.clear();
+      return 1;
+    }
+    s->cached.push_back(id);
+  }
+
+  if (output_len > 0) {
+    std::strncpy(output, out.c_str(), output_len - 1);
+    output[output_len - 1] = '\0';
+  }
+
+  bool cold = s->n_run++ == 0;
+  if (cold)
+    s->cold_ttft_us = ttft;
+  else
+    s->warm_ttft_us += ttft;
+  s->reused_nr += n_reuse;
+  s->prompt_nr += prompt.size();
+  LOG("\nlcf: time to first token: %ld us (%s, %zu of %zu prompt tokens "
+      "reused)\n",
+      ttft, cold ? "cold" : "warm", n_reuse, prompt.size());
+  if (cold)
+    LOG("lcf: time to first token with startup: %ld us\n",
+        ttft + s->create_us);
+  return 0;
+}
+
+void infer_session_destroy(struct infer_session *s) {
+  if (!s)
+    return;
+  if (s->n_run > 1)
+    LOG_INF("%s: %d runs, ttft cold %.2f ms (+%.2f ms startup), warm avg "
+            "%.2f ms, %zu of %zu prompt tokens reused\n",
+            __func__, s->n_run, s->cold_ttft_us / 1e3, s->create_us / 1e3,
+            s->warm_ttft_us / 1e3 / (s->n_run - 1), s->reused_nr,
+            s->prompt_nr);
+  gpt_perf_print(s->ctx, s->smpl);
+  trace_export();
+  infer_session_free(s);
+}
+
 #ifdef __cplusplus
 }
 #endif
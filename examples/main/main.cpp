@@ -196,7 +196,12 @@ int main(int argc, char **argv)
     printf("Main thread is waiting for smc\n");
     usys_tee_wait_switch_req(&req);
     printf("Main thread is awaken from smc\n");
-    params.cache = std::stoi(std::string(task_queue->cache_p));
+    std::string cache_p(task_queue->cache_p);
+    // "N%" asks for a percentage instead of fifths
+    if (!cache_p.empty() && cache_p.back() == '%')
+        params.cache_percent = std::stoi(cache_p);
+    else
+        params.cache = std::stoi(cache_p);
     parse_prompt(params, std::string(task_queue->prompt));
     params.model = std::string(task_queue->inner_model_path);
     params.n_predict = std::stoi(std::string(task_queue->n));
@@ -211,7 +216,11 @@ int main(int argc, char **argv)
     extern void set_io_model_path(const char *io_model_path);
     set_io_model_path(params.io_model_path.c_str());
     extern void set_cache_proportion(int p);
-    set_cache_proportion(params.cache);
+    extern void set_cache_percent(int p);
+    if (params.cache_percent >= 0)
+        set_cache_percent(params.cache_percent);
+    else
+        set_cache_proportion(params.cache);
 
     std::cout << "before gpt_init" << std::endl;
     gpt_init();
@@ -1222,6 +1231,8 @@ int main(int argc, char **argv)
     gpt_perf_print(ctx, smpl);
     write_logfile(
         ctx, params, model, input_tokens, output_ss.str(), output_tokens);
+    extern void trace_export(void);
+    trace_export();
 
     gpt_sampler_free(smpl);
 
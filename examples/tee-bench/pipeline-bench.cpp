@@ -0,0 +1,81 @@
+// Streams every tensor of a GGUF model through the Alloc/IO/Decrypt pipeline
+// and reports weight-load throughput. Build with -DLLAMA_TEE_EMULATION=ON (or
+// run with LLAMA_TEE_EMULATION=1) to use it without the board.
+#include "ggml.h"
+#include "prefetch.h"
+#include "interface.h"
+#include "crypto.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+extern "C" void use_param_tensor(ggml_tensor *tensor, int ith);
+extern void set_io_model_path(const char *io_model_path);
+extern void set_cache_proportion(int p);
+extern void clear_measure(void);
+extern void dump_measure(void);
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.gguf [repeat]\n", argv[0]);
+        return 1;
+    }
+    const char *fname = argv[1];
+    const int repeat = argc > 2 ? atoi(argv[2]) : 3;
+
+    struct ggml_context *ctx = NULL;
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx,
+    };
+    struct gguf_context *gguf = gguf_init_from_file(fname, params);
+    if (!gguf) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, fname);
+        return 1;
+    }
+
+    // as the model loader does, so encrypted containers get verified
+    crypto_load_container(gguf);
+    set_io_model_path(fname);
+    set_cache_proportion(0);
+
+    const size_t data_off = gguf_get_data_offset(gguf);
+    const int n_tensors = gguf_get_n_tensors(gguf);
+    std::vector<ggml_tensor *> tensors;
+    size_t total = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        ggml_tensor *tensor = ggml_get_tensor(ctx, gguf_get_tensor_name(gguf, i));
+        GGML_ASSERT(tensor);
+        record_tensor_size(ggml_nbytes(tensor));
+        total += ggml_nbytes(tensor);
+        tensors.push_back(tensor);
+    }
+    for (int i = 0; i < n_tensors; i++) {
+        register_param_tensor(tensors[i], data_off + gguf_get_tensor_offset(gguf, i), ggml_nbytes(tensors[i]), -1);
+    }
+
+    printf("%s: %d tensors, %.2f MB\n", __func__, n_tensors, total / 1024.0 / 1024.0);
+    for (int r = 0; r < repeat; r++) {
+        if (r > 0) {
+            reset_param_tensor();
+        }
+        clear_measure();
+        auto start = get_micro();
+        int64_t first = -1;
+        for (auto tensor : tensors) {
+            use_param_tensor(tensor, 0);
+            if (first < 0) {
+                first = get_micro() - start;
+            }
+        }
+        auto elapsed = get_micro() - start;
+        printf("run %d: first tensor %.2f ms, all %.2f ms, %.2f GB/s\n",
+               r, first / 1000.0, elapsed / 1000.0, 1e-3 * total / elapsed);
+        dump_measure();
+    }
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Measures the REE<->TEE command queue between two processes sharing
+// CMD_QUEUE_SHM_NAME: the parent pushes io_tasks, the child echoes each one
+// back as an io_result, and the parent reports ops/s and round-trip latency.
+#include "interface.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sched.h>
+#include <sys/wait.h>
+
+static uint64_t get_nano(void) {
+    auto now = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+}
+
+static void echo_loop(void) {
+    auto queue = (all_ring_buffer *)shm_client(CMD_QUEUE_SHM_NAME, CMD_QUEUE_SHM_SIZE);
+    io_task tasks[IO_BATCH_SIZE];
+    io_result results[IO_BATCH_SIZE];
+    while (true) {
+        int n = queue->io_tasks.consume_batch(tasks, IO_BATCH_SIZE);
+        if (n == 0) {
+            sched_yield();
+        }
+        for (int i = 0; i < n; i++) {
+            if (tasks[i].is_measurement) {
+                return;
+            }
+            results[i].pipeline = (void *)tasks[i].io_seg.off;
+        }
+        int done = 0;
+        while (done < n) {
+            done += queue->io_results.produce_batch(results + done, n - done);
+        }
+    }
+}
+
+static void run(all_ring_buffer *queue, int n_ops, int batch, int window) {
+    std::vector<uint64_t> lat;
+    lat.reserve(n_ops);
+    std::vector<io_task> tasks(batch);
+    io_result results[IO_BATCH_SIZE];
+
+    int sent = 0;
+    auto start = get_nano();
+    while ((int)lat.size() < n_ops) {
+        if (sent < n_ops && sent - (int)lat.size() + batch <= window) {
+            int n = std::min(batch, n_ops - sent);
+            uint64_t now = get_nano();
+            for (int i = 0; i < n; i++) {
+                tasks[i] = {};
+                tasks[i].io_seg.off = now;
+            }
+            int done = 0;
+            while (done < n) {
+                done += queue->io_tasks.produce_batch(tasks.data() + done, n - done);
+            }
+            sent += n;
+        }
+        int n = queue->io_results.consume_batch(results, IO_BATCH_SIZE);
+        if (n == 0) {
+            sched_yield();
+        }
+        uint64_t now = get_nano();
+        for (int i = 0; i < n; i++) {
+            lat.push_back(now - (uint64_t)results[i].pipeline);
+        }
+    }
+    double elapsed = (get_nano() - start) * 1e-9;
+
+    std::sort(lat.begin(), lat.end());
+    printf("batch %3d window %4d: %10.0f ops/s, latency p50 %6.2f us p99 %6.2f us max %8.2f us\n",
+           batch, window, n_ops / elapsed,
+           lat[lat.size() / 2] * 1e-3, lat[lat.size() * 99 / 100] * 1e-3, lat.back() * 1e-3);
+}
+
+int main(int argc, char **argv) {
+    const int n_ops = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    auto queue = (all_ring_buffer *)shm_server(CMD_QUEUE_SHM_NAME, CMD_QUEUE_SHM_SIZE);
+    queue->init();
+
+    pid_t pid = fork();
+    GGML_ASSERT(pid >= 0);
+    if (pid == 0) {
+        echo_loop();
+        return 0;
+    }
+
+    // ping-pong first, then increasingly deep pipelines
+    run(queue, n_ops / 10, 1, 1);
+    for (int batch : {1, 8, IO_BATCH_SIZE}) {
+        run(queue, n_ops, batch, 1024);
+    }
+
+    io_task stop = {};
+    stop.is_measurement = true;
+    queue->io_tasks.produce(&stop);
+    waitpid(pid, NULL, 0);
+    shm_unlink(CMD_QUEUE_SHM_NAME);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Streams a GGUF model through the Alloc/IO/Decrypt pipeline while 1..N
+// threads step the scheduler, the way compute threads do from ggml's
+// barriers, and reports scheduled tasks/s for every thread count. A small
+// LLAMA_DECRYPT_CHUNK_KB (e.g. 64) makes tasks short so the scheduler itself
+// becomes the bottleneck.
+#include "ggml.h"
+#include "prefetch.h"
+#include "interface.h"
+#include "crypto.h"
+#include "pipeline.h"
+#include "pipeline-workers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+extern "C" void use_param_tensor(ggml_tensor *tensor, int ith);
+extern void set_io_model_path(const char *io_model_path);
+extern void set_cache_proportion(int p);
+extern void reset_param_tensor(void);
+extern void clear_measure(void);
+extern Scheduler *sched;
+
+static void run(const std::vector<ggml_tensor *> &tensors, size_t total, int n_threads, int repeat) {
+    double best_rate = 0, best_bw = 0;
+    for (int r = 0; r < repeat; r++) {
+        reset_param_tensor();
+        clear_measure();
+        std::atomic<bool> done(false);
+        std::vector<std::thread> helpers;
+        auto start = get_micro();
+        for (int i = 1; i < n_threads; i++) {
+            helpers.emplace_back([&done] {
+                while (!done.load(std::memory_order_relaxed))
+                    sched->step();
+            });
+        }
+        for (auto tensor : tensors)
+            use_param_tensor(tensor, 0);
+        auto elapsed = get_micro() - start;
+        done = true;
+        for (auto &helper : helpers)
+            helper.join();
+        best_rate = std::max(best_rate, 1e6 * pipeline_tasks_run() / elapsed);
+        best_bw = std::max(best_bw, 1e-3 * total / elapsed);
+    }
+    printf("threads %2d: %10.0f tasks/s, %.2f GB/s\n", n_threads, best_rate, best_bw);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s model.gguf [max threads] [repeat]\n", argv[0]);
+        return 1;
+    }
+    const char *fname = argv[1];
+    const int max_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    const int repeat = argc > 3 ? atoi(argv[3]) : 3;
+
+    struct ggml_context *ctx = NULL;
+    struct gguf_init_params params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx,
+    };
+    struct gguf_context *gguf = gguf_init_from_file(fname, params);
+    if (!gguf) {
+        fprintf(stderr, "%s: failed to load %s\n", __func__, fname);
+        return 1;
+    }
+    crypto_load_container(gguf);
+
+    set_io_model_path(fname);
+    set_cache_proportion(0);
+
+    const size_t data_off = gguf_get_data_offset(gguf);
+    const int n_tensors = gguf_get_n_tensors(gguf);
+    std::vector<ggml_tensor *> tensors;
+    size_t total = 0;
+    for (int i = 0; i < n_tensors; i++) {
+        ggml_tensor *tensor = ggml_get_tensor(ctx, gguf_get_tensor_name(gguf, i));
+        GGML_ASSERT(tensor);
+        record_tensor_size(ggml_nbytes(tensor));
+        total += ggml_nbytes(tensor);
+        tensors.push_back(tensor);
+    }
+    for (int i = 0; i < n_tensors; i++) {
+        register_param_tensor(tensors[i], data_off + gguf_get_tensor_offset(gguf, i), ggml_nbytes(tensors[i]), -1);
+    }
+    // warm up the page cache and the task pools
+    for (auto tensor : tensors)
+        use_param_tensor(tensor, 0);
+
+    printf("%s: %d tensors, %.2f MB, decrypt chunk %zu KB\n", __func__, n_tensors, total / 1024.0 / 1024.0,
+           crypto_chunk_size() / 1024);
+    for (int n_threads = 1; n_threads < max_threads; n_threads *= 2)
+        run(tensors, total, n_threads, repeat);
+    run(tensors, total, std::max(max_threads, 1), repeat);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+    return 0;
+}
@@ -17,6 +17,16 @@ GGML_API GGML_CALL void ggml_backend_rknpu2_set_n_threads(ggml_backend_t backend
 int ggml_rknpure_can_mul_mat_b(const ggml_tensor * tensor);
 int ggml_rknpure_transform_tensor(const void * data, ggml_tensor * tensor, size_t offset, size_t size);
 void ggml_rknpu2_transform_tensor_back(void * data, const ggml_tensor * tensor, size_t offset, size_t size);
+// Pack a weight into the NPU layout once, off the compute path. begin returns
+// the number of tiles, 0 if the NPU never reads the tensor. Tiles may be packed
+// concurrently from the decrypted data; end makes them visible to matmuls and
+// drop frees them when the tensor is evicted. size is the host memory the
+// packed copy takes on top of the weight, 0 if it is never packed.
+size_t ggml_rknpure_relayout_size(const struct ggml_tensor * weight);
+int  ggml_rknpure_relayout_begin(const struct ggml_tensor * weight);
+void ggml_rknpure_relayout_tile(const struct ggml_tensor * weight, const void * data, int tile);
+void ggml_rknpure_relayout_end(const struct ggml_tensor * weight);
+void ggml_rknpure_relayout_drop(const struct ggml_tensor * weight);
 // pinned host buffer for use with the CPU backend for faster copies between CPU and GPU
 GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_rknpu2_host_buffer_type(void);
 GGML_API GGML_CALL ggml_backend_buffer_type_t ggml_backend_rknpure_buffer_type(int32_t dev_num);
@@ -2531,6 +2531,10 @@ extern "C" {
 
     GGML_API void ggml_set_polling_routine(void (*routine)(void));
 
+    // accelerator's learned share of the rows of a MUL_MAT of src1 m x k by src0 n x k
+    // (GGML_MUL_MAT_SPLIT=auto), or -1 if the shape has not run yet
+    GGML_API float ggml_mul_mat_split_share(int64_t m, int64_t k, int64_t n, enum ggml_type type);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -13,6 +13,7 @@
 #include <condition_variable>
 #include <unordered_map>
 #include <map>
+#include <list>
 
 #include <chrono>
 #include <queue>
@@ -103,6 +104,8 @@ void ggml_rknpu_dump_measure(void) {
 #include <ggml-rknpu-re/rknpu-ioctl.h>
 #include <ggml-rknpu-re/npu_interface.h>
 #include <ggml-rknpu-re/npu_matmul.h>
+#include <ggml-rknpu-re/npu_relayout.h>
+#include <ggml-rknpu-re/npu_jobq.h>
 #ifdef USE_CPU_CHECK
 #include <ggml-rknpu-re/matmul_cpu_check.h>
 #endif
@@ -926,6 +929,7 @@ struct A_bufs {
             for (int kk = 0; kk < k; kk += K)
                 As.emplace(std::make_tuple(mm, kk), std::make_shared<rknn_mem>(A_buf_size));
     }
+    size_t bytes(void) const { return As.size() * A_buf_size; }
 };
 struct B_bufs {
     int K, N, k, n;
@@ -938,6 +942,7 @@ struct B_bufs {
             for (int kk = 0; kk < k; kk += K)
                 Bs.emplace(std::make_tuple(nn, kk), std::make_shared<rknn_mem>(B_buf_size));
     }
+    size_t bytes(void) const { return Bs.size() * B_buf_size; }
 };
 struct C_bufs {
     int M, K, N, m, k, n;
@@ -951,50 +956,53 @@ struct C_bufs {
                 for (int kk = 0; kk < k; kk += K)
                     Cs.emplace(std::make_tuple(mm, nn, kk), std::make_shared<rknn_mem>(C_buf_size));
     }
+    size_t bytes(void) const { return Cs.size() * C_buf_size; }
 };
 
+// Buffer sets are shared by the plans of the same (m, k) or (m, k, n) and
+// freed with the last plan using them, see matmul_plan_cache.
 struct matmul_buffer_mgr {
-    std::map<std::tuple<int, int, int, int, rknn_tensor_type>, std::shared_ptr<A_bufs>> A_map;
-    std::map<std::tuple<int, int, int, int, rknn_tensor_type>, std::shared_ptr<B_bufs>> B_map;
-    std::map<std::tuple<int, int, int, int, int, int, rknn_tensor_type>, std::shared_ptr<C_bufs>> C_map;
-
-    std::shared_ptr<A_bufs> get_A_bufs(int M, int K, int m, int k, rknn_tensor_type type) {
-        auto A_bufs_iter = A_map.find(std::make_tuple(M, K, m, k, type));
-        std::shared_ptr<A_bufs> ret;
-        if (A_bufs_iter == A_map.end()) {
-            ret = std::make_shared<A_bufs>(M, K, m, k, type);
-            A_map.emplace(std::make_tuple(M, K, m, k, type), ret);
-        } else {
-            ret = A_bufs_iter->second;
+    std::map<std::tuple<int, int, int, int, rknn_tensor_type>, std::weak_ptr<A_bufs>> A_map;
+    std::map<std::tuple<int, int, int, int, rknn_tensor_type>, std::weak_ptr<B_bufs>> B_map;
+    std::map<std::tuple<int, int, int, int, int, int, rknn_tensor_type>, std::weak_ptr<C_bufs>> C_map;
+
+    template <typename Map, typename Key, typename... Args>
+    static std::shared_ptr<typename Map::mapped_type::element_type> get(Map &map, const Key &key, Args... args) {
+        auto ret = map[key].lock();
+        if (!ret) {
+            ret = std::make_shared<typename Map::mapped_type::element_type>(args...);
+            map[key] = ret;
         }
         return ret;
     }
+    std::shared_ptr<A_bufs> get_A_bufs(int M, int K, int m, int k, rknn_tensor_type type) {
+        return get(A_map, std::make_tuple(M, K, m, k, type), M, K, m, k, type);
+    }
     std::shared_ptr<B_bufs> get_B_bufs(int K, int N, int k, int n, rknn_tensor_type type) {
-        auto B_bufs_iter = B_map.find(std::make_tuple(K, N, k, n, type));
-        std::shared_ptr<B_bufs> ret;
-        if (B_bufs_iter == B_map.end()) {
-            ret = std::make_shared<B_bufs>(K, N, k, n, type);
-            B_map.emplace(std::make_tuple(K, N, k, n, type), ret);
-        } else {
-            ret = B_bufs_iter->second;
-        }
-        return ret;
+        return get(B_map, std::make_tuple(K, N, k, n, type), K, N, k, n, type);
     }
     std::shared_ptr<C_bufs> get_C_bufs(int M, int K, int N, int m, int k, int n, rknn_tensor_type type) {
-        auto C_bufs_iter = C_map.find(std::make_tuple(M, K, N, m, k, n, type));
-        std::shared_ptr<C_bufs> ret;
-        if (C_bufs_iter == C_map.end()) {
-            ret = std::make_shared<C_bufs>(M, K, N, m, k, n, type);
-            C_map.emplace(std::make_tuple(M, K, N, m, k, n, type), ret);
-        } else {
-            ret = C_bufs_iter->second;
-        }
-        return ret;
+        return get(C_map, std::make_tuple(M, K, N, m, k, n, type), M, K, N, m, k, n, type);
     }
-    void clear(void) {
-        A_map.clear();
-        B_map.clear();
-        C_map.clear();
+
+    // drops the entries of freed buffer sets, returns the bytes still allocated
+    size_t bytes(void) {
+        return sweep(A_map) + sweep(B_map) + sweep(C_map);
+    }
+
+private:
+    template <typename Map>
+    static size_t sweep(Map &map) {
+        size_t total = 0;
+        for (auto it = map.begin(); it != map.end();) {
+            if (auto bufs = it->second.lock()) {
+                total += bufs->bytes();
+                ++it;
+            } else {
+                it = map.erase(it);
+            }
+        }
+        return total;
     }
 };
 
@@ -1101,6 +1109,8 @@ extern "C" {
 
 struct npu_task_multi_core {
     std::vector<std::shared_ptr<npu_task>> npu_tasks;
+    // first row of the input tile
+    int mm = 0;
 
     npu_task_multi_core(std::shared_ptr<npu_task> task)
         : npu_tasks(1, task) {}
@@ -1127,12 +1137,14 @@ struct npu_task_multi_core {
 };
 
 struct matmul_kernel {
-    const int MAX_N = 4096;
-    const int ALIGN_N = 32;
-    const int MAX_K = 4096;
-    const int ALIGN_K = 32;
+    static const int MAX_N = 4096;
+    static const int ALIGN_N = 32;
+    static const int MAX_K = 4096;
+    static const int ALIGN_K = 32;
     int m, n, k;
     int M, N, K;
+    // rows of each weight tile done on the NPU, the CPU does the rest
+    int active;
     rknn_tensor_type type;
     std::vector<std::shared_ptr<npu_task_multi_core>> npu_tasks;
     std::shared_ptr<A_bufs> inputs;
@@ -1144,12 +1156,16 @@ struct matmul_kernel {
         GGML_ASSERT(part <= max && part % align == 0);
         return part;
     }
-    matmul_kernel(int m, int n, int k, rknn_tensor_type type)
-        : m(m), n(n), k(k), type(type) {
+    // weight tiles only depend on the weight's shape, not on m
+    static std::pair<int, int> weight_tile(int n, int k) {
+        return { partition(n / NPU_CORE_NUM, MAX_N, ALIGN_N), partition(k, MAX_K, ALIGN_K) };
+    }
+    matmul_kernel(int m, int n, int k, int active, rknn_tensor_type type)
+        : m(m), n(n), k(k), active(active), type(type) {
         // partition m, n, k into M, N, K;
 
-        N = partition(n / NPU_CORE_NUM, MAX_N, ALIGN_N);
-        K = partition(k, MAX_K, ALIGN_K);
+        std::tie(N, K) = weight_tile(n, k);
+        GGML_ASSERT(active > 0 && active <= N && active % ALIGN_N == 0);
         // N = std::min(n / THREAD_NR / 32 * 32 + 32, 4096); K = std::min(k / 32 * 32 + 32, 4096);
         // let N be 4096, experiments show the following limitations: 
         if (type == RKNN_TENSOR_FLOAT32) {
@@ -1348,9 +1364,11 @@ struct matmul_kernel {
                     std::shared_ptr<rknn_mem> weight(global_weight);
 #endif
                     auto output = outputs->Cs.find(std::make_tuple(mm, nn, kk))->second;
-                    tmp_tasks.emplace_back(std::make_shared<npu_task>(M, N, K, type, input, weight, output));
+                    // a prefix of the packed weight tile is the packed prefix of its rows
+                    tmp_tasks.emplace_back(std::make_shared<npu_task>(M, active, K, type, input, weight, output));
                     if (tmp_tasks.size() == NPU_CORE_NUM || nn + N >= n) {
                         npu_tasks.emplace_back(std::make_shared<npu_task_multi_core>(tmp_tasks));
+                        npu_tasks.back()->mm = mm;
                         tmp_tasks.clear();
                     }
                 }
@@ -1381,10 +1399,13 @@ struct matmul_kernel {
     }
 
 #ifndef GGML_USE_CHCORE
-    std::vector<std::vector<std::shared_ptr<npu_task>>> to_multi_npu(int npu_nr) const {
+    // the tasks of the input tiles the first rows rows reach
+    std::vector<std::vector<std::shared_ptr<npu_task>>> to_multi_npu(int npu_nr, int rows) const {
         std::vector<std::vector<std::shared_ptr<npu_task>>> tasks;
         tasks.resize(npu_nr);
         for (auto task: npu_tasks) {
+            if (task->mm >= rows)
+                continue;
             GGML_ASSERT(task->npu_tasks.size() <= npu_nr);
             for (std::size_t i = 0; i < task->npu_tasks.size(); i++) {
                 tasks[i].push_back(task->npu_tasks[i]);
@@ -1395,28 +1416,93 @@ struct matmul_kernel {
 #endif
 };
 
-std::vector<std::shared_ptr<matmul_kernel>> matmul_kernels;
+// NPU rows per weight tile, set by ggml_compute_forward_mul_mat_split, 0 for all
+static int ggml_rknpu2_matmul_active(const struct ggml_tensor * dst) {
+    int32_t active = dst->op_params[0];
+    return active ? active : matmul_kernel::weight_tile(dst->ne[0], dst->src[0]->ne[0]).first;
+}
+
+// Plans are built for m rounded up to one of four buckets per octave, so
+// prompts of nearby lengths share one and its buffers; the tasks of input
+// tiles past the real m are skipped at submit. Least recently used plans
+// are dropped once their buffers exceed GGML_RKNPU_PLAN_MB.
+struct matmul_plan_cache {
+    typedef std::tuple<int, int, int, int, rknn_tensor_type> key_t;
+    struct key_hash {
+        size_t operator()(const key_t &key) const {
+            return std::hash<uint64_t>()(((uint64_t)std::get<0>(key) << 40) ^ ((uint64_t)std::get<1>(key) << 24) ^
+                ((uint64_t)std::get<2>(key) << 8) ^ (uint64_t)std::get<3>(key) * 31 ^ std::get<4>(key));
+        }
+    };
 
-static std::shared_ptr<matmul_kernel>
-ggml_rknpu2_matmul_kernel_find(int m, int k, int n, rknn_tensor_type type) {
-    for (const auto &kernel: matmul_kernels) {
-        if (kernel->m == m && kernel->k == k && kernel->n == n && kernel->type == type) {
-            return kernel;
+    // most recently used first
+    std::list<std::shared_ptr<matmul_kernel>> lru;
+    std::unordered_map<key_t, std::list<std::shared_ptr<matmul_kernel>>::iterator, key_hash> plans;
+    size_t budget;
+    uint64_t hits, misses, evictions;
+
+    matmul_plan_cache(void) : hits(0), misses(0), evictions(0) {
+        const char *mb = getenv("GGML_RKNPU_PLAN_MB");
+        budget = (size_t)(mb ? std::max(1, atoi(mb)) : 256) << 20;
+    }
+
+    static int m_bucket(int m) {
+        // the driver needs m == 1 or m % 4 == 0 anyway
+        if (m <= 16)
+            return m == 1 ? 1 : (m + 3) / 4 * 4;
+        int step = (1 << (31 - __builtin_clz(m - 1))) / 4;
+        return (m + step - 1) / step * step;
+    }
+
+    // safe from all threads as long as nobody creates
+    std::shared_ptr<matmul_kernel> find(int m, int k, int n, int active, rknn_tensor_type type) const {
+        auto it = plans.find(std::make_tuple(m_bucket(m), k, n, active, type));
+        return it == plans.end() ? nullptr : *it->second;
+    }
+
+    std::shared_ptr<matmul_kernel> create(int m, int k, int n, int active, rknn_tensor_type type) {
+        auto key = std::make_tuple(m_bucket(m), k, n, active, type);
+        auto it = plans.find(key);
+        if (it != plans.end()) {
+            hits++;
+            lru.splice(lru.begin(), lru, it->second);
+            return lru.front();
+        }
+        misses++;
+        lru.emplace_front(std::make_shared<matmul_kernel>(m_bucket(m), n, k, active, type));
+        plans.emplace(key, lru.begin());
+        // the new plan stays even if it alone is over budget
+        while (lru.size() > 1 && matmul_buffer_mgr.bytes() > budget) {
+            auto &victim = lru.back();
+            plans.erase(std::make_tuple(victim->m, victim->k, victim->n, victim->active, victim->type));
+            lru.pop_back();
+            evictions++;
         }
+        return lru.front();
     }
-    return nullptr;
+
+    void clear(void) {
+        plans.clear();
+        lru.clear();
+    }
+
+    void dump(void) {
+        printf("rknpu plan cache: %zu plans, %zu MB, %lu hits, %lu misses, %lu evictions\n",
+            lru.size(), matmul_buffer_mgr.bytes() >> 20, hits, misses, evictions);
+    }
+};
+
+static struct matmul_plan_cache matmul_plans;
+
+static std::shared_ptr<matmul_kernel>
+ggml_rknpu2_matmul_kernel_find(int m, int k, int n, int active, rknn_tensor_type type) {
+    return matmul_plans.find(m, k, n, active, type);
 }
 // first find from buffer, then reuse them
 static std::shared_ptr<matmul_kernel>
-ggml_rknpu2_matmul_kernel_create(int m, int k, int n, rknn_tensor_type type)
+ggml_rknpu2_matmul_kernel_create(int m, int k, int n, int active, rknn_tensor_type type)
 {
-    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, type);
-    if (kernel != NULL)
-        return kernel;
-
-    kernel = std::make_shared<matmul_kernel>(m, n, k, type);
-    matmul_kernels.emplace_back(kernel);
-    return kernel;
+    return matmul_plans.create(m, k, n, active, type);
 }
 
 static void ggml_backend_rknpu2_mul_mat_mul_npu(
@@ -1434,85 +1520,101 @@ static void ggml_backend_rknpu2_mul_mat_mul_npu(
     rknn_core_mask core_mask
 );
 
-std::mutex mtx;
-std::condition_variable cv_worker;
-std::condition_variable cv_master;
-bool done;
-bool ready[THREAD_NR];
-std::atomic<int> finished_nr;
-static std::once_flag once_flag;
-
-#ifdef GGML_USE_CHCORE
-std::vector<std::shared_ptr<npu_task_multi_core>> npu_tasks[THREAD_NR];
-#else
-std::vector<std::shared_ptr<npu_task>> npu_tasks[THREAD_NR];
+#ifndef GGML_USE_CHCORE
+// cpus of the threadpool's cpumask, the NPU submitters are spread over them
+static std::vector<int> npu_cpus;
+static npu_jobq *npu_queue;
+// guards both, the queue is created on first use and again after a backend free
+static std::mutex npu_queue_mtx;
+
+static void npu_job_submit(void *arg, int core) {
+    auto task = (npu_task *)arg;
+    task->apply_scale();
+    task->submit(1 << core);
+}
+
+static npu_jobq *get_npu_queue(void) {
+    std::lock_guard<std::mutex> _(npu_queue_mtx);
+    if (npu_queue)
+        return npu_queue;
+    // more than one submitter per core keeps the core's next task queued in the driver
+    const char *env = getenv("GGML_RKNPU_SUBMITTERS");
+    int nsubmitters = env ? std::max(NPU_CORE_NUM, atoi(env)) : NPU_CORE_NUM;
+    std::vector<int> cpus = npu_cpus;
+    if (cpus.empty()) {
+        // no cpumask, the big cores next to the NPU
+        for (int i = 0; i < NPU_CORE_NUM; i++)
+            cpus.push_back(i + 4);
+    }
+    npu_queue = npu_jobq_create(NPU_CORE_NUM, nsubmitters, cpus.data(), cpus.size(), 40);
+    return npu_queue;
+}
 #endif
 
-void npu_worker(int tid) {
-    int ith = tid;
+extern "C" void rknpu2_matmul_set_cpumask(const bool * cpumask) {
 #ifndef GGML_USE_CHCORE
-    struct sched_param param;
-    int policy = SCHED_FIFO;
-    int priority = 40;
-    param.sched_priority = priority;
-    GGML_ASSERT(pthread_setschedparam(pthread_self(), policy, &param) == 0);
-
-    cpu_set_t cpuset;
-    CPU_ZERO(&cpuset);
-    CPU_SET(tid + 4, &cpuset);
-    printf("npu worker: bind to core %d\n", tid + 4);
-    GGML_ASSERT(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0);
-#else
-    usys_set_prio(0, 54);
+    // taken when the submitters start
+    std::lock_guard<std::mutex> _(npu_queue_mtx);
+    if (npu_queue)
+        return;
+    npu_cpus.clear();
+    for (int i = 0; i < GGML_MAX_N_THREADS; i++) {
+        if (cpumask[i])
+            npu_cpus.push_back(i);
+    }
 #endif
+}
 
-    rknn_core_mask core_mask;
-    if (tid == 0) core_mask = 0x1;
-    if (tid == 1) core_mask = 0x2;
-    if (tid == 2) core_mask = 0x4;
-    while (true) {
-        {
-            std::unique_lock<std::mutex> lock(mtx);
-            cv_worker.wait(lock, [tid] { return ready[tid] || done; });
-        }
-        BEGIN_MEASURE_0;
+static inline rknn_tensor_type ggml_type_to_rknn_type(enum ggml_type type) {
+    if (type == GGML_TYPE_F16) return RKNN_TENSOR_FLOAT32;
+    if (type == GGML_TYPE_Q8_0) return RKNN_TENSOR_INT8;
+    GGML_ASSERT(false);
+}
 
-        if (done) break;
+// Abs-max scales of the int8 weight tiles. Weights never change, so a tensor's
+// scales are computed on its first matmul and every later one reuses them.
+struct weight_tile_scales {
+    int N, K;
+    int tiles_k;
+    std::vector<float> scale;
 
-        for (auto task: npu_tasks[tid]) {
-            task->apply_scale();
-#ifdef GGML_USE_CHCORE
-            task->submit();
-#else
-            task->submit(core_mask);
-#endif
-        }
+    float &at(int nn, int kk) { return scale[nn / N * tiles_k + kk / K]; }
+};
 
-        {
-            std::lock_guard<std::mutex> lock(mtx);
-            finished_nr++;
-            ready[tid] = false;
-            if (finished_nr == THREAD_NR) {
-                cv_master.notify_one();
-            }
-        }
-        END_MEASURE_0;
-    }
-}
+// Weight tiles already in the layout the NPU reads, packed by the streaming
+// pipeline right after the tensor is decrypted, so pre1 only copies them.
+struct weight_layout {
+    int N, K;
+    int tiles_k;
+    size_t tile_size;
+    std::vector<uint8_t> data;
+    // int8 tiles are quantized to these
+    std::shared_ptr<weight_tile_scales> scales;
+
+    uint8_t *tile(int nn, int kk) { return data.data() + (nn / N * tiles_k + kk / K) * tile_size; }
+};
 
-std::vector<std::thread> npu_threads;
+// keyed by the model tensor, not by the per-graph view of it
+static std::mutex weight_mtx;
+static std::unordered_map<const ggml_tensor *, std::shared_ptr<weight_tile_scales>> weight_scales;
+static std::unordered_map<const ggml_tensor *, std::shared_ptr<weight_layout>> weight_layouts;
+// packed while the tensor streams in, not yet readable by matmuls
+static std::unordered_map<const ggml_tensor *, std::shared_ptr<weight_layout>> weight_layouts_pending;
 
-static void init_npu_thread(int thread_nr) {
-    GGML_ASSERT(thread_nr <= 3);
-    for (int i = 0; i < thread_nr; i++) {
-        npu_threads.emplace_back(npu_worker, i);
-    }
+static const ggml_tensor *weight_scales_key(const ggml_tensor *weight) {
+    return weight->view_src ? weight->view_src : weight;
 }
 
-static inline rknn_tensor_type ggml_type_to_rknn_type(enum ggml_type type) {
-    if (type == GGML_TYPE_F16) return RKNN_TENSOR_FLOAT32;
-    if (type == GGML_TYPE_Q8_0) return RKNN_TENSOR_INT8;
-    GGML_ASSERT(false);
+static std::shared_ptr<weight_tile_scales> weight_scales_find(const ggml_tensor *weight) {
+    std::lock_guard<std::mutex> _(weight_mtx);
+    auto it = weight_scales.find(weight_scales_key(weight));
+    return it == weight_scales.end() ? nullptr : it->second;
+}
+
+static std::shared_ptr<weight_layout> weight_layout_find(const ggml_tensor *weight) {
+    std::lock_guard<std::mutex> _(weight_mtx);
+    auto it = weight_layouts.find(weight_scales_key(weight));
+    return it == weight_layouts.end() ? nullptr : it->second;
 }
 
 static inline int8_t f32_to_i8(float x, float scale) {
@@ -1528,7 +1630,7 @@ void matmul_perf_test(int m, int k, int n) {
     auto kernel = ggml_rknpu2_matmul_kernel_create(m, k, n, tensor_type);
     GGML_ASSERT(kernel);
 
-    auto tasks = kernel->to_multi_npu(1);
+    auto tasks = kernel->to_multi_npu(1, m);
     GGML_ASSERT(tasks.size() == 1 && tasks[0].size() == 1);
 
     std::queue<std::pair<int64_t, int64_t>> tss;
@@ -1607,14 +1709,18 @@ void rknpu2_matmul_pre0(struct ggml_tensor * dst, int nth, int ith) {
     const int64_t k = src0->ne[0];
     const int64_t n = dst->ne[0];
 
-    static bool cleared;
+    static bool dumped;
     if (ith == 0) {
-        /* now in decoding stage, clear all prefill buffers */
-        if (m == 1 && cleared == false) {
-            matmul_kernels.clear();
-            matmul_buffer_mgr.clear();
-            cleared = true;
+        /* now in decoding stage, dump the prefill measurements */
+        if (m == 1 && dumped == false) {
+            dumped = true;
             ggml_rknpu_dump_measure();
+            matmul_plans.dump();
+#ifndef GGML_USE_CHCORE
+            std::lock_guard<std::mutex> _(npu_queue_mtx);
+            if (npu_queue)
+                npu_jobq_dump(npu_queue);
+#endif
         }
     }
 
@@ -1625,7 +1731,7 @@ void rknpu2_matmul_pre0(struct ggml_tensor * dst, int nth, int ith) {
     rknn_tensor_type tensor_type = ggml_type_to_rknn_type(type);
 
     if (ith == 0) {
-        auto kernel = ggml_rknpu2_matmul_kernel_create(m, k, n, tensor_type);
+        auto kernel = ggml_rknpu2_matmul_kernel_create(m, k, n, ggml_rknpu2_matmul_active(dst), tensor_type);
         GGML_ASSERT(kernel);
         memset(dst->data, 0, m * n * sizeof(float));
 
@@ -1669,11 +1775,10 @@ void rknpu2_matmul_pre_scale(struct ggml_tensor * dst, int nth, int ith) {
 
     rknn_tensor_type tensor_type = ggml_type_to_rknn_type(src0->type);
 
-    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, tensor_type);
+    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, ggml_rknpu2_matmul_active(dst), tensor_type);
     GGML_ASSERT(kernel);
 
     float *A = (float*)src1->data;
-    void *B = src0->data;
 
     kernel->for_all_inputs(
         [&](int mm, int kk, int M, int K, std::shared_ptr<rknn_mem> input_mem) {
@@ -1692,31 +1797,65 @@ void rknpu2_matmul_pre_scale(struct ggml_tensor * dst, int nth, int ith) {
             }
         }
     );
+    // weight tiles, and so their scales, only reach the NPU with MAT_COPY
+#ifdef MAT_COPY
+    void *B = src0->data;
+    auto scales = weight_scales_find(src0);
+    std::vector<float> row;
     kernel->for_all_weights(
         [&](int nn, int kk, int N, int K, std::shared_ptr<rknn_mem> weight_mem) {
-            auto weight = weight_mem->ptr;
-            if (tensor_type == RKNN_TENSOR_INT8) {
-                float scale = SCALE_MIN;
-                ggml_type_traits_t traits = ggml_internal_get_type_traits(src0->type);
-                GGML_ASSERT(traits.to_float != NULL);
-                int nele = k * n;
-                float *fB = (float *)malloc(nele * sizeof(*fB));
-                traits.to_float(B, fB, nele);
-                for (int i = weight_mem->pre_scale_cnt.fetch_add(1); i < N; i = weight_mem->pre_scale_cnt.fetch_add(1))
-                    for (int j = 0; j < K; j++) {
-                        int ii = nn + i;
-                        int jj = kk + j;
-                        if (ii >= n || jj >= k) continue;
-                        scale = std::max(scale, std::abs(fB[ii * k + jj]));
-                    }
-                weight_mem->commit_scale(scale / 127.f);
-                free(fB);
+            if (tensor_type != RKNN_TENSOR_INT8) {
+                return;
+            }
+            if (scales) {
+                // one thread is enough to set it
+                if (weight_mem->pre_scale_cnt.fetch_add(1) == 0)
+                    weight_mem->commit_scale(scales->at(nn, kk));
+                return;
+            }
+            // first use, dequantize only the rows of the tile this thread takes
+            float scale = SCALE_MIN;
+            ggml_type_traits_t traits = ggml_internal_get_type_traits(src0->type);
+            GGML_ASSERT(traits.to_float != NULL);
+            GGML_ASSERT(kk % ggml_blck_size(src0->type) == 0);
+            const int len = std::min<int>(K, k - kk);
+            row.resize(K);
+            for (int i = weight_mem->pre_scale_cnt.fetch_add(1); i < N; i = weight_mem->pre_scale_cnt.fetch_add(1)) {
+                int ii = nn + i;
+                if (ii >= n) break;
+                const char *src = (const char *)B + ii * src0->nb[1] + kk / ggml_blck_size(src0->type) * ggml_type_size(src0->type);
+                traits.to_float(src, row.data(), len);
+                for (int j = 0; j < len; j++) {
+                    scale = std::max(scale, std::abs(row[j]));
+                }
             }
+            weight_mem->commit_scale(scale / 127.f);
         }
     );
+#endif
     END_MEASURE_0;
 }
 
+#ifdef MAT_COPY
+// keep the scales the threads just committed for the next matmul of src0
+static void weight_scales_record(const ggml_tensor *src0, std::shared_ptr<matmul_kernel> kernel) {
+    if (weight_scales_find(src0))
+        return;
+    auto scales = std::make_shared<weight_tile_scales>();
+    scales->N = kernel->N;
+    scales->K = kernel->K;
+    scales->tiles_k = (kernel->k + kernel->K - 1) / kernel->K;
+    scales->scale.resize((kernel->n + kernel->N - 1) / kernel->N * scales->tiles_k);
+    kernel->for_all_weights(
+        [&](int nn, int kk, int N, int K, std::shared_ptr<rknn_mem> weight_mem) {
+            scales->at(nn, kk) = weight_mem->scale;
+        }
+    );
+    std::lock_guard<std::mutex> _(weight_mtx);
+    weight_scales.emplace(weight_scales_key(src0), scales);
+}
+#endif
+
 std::atomic<bool> finish;
 
 void rknpu2_matmul_pre1(struct ggml_tensor * dst, int nth, int ith) {
@@ -1734,9 +1873,18 @@ void rknpu2_matmul_pre1(struct ggml_tensor * dst, int nth, int ith) {
 
     rknn_tensor_type tensor_type = ggml_type_to_rknn_type(src0->type);
 
-    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, tensor_type);
+    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, ggml_rknpu2_matmul_active(dst), tensor_type);
     GGML_ASSERT(kernel);
 
+#ifdef MAT_COPY
+    // every thread is past the pre_scale barrier, the tile scales are final
+    if (ith == 0 && tensor_type == RKNN_TENSOR_INT8) {
+        weight_scales_record(src0, kernel);
+    }
+#endif
+    auto layout = weight_layout_find(src0);
+    std::vector<float> row;
+
     kernel->for_all_inputs(
         [&](int mm, int kk, int M, int K, std::shared_ptr<rknn_mem> input_mem) {
             auto input = input_mem->ptr;
@@ -1777,8 +1925,13 @@ void rknpu2_matmul_pre1(struct ggml_tensor * dst, int nth, int ith) {
     kernel->for_all_weights(
         [&](int nn, int kk, int N, int K, std::shared_ptr<rknn_mem> weight_mem) {
             auto weight = weight_mem->ptr;
-            if (tensor_type == RKNN_TENSOR_FLOAT32) {
-                for (int i = weight_mem->pre1_cnt.fetch_add(1); i < N; i = weight_mem->pre1_cnt.fetch_add(1))
+            if (layout) {
+                // already packed, copy it over 32 rows at a time
+                const size_t chunk = layout->tile_size / (N / 32);
+                for (int i = weight_mem->pre1_cnt.fetch_add(1); i < kernel->active / 32; i = weight_mem->pre1_cnt.fetch_add(1))
+                    memcpy((uint8_t *)weight + i * chunk, layout->tile(nn, kk) + i * chunk, chunk);
+            } else if (tensor_type == RKNN_TENSOR_FLOAT32) {
+                for (int i = weight_mem->pre1_cnt.fetch_add(1); i < kernel->active; i = weight_mem->pre1_cnt.fetch_add(1))
                     for (int j = 0; j < K; j++) {
                         int ii = nn + i;
                         int jj = kk + j;
@@ -1786,19 +1939,20 @@ void rknpu2_matmul_pre1(struct ggml_tensor * dst, int nth, int ith) {
                         ((__fp16 *)weight)[weight_fp16(K, i + 1, j + 1)] = ((__fp16 *)B)[ii * k + jj];
                     }
             } else if (tensor_type == RKNN_TENSOR_INT8) {
+                // dequantize only the part of each row the tile holds
                 ggml_type_traits_t traits = ggml_internal_get_type_traits(src0->type);
                 GGML_ASSERT(traits.to_float != NULL);
-                int nele = k * n;
-                float *fB = (float *)malloc(nele * sizeof(*fB));
-                traits.to_float(B, fB, nele);
-                for (int i = weight_mem->pre1_cnt.fetch_add(1); i < N; i = weight_mem->pre1_cnt.fetch_add(1))
-                    for (int j = 0; j < K; j++) {
-                        int ii = nn + i;
-                        int jj = kk + j;
-                        if (ii >= n || jj >= k) continue;
-                        ((int8_t *)weight)[weight_int8(K, i + 1, j + 1)] = f32_to_i8(fB[ii * k + jj], weight_mem->scale);
-                    }
-                free(fB);
+                GGML_ASSERT(kk % ggml_blck_size(src0->type) == 0);
+                const int len = std::min<int>(K, k - kk);
+                row.resize(K);
+                for (int i = weight_mem->pre1_cnt.fetch_add(1); i < kernel->active; i = weight_mem->pre1_cnt.fetch_add(1)) {
+                    int ii = nn + i;
+                    if (ii >= n) continue;
+                    const char *src = (const char *)B + ii * src0->nb[1] + kk / ggml_blck_size(src0->type) * ggml_type_size(src0->type);
+                    traits.to_float(src, row.data(), len);
+                    for (int j = 0; j < len; j++)
+                        ((int8_t *)weight)[weight_int8(K, i + 1, j + 1)] = f32_to_i8(row[j], weight_mem->scale);
+                }
             }
         }
     );
@@ -1823,32 +1977,27 @@ void rknpu2_matmul_submit(struct ggml_tensor * dst, int nth, int ith) {
 
     rknn_tensor_type tensor_type = ggml_type_to_rknn_type(src0->type);
 
-    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, tensor_type);
+    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, ggml_rknpu2_matmul_active(dst), tensor_type);
     GGML_ASSERT(kernel);
 
 #ifdef GGML_USE_CHCORE
     for (auto task: kernel->npu_tasks) {
+        if (task->mm >= m)
+            continue;
         task->apply_scale();
         task->submit();
     }
 #else
-    auto tasks = kernel->to_multi_npu(THREAD_NR);
-    for (int i = 0; i < THREAD_NR; i++)
-        npu_tasks[i].assign(tasks[i].begin(), tasks[i].end());
-
-    std::call_once(once_flag, init_npu_thread, THREAD_NR);
-
-    finished_nr = 0;
-    for (int i = 0; i < THREAD_NR; i++)
-        ready[i] = true;
-    cv_worker.notify_all();
-    // std::unique_lock<std::mutex> lock(mtx);
-    // cv_master.wait(lock, [] { return finished_nr == THREAD_NR; });
-    while (finished_nr.load() != THREAD_NR) {
-        ggml_thread_cpu_relax_out();
-    }
-    for (int i = 0; i < THREAD_NR; i++)
-        npu_tasks[i].clear();
+    npu_jobq *queue = get_npu_queue();
+
+    // every core works through its tasks while the rest are still being queued
+    for (auto task: kernel->npu_tasks) {
+        if (task->mm >= m)
+            continue;
+        for (size_t core = 0; core < task->npu_tasks.size(); core++)
+            npu_jobq_push(queue, core, { npu_job_submit, task->npu_tasks[core].get() });
+    }
+    npu_jobq_wait(queue, ggml_thread_cpu_relax_out);
 #endif
     finish = true;
     END_MEASURE_0;
@@ -1866,7 +2015,7 @@ void rknpu2_matmul_post(struct ggml_tensor * dst, int nth, int ith) {
 
     float *C = (float*)dst->data;
 
-    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, tensor_type);
+    auto kernel = ggml_rknpu2_matmul_kernel_find(m, k, n, ggml_rknpu2_matmul_active(dst), tensor_type);
     GGML_ASSERT(kernel);
 
     BEGIN_MEASURE_0;
@@ -1879,7 +2028,7 @@ void rknpu2_matmul_post(struct ggml_tensor * dst, int nth, int ith) {
                     int ii = mm + i;
                     int off_in_sub_mat = i * 4;
                     if (ii >= m) break;
-                    for (int j = 0; j < N; j += 4) {
+                    for (int j = 0; j < kernel->active; j += 4) {
                         int jj = nn + j;
                         if (jj >= n) break;
                         int base_sub_mat = M * j;
@@ -1895,7 +2044,7 @@ void rknpu2_matmul_post(struct ggml_tensor * dst, int nth, int ith) {
                     int ii = mm + i;
                     int off_in_sub_mat = i * 4;
                     if (ii >= m) break;
-                    for (int j = 0; j < N; j += 4) {
+                    for (int j = 0; j < kernel->active; j += 4) {
                         int jj = nn + j;
                         if (jj >= n) break;
                         int base_sub_mat = M * j;
@@ -1956,13 +2105,18 @@ GGML_CALL static void ggml_backend_rknpu2_free(ggml_backend_t backend) {
         delete backend;
         g_rknpu2_mgr[ctx->device].backend = nullptr;
     }
-    matmul_kernels.clear();
+    matmul_plans.clear();
+    std::lock_guard<std::mutex> _(weight_mtx);
+    weight_scales.clear();
+    weight_layouts.clear();
 
-    done = true;
-    cv_worker.notify_all();
-    for (auto &thread: npu_threads) {
-        thread.join();
+#ifndef GGML_USE_CHCORE
+    std::lock_guard<std::mutex> q_lock(npu_queue_mtx);
+    if (npu_queue) {
+        npu_jobq_destroy(npu_queue);
+        npu_queue = nullptr;
     }
+#endif
 }
 
 GGML_CALL static ggml_backend_buffer_type_t ggml_backend_rknpu2_get_default_buffer_type(ggml_backend_t backend) {
@@ -2007,6 +2161,102 @@ void ggml_backend_rknpure_set_strawman(bool strawman) {
     is_strawman = strawman;
 }
 
+#ifdef MAT_COPY
+// the tiling of weight in the NPU layout, false if the NPU never reads it
+static bool relayout_plan(const struct ggml_tensor * weight, weight_layout & layout, int & tile_nr) {
+    const int64_t k = weight->ne[0];
+    const int64_t n = weight->ne[1];
+    // what supports_op sends to the NPU, see ggml_backend_rknpure_supports_op
+    if (is_strawman || (weight->type != GGML_TYPE_F16 && weight->type != GGML_TYPE_Q8_0) ||
+        !ggml_is_contiguous(weight) || weight->ne[2] != 1 || weight->ne[3] != 1 ||
+        k >= 50000 || n >= 50000 || k % 32 || n % 32) {
+        return false;
+    }
+    std::tie(layout.N, layout.K) = matmul_kernel::weight_tile(n, k);
+    layout.tiles_k = (k + layout.K - 1) / layout.K;
+    tile_nr = (n + layout.N - 1) / layout.N * layout.tiles_k;
+    layout.tile_size = (size_t)layout.N * layout.K * (weight->type == GGML_TYPE_F16 ? sizeof(ggml_fp16_t) : sizeof(int8_t));
+    return true;
+}
+#endif
+
+size_t ggml_rknpure_relayout_size(const struct ggml_tensor * weight) {
+#ifndef MAT_COPY
+    GGML_UNUSED(weight);
+    return 0;
+#else
+    weight_layout layout;
+    int tile_nr;
+    if (!relayout_plan(weight, layout, tile_nr)) {
+        return 0;
+    }
+    return tile_nr * layout.tile_size + (weight->type == GGML_TYPE_Q8_0 ? tile_nr * sizeof(float) : 0);
+#endif
+}
+
+int ggml_rknpure_relayout_begin(const struct ggml_tensor * weight) {
+#ifndef MAT_COPY
+    // weight tiles aren't copied to the NPU at all
+    GGML_UNUSED(weight);
+    return 0;
+#else
+    auto layout = std::make_shared<weight_layout>();
+    int tile_nr;
+    if (!relayout_plan(weight, *layout, tile_nr)) {
+        return 0;
+    }
+    layout->data.resize(tile_nr * layout->tile_size);
+    if (weight->type == GGML_TYPE_Q8_0) {
+        layout->scales = std::make_shared<weight_tile_scales>();
+        layout->scales->N = layout->N;
+        layout->scales->K = layout->K;
+        layout->scales->tiles_k = layout->tiles_k;
+        layout->scales->scale.resize(tile_nr);
+    }
+    std::lock_guard<std::mutex> _(weight_mtx);
+    weight_layouts_pending[weight] = layout;
+    return tile_nr;
+#endif
+}
+
+void ggml_rknpure_relayout_tile(const struct ggml_tensor * weight, const void * data, int tile) {
+    std::shared_ptr<weight_layout> layout;
+    {
+        std::lock_guard<std::mutex> _(weight_mtx);
+        layout = weight_layouts_pending.at(weight);
+    }
+    const int k = weight->ne[0];
+    const int n = weight->ne[1];
+    const int nn = tile / layout->tiles_k * layout->N;
+    const int kk = tile % layout->tiles_k * layout->K;
+    uint8_t *dst = layout->tile(nn, kk);
+    if (weight->type == GGML_TYPE_F16) {
+        npu_pack_fp16_tile((uint16_t *)dst, (const uint16_t *)data, k, n, layout->K, layout->N, kk, nn);
+        return;
+    }
+    // the scale pre_scale would have committed for this tile
+    float absmax = npu_q8_0_tile_absmax(data, k, n, layout->K, layout->N, kk, nn);
+    float scale = std::max(SCALE_MIN, std::max(SCALE_MIN, absmax) / 127.f);
+    layout->scales->at(nn, kk) = scale;
+    npu_pack_q8_0_tile((int8_t *)dst, data, k, n, layout->K, layout->N, kk, nn, scale);
+}
+
+void ggml_rknpure_relayout_end(const struct ggml_tensor * weight) {
+    std::lock_guard<std::mutex> _(weight_mtx);
+    auto layout = weight_layouts_pending.at(weight);
+    weight_layouts_pending.erase(weight);
+    weight_layouts[weight] = layout;
+    if (layout->scales) {
+        weight_scales[weight] = layout->scales;
+    }
+}
+
+void ggml_rknpure_relayout_drop(const struct ggml_tensor * weight) {
+    std::lock_guard<std::mutex> _(weight_mtx);
+    weight_layouts_pending.erase(weight);
+    weight_layouts.erase(weight);
+}
+
 GGML_CALL static bool ggml_backend_rknpure_supports_op(ggml_backend_t backend, const struct ggml_tensor * op) {
     const struct ggml_tensor * src0 = op->src[0];
     const struct ggml_tensor * src1 = op->src[1];
@@ -2085,6 +2335,11 @@ GGML_CALL static bool ggml_backend_rknpure_supports_op(ggml_backend_t backend, c
     GGML_UNUSED(backend);
 }
 extern "C" {
+    void rknpu2_matmul_tile(const struct ggml_tensor * dst, int64_t * tile, int64_t * align) {
+        *tile = matmul_kernel::weight_tile(dst->ne[0], dst->src[0]->ne[0]).first;
+        *align = matmul_kernel::ALIGN_N;
+    }
+
     bool ggml_backend_rknpure_supports_op_out(const struct ggml_tensor *op) {
         ggml_backend_t backend;
         return ggml_backend_rknpure_supports_op(backend, op);
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ggml.h"
+
+#include "npu_jobq.h"
+
+/* jobs a submitter can have queued, a power of two */
+#define RING_SIZE 256
+/* histogram buckets, bucket b counts times below 2^b us */
+#define HIST_NR 24
+/* rounds a submitter polls its ring before it sleeps */
+#define SPIN_NR 2000
+
+struct ring_entry {
+  npu_job job;
+  int64_t t_push;
+};
+
+struct submitter {
+  npu_jobq *q;
+  int core;
+  int cpu;
+  int prio;
+  pthread_t thread;
+  /* written by the submitter */
+  _Alignas(64) _Atomic uint32_t head;
+  _Atomic uint32_t sleeping;
+  /* written by the producer; wake is the futex word the submitter sleeps on */
+  _Alignas(64) _Atomic uint32_t tail;
+  _Atomic uint32_t wake;
+  struct ring_entry ring[RING_SIZE];
+  _Atomic uint64_t wait_hist[HIST_NR];
+  _Atomic uint64_t run_hist[HIST_NR];
+};
+
+struct npu_jobq {
+  int ncores;
+  int nsubmitters;
+  struct submitter *subs;
+  /* per core, which of its submitters gets the next job */
+  int *next;
+  /* jobs pushed, producer only */
+  uint32_t pushed;
+  _Atomic uint32_t stop;
+  /* jobs done, the futex word the producer sleeps on */
+  _Alignas(64) _Atomic uint32_t done;
+  _Atomic uint32_t waiting;
+};
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hist_add(_Atomic uint64_t *hist, int64_t us) {
+  int b = us <= 0 ? 0 : 64 - __builtin_clzll((uint64_t)us);
+  atomic_fetch_add_explicit(&hist[b < HIST_NR ? b : HIST_NR - 1], 1, memory_order_relaxed);
+}
+
+static atomic_flag prio_warned = ATOMIC_FLAG_INIT;
+
+static void *submitter_main(void *arg) {
+  struct submitter *s = arg;
+  npu_jobq *q = s->q;
+
+  if (s->prio > 0) {
+    struct sched_param param;
+    param.sched_priority = s->prio;
+    // needs CAP_SYS_NICE, the default policy only costs latency
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0 &&
+        !atomic_flag_test_and_set(&prio_warned))
+      fprintf(stderr, "npu jobq: cannot use SCHED_FIFO, submitters keep the default policy\n");
+  }
+  if (s->cpu >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(s->cpu, &cpuset);
+    GGML_ASSERT(pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0);
+  }
+
+  uint32_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+  for (;;) {
+    uint32_t tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+    if (head == tail) {
+      if (atomic_load(&q->stop))
+        break;
+      // the next job of a matmul is usually right behind
+      for (int i = 0; i < SPIN_NR && tail == head; i++)
+        tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+      if (tail != head)
+        continue;
+      uint32_t wake = atomic_load(&s->wake);
+      atomic_store(&s->sleeping, 1);
+      if (atomic_load(&s->tail) == head && !atomic_load(&q->stop))
+        futex_wait(&s->wake, wake);
+      atomic_store(&s->sleeping, 0);
+      continue;
+    }
+
+    struct ring_entry *e = &s->ring[head % RING_SIZE];
+    int64_t start = now_us();
+    e->job.fn(e->job.arg, s->core);
+    int64_t end = now_us();
+    hist_add(s->wait_hist, start - e->t_push);
+    hist_add(s->run_hist, end - start);
+
+    atomic_store_explicit(&s->head, ++head, memory_order_release);
+    atomic_fetch_add(&q->done, 1);
+    if (atomic_load(&q->waiting))
+      futex_wake(&q->done);
+  }
+  return NULL;
+}
+
+npu_jobq *npu_jobq_create(int ncores, int nsubmitters, const int *cpus, int ncpus, int prio) {
+  GGML_ASSERT(ncores > 0 && nsubmitters >= ncores);
+
+  npu_jobq *q = calloc(1, sizeof(*q));
+  GGML_ASSERT(q);
+  q->ncores = ncores;
+  q->nsubmitters = nsubmitters;
+  q->next = calloc(ncores, sizeof(*q->next));
+  GGML_ASSERT(q->next);
+  GGML_ASSERT(posix_memalign((void **)&q->subs, 64, nsubmitters * sizeof(*q->subs)) == 0);
+  memset(q->subs, 0, nsubmitters * sizeof(*q->subs));
+  for (int i = 0; i < nsubmitters; i++) {
+    struct submitter *s = &q->subs[i];
+    s->q = q;
+    s->core = i % ncores;
+    s->cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+    s->prio = prio;
+  }
+  for (int i = 0; i < nsubmitters; i++)
+    GGML_ASSERT(pthread_create(&q->subs[i].thread, NULL, submitter_main, &q->subs[i]) == 0);
+  return q;
+}
+
+void npu_jobq_destroy(npu_jobq *q) {
+  atomic_store(&q->stop, 1);
+  for (int i = 0; i < q->nsubmitters; i++) {
+    atomic_fetch_add(&q->subs[i].wake, 1);
+    futex_wake(&q->subs[i].wake);
+  }
+  for (int i = 0; i < q->nsubmitters; i++)
+    pthread_join(q->subs[i].thread, NULL);
+  free(q->subs);
+  free(q->next);
+  free(q);
+}
+
+void npu_jobq_push(npu_jobq *q, int core, npu_job job) {
+  GGML_ASSERT(core >= 0 && core < q->ncores);
+  int per_core = (q->nsubmitters - core + q->ncores - 1) / q->ncores;
+  struct submitter *s = &q->subs[core + q->next[core] * q->ncores];
+  q->next[core] = (q->next[core] + 1) % per_core;
+
+  uint32_t tail = atomic_load_explicit(&s->tail, memory_order_relaxed);
+  while (tail - atomic_load_explicit(&s->head, memory_order_acquire) == RING_SIZE)
+    sched_yield();
+  s->ring[tail % RING_SIZE] = (struct ring_entry){ job, now_us() };
+  atomic_store(&s->tail, tail + 1);
+  q->pushed++;
+
+  if (atomic_load(&s->sleeping)) {
+    atomic_fetch_add(&s->wake, 1);
+    futex_wake(&s->wake);
+  }
+}
+
+void npu_jobq_wait(npu_jobq *q, void (*poll)(void)) {
+  for (;;) {
+    uint32_t done = atomic_load(&q->done);
+    if (done == q->pushed)
+      return;
+    if (poll) {
+      poll();
+      continue;
+    }
+    atomic_store(&q->waiting, 1);
+    if (atomic_load(&q->done) == done)
+      futex_wait(&q->done, done);
+    atomic_store(&q->waiting, 0);
+  }
+}
+
+static void dump_hist(int core, const char *what, uint64_t *hist) {
+  printf("npu jobq core %d %s:", core, what);
+  for (int b = 0; b < HIST_NR; b++) {
+    if (hist[b])
+      printf(" <%lldus %llu", 1ll << b, (unsigned long long)hist[b]);
+  }
+  printf("\n");
+}
+
+void npu_jobq_dump(npu_jobq *q) {
+  for (int core = 0; core < q->ncores; core++) {
+    uint64_t wait[HIST_NR] = { 0 };
+    uint64_t run[HIST_NR] = { 0 };
+    for (int i = core; i < q->nsubmitters; i += q->ncores) {
+      for (int b = 0; b < HIST_NR; b++) {
+        wait[b] += atomic_load_explicit(&q->subs[i].wait_hist[b], memory_order_relaxed);
+        run[b] += atomic_load_explicit(&q->subs[i].run_hist[b], memory_order_relaxed);
+      }
+    }
+    dump_hist(core, "queued", wait);
+    dump_hist(core, "ran", run);
+  }
+}
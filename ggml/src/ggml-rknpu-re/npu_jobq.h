@@ -0,0 +1,51 @@
+#ifndef NPU_JOBQ_H
+#define NPU_JOBQ_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Hands jobs from one producer thread to submitter threads that each serve
+ * one accelerator core. Every submitter has its own single producer, single
+ * consumer ring and sleeps on a futex when it runs dry, so pushing a job is
+ * a store and, only if the submitter went to sleep, a wake.
+ *
+ * Submitter i serves core i % ncores. With more submitters than cores the
+ * jobs of a core alternate between its submitters, so the next job is
+ * already in the driver while the current one runs.
+ */
+
+typedef struct npu_job {
+  void (*fn)(void *arg, int core);
+  void *arg;
+} npu_job;
+
+typedef struct npu_jobq npu_jobq;
+
+/*
+ * Starts nsubmitters threads for ncores cores. Submitter i is pinned to
+ * cpus[i % ncpus] if ncpus > 0, and runs SCHED_FIFO at prio if prio > 0.
+ */
+npu_jobq *npu_jobq_create(int ncores, int nsubmitters, const int *cpus, int ncpus, int prio);
+
+/* stops the submitters once their rings are empty */
+void npu_jobq_destroy(npu_jobq *q);
+
+/* producer only: queues job for core, waits while the submitter's ring is full */
+void npu_jobq_push(npu_jobq *q, int core, npu_job job);
+
+/*
+ * producer only: returns once every job pushed so far is done. poll, if not
+ * NULL, is called while waiting, otherwise the producer sleeps.
+ */
+void npu_jobq_wait(npu_jobq *q, void (*poll)(void));
+
+/* prints the log2 histograms of the time jobs waited in the rings and ran */
+void npu_jobq_dump(npu_jobq *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // NPU_JOBQ_H
@@ -239,10 +239,10 @@ int gen_matmul_fp16(matmul_params_t *params) {
    cna_desc.weight_height = 1;
    cna_desc.weight_kernels = params->n;
    cna_desc.weight_bytes_per_kernel = cna_desc.weight_width * cna_desc.weight_height * 
-     cna_desc.datain_channel * sizeof(__fp16);
+     cna_desc.datain_channel * sizeof(uint16_t);
    cna_desc.weight_bytes = cna_desc.weight_bytes_per_kernel * cna_desc.weight_kernels; 
 
-   fd_bytes = cna_desc.datain_width * cna_desc.datain_height * cna_desc.datain_channel * sizeof(__fp16);
+   fd_bytes = cna_desc.datain_width * cna_desc.datain_height * cna_desc.datain_channel * sizeof(uint16_t);
    fd_banks = (fd_bytes / NPU_CBUF_BANK_SIZE);
    fd_banks = ((fd_bytes % NPU_CBUF_BANK_SIZE) == 0) ? fd_banks : fd_banks +1;
    weight_banks = (cna_desc.weight_bytes / NPU_CBUF_BANK_SIZE);
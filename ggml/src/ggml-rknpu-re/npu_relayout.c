@@ -0,0 +1,160 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GGML_COMMON_DECL_C
+#include "../ggml-common.h"
+#include "ggml.h"
+
+#include "npu_relayout.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* same as weight_fp16() and weight_int8() in npu_matmul.c */
+static int ref_weight_fp16(int C, int k, int c) {
+  int kpg = ((k-1)/16);
+  int cpg = ((c-1)/32);
+  return ((cpg*32)*16) + (kpg*16*C) + ((c-1)%32) + (((k-1)%16)*32);
+}
+
+static int ref_weight_int8(int C, int k, int c) {
+  int kpg = ((k-1)/32);
+  int cpg = ((c-1)/32);
+  return ((cpg*32)*32) + (kpg*32*C) + ((c-1)%32) + (((k-1)%32)*32);
+}
+
+/* A row's 32 columns of one group land next to each other in both layouts,
+ * so a tile is packed 32 elements at a time. */
+static inline void copy_fp16_x32(uint16_t *dst, const uint16_t *src) {
+#if defined(__ARM_NEON)
+  vst1q_u16(dst, vld1q_u16(src));
+  vst1q_u16(dst + 8, vld1q_u16(src + 8));
+  vst1q_u16(dst + 16, vld1q_u16(src + 16));
+  vst1q_u16(dst + 24, vld1q_u16(src + 24));
+#elif defined(__SSE2__)
+  for (int i = 0; i < 32; i += 8)
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
+#else
+  memcpy(dst, src, 32 * sizeof(*dst));
+#endif
+}
+
+void npu_pack_fp16_tile(uint16_t *dst, const uint16_t *src, int k, int n, int K, int N, int kk, int nn) {
+  int rows = n - nn < N ? n - nn : N;
+  int cols = k - kk < K ? k - kk : K;
+  /* a group of 16 rows is written front to back, 32 columns of each row in turn */
+  for (int i = 0; i < N; i += 16) {
+    uint16_t *out = dst + (size_t)i * K;
+    for (int j = 0; j < K; j += 32)
+      for (int r = 0; r < 16; r++, out += 32) {
+        if (i + r < rows && j < cols)
+          copy_fp16_x32(out, src + (size_t)(nn + i + r) * k + kk + j);
+        else
+          memset(out, 0, 32 * sizeof(*out));
+      }
+  }
+}
+
+void npu_pack_fp16_tile_ref(uint16_t *dst, const uint16_t *src, int k, int n, int K, int N, int kk, int nn) {
+  memset(dst, 0, (size_t)N * K * sizeof(*dst));
+  for (int i = 0; i < N; i++)
+    for (int j = 0; j < K; j++) {
+      int ii = nn + i;
+      int jj = kk + j;
+      if (ii >= n || jj >= k) continue;
+      dst[ref_weight_fp16(K, i + 1, j + 1)] = src[(size_t)ii * k + jj];
+    }
+}
+
+static inline const block_q8_0 *q8_0_block(const void *src, int k, int row, int col) {
+  return (const block_q8_0 *)src + (size_t)row * (k / QK8_0) + col / QK8_0;
+}
+
+float npu_q8_0_tile_absmax(const void *src, int k, int n, int K, int N, int kk, int nn) {
+  float absmax = 0.0f;
+  for (int i = 0; i < N && nn + i < n; i++)
+    for (int j = 0; j < K && kk + j < k; j += QK8_0) {
+      const block_q8_0 *block = q8_0_block(src, k, nn + i, kk + j);
+      int qmax = 0;
+      for (int t = 0; t < QK8_0; t++)
+        qmax = abs(block->qs[t]) > qmax ? abs(block->qs[t]) : qmax;
+      /* |q * d| == |q| * |d| and rounding is monotonic, so this is the max of the dequantized values */
+      absmax = fmaxf(absmax, qmax * fabsf(ggml_fp16_to_fp32(block->d)));
+    }
+  return absmax;
+}
+
+/* (int8_t)clamp(q * d / scale, -127, 127), truncating like f32_to_i8() */
+static inline void requant_x32(int8_t *dst, const int8_t *qs, float d, float scale) {
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  float32x4_t vd = vdupq_n_f32(d);
+  float32x4_t vs = vdupq_n_f32(scale);
+  float32x4_t lo = vdupq_n_f32(-127.f);
+  float32x4_t hi = vdupq_n_f32(127.f);
+  for (int i = 0; i < 32; i += 8) {
+    int16x8_t q16 = vmovl_s8(vld1_s8(qs + i));
+    int32x4_t q32[2] = { vmovl_s16(vget_low_s16(q16)), vmovl_s16(vget_high_s16(q16)) };
+    int32x4_t r[2];
+    for (int h = 0; h < 2; h++) {
+      float32x4_t x = vdivq_f32(vmulq_f32(vcvtq_f32_s32(q32[h]), vd), vs);
+      r[h] = vcvtq_s32_f32(vminq_f32(vmaxq_f32(x, lo), hi));
+    }
+    vst1_s8(dst + i, vmovn_s16(vcombine_s16(vmovn_s32(r[0]), vmovn_s32(r[1]))));
+  }
+#elif defined(__SSE2__)
+  __m128 vd = _mm_set1_ps(d);
+  __m128 vs = _mm_set1_ps(scale);
+  __m128 lo = _mm_set1_ps(-127.f);
+  __m128 hi = _mm_set1_ps(127.f);
+  for (int i = 0; i < 32; i += 16) {
+    __m128i q8 = _mm_loadu_si128((const __m128i *)(qs + i));
+    /* sign extend by unpacking each byte into the high half and shifting down */
+    __m128i q16[2] = { _mm_srai_epi16(_mm_unpacklo_epi8(q8, q8), 8), _mm_srai_epi16(_mm_unpackhi_epi8(q8, q8), 8) };
+    __m128i r[4];
+    for (int h = 0; h < 4; h++) {
+      __m128i q = h % 2 ? _mm_unpackhi_epi16(q16[h / 2], q16[h / 2]) : _mm_unpacklo_epi16(q16[h / 2], q16[h / 2]);
+      __m128 x = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(q, 16)), vd), vs);
+      r[h] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(x, lo), hi));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi16(_mm_packs_epi32(r[0], r[1]), _mm_packs_epi32(r[2], r[3])));
+  }
+#else
+  for (int i = 0; i < 32; i++)
+    dst[i] = (int8_t)fminf(fmaxf(qs[i] * d / scale, -127.f), 127.f);
+#endif
+}
+
+void npu_pack_q8_0_tile(int8_t *dst, const void *src, int k, int n, int K, int N, int kk, int nn, float scale) {
+  int rows = n - nn < N ? n - nn : N;
+  int cols = k - kk < K ? k - kk : K;
+  for (int i = 0; i < N; i += 32) {
+    int8_t *out = dst + (size_t)i * K;
+    for (int j = 0; j < K; j += QK8_0)
+      for (int r = 0; r < 32; r++, out += 32) {
+        if (i + r < rows && j < cols) {
+          const block_q8_0 *block = q8_0_block(src, k, nn + i + r, kk + j);
+          requant_x32(out, block->qs, ggml_fp16_to_fp32(block->d), scale);
+        } else {
+          memset(out, 0, 32);
+        }
+      }
+  }
+}
+
+void npu_pack_q8_0_tile_ref(int8_t *dst, const void *src, int k, int n, int K, int N, int kk, int nn, float scale) {
+  memset(dst, 0, (size_t)N * K);
+  for (int i = 0; i < N; i++)
+    for (int j = 0; j < K; j++) {
+      int ii = nn + i;
+      int jj = kk + j;
+      if (ii >= n || jj >= k) continue;
+      const block_q8_0 *block = q8_0_block(src, k, ii, jj);
+      float x = block->qs[jj % QK8_0] * ggml_fp16_to_fp32(block->d);
+      dst[ref_weight_int8(K, i + 1, j + 1)] = (int8_t)fminf(fmaxf(x / scale, -127.f), 127.f);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef NPU_RELAYOUT_H
+#define NPU_RELAYOUT_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Packs one N x K tile of an n x k weight, rows [nn, nn + N) and columns
+ * [kk, kk + K), into the layout the NPU reads weights in. Rows past n and
+ * columns past k are zero. N and K are multiples of 32, so are k and kk.
+ *
+ * fp16 tiles are (N/16, K/32, 16, 32), see weight_fp16(). q8_0 rows are
+ * requantized to the tile's scale into (N/32, K/32, 32, 32), see weight_int8().
+ * The _ref versions are the element by element loops rknpu2_matmul_pre1 used.
+ */
+void npu_pack_fp16_tile(uint16_t *dst, const uint16_t *src, int k, int n, int K, int N, int kk, int nn);
+void npu_pack_fp16_tile_ref(uint16_t *dst, const uint16_t *src, int k, int n, int K, int N, int kk, int nn);
+
+float npu_q8_0_tile_absmax(const void *src, int k, int n, int K, int N, int kk, int nn);
+void npu_pack_q8_0_tile(int8_t *dst, const void *src, int k, int n, int K, int N, int kk, int nn, float scale);
+void npu_pack_q8_0_tile_ref(int8_t *dst, const void *src, int k, int n, int K, int N, int kk, int nn, float scale);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // NPU_RELAYOUT_H
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ggml-cpu-impl.h"
+
+#include "npu_hw.h"
+#include "npu_sim.h"
+
+/* covers the PC, CNA, CORE and DPU register ranges */
+#define SIM_REG_NR (0x5000 / 4)
+
+typedef struct sim_regs {
+  uint32_t value[SIM_REG_NR];
+  uint8_t set[SIM_REG_NR];
+} sim_regs;
+
+#define SIM_FAIL(msg) do { *err = (msg); return -1; } while (0)
+#define SIM_CHECK(cond, msg) do { if (!(cond)) SIM_FAIL(msg); } while (0)
+#define SIM_REG(reg, out) do { \
+    SIM_CHECK(regs->set[(reg) / 4], "task doesn't set " #reg); \
+    (out) = regs->value[(reg) / 4]; \
+  } while (0)
+
+/* register address range an op's block may write */
+static int op_block_base(uint16_t op) {
+  switch (op) {
+    case OP_REG_PC:   return 0x0000;
+    case OP_REG_CNA:  return 0x1000;
+    case OP_REG_CORE: return 0x3000;
+    case OP_REG_DPU:  return 0x4000;
+  }
+  return -1;
+}
+
+static int sim_load(const uint64_t *ops, int nops, sim_regs *regs, const char **err) {
+  memset(regs, 0, sizeof(*regs));
+  for (int i = 0; i < nops; i++) {
+    uint16_t op = (uint16_t)(ops[i] >> 48);
+    uint32_t value = (uint32_t)(ops[i] >> 16);
+    uint16_t reg = (uint16_t)ops[i];
+
+    if (op == OP_NONE || op == OP_40)
+      continue;
+    if (op == OP_ENABLE) {
+      SIM_CHECK(reg == PC_OPERATION_ENABLE, "enable op doesn't target PC_OPERATION_ENABLE");
+      SIM_CHECK((value & (PC_ENABLE | PC_ENABLE_CNA | PC_ENABLE_DPU)) == (PC_ENABLE | PC_ENABLE_CNA | PC_ENABLE_DPU),
+                "task doesn't enable both CNA and DPU");
+      return 0;
+    }
+    int base = op_block_base(op);
+    SIM_CHECK(base >= 0, "unknown op");
+    SIM_CHECK(reg % 4 == 0 && reg < SIM_REG_NR * 4, "register out of range");
+    SIM_CHECK((reg & 0xf000) == base, "register written through another block's op");
+    regs->value[reg / 4] = value;
+    regs->set[reg / 4] = 1;
+  }
+  SIM_FAIL("task never enables the NPU");
+}
+
+static int precision_size(int precision) {
+  switch (precision) {
+    case precision_int8:    return 1;
+    case precision_float16: return 2;
+    case precision_int32:   return 4;
+    case precision_float32: return 4;
+  }
+  return 0;
+}
+
+static int sim_decode(const sim_regs *regs, npu_sim_matmul *mm, const char **err) {
+  uint32_t v;
+
+  SIM_REG(CNA_CONV_CON1, v);
+  SIM_CHECK((v & 0xf) == direct_convolution, "only direct convolution is simulated");
+  int in_precision = (v >> 4) & 0x7;
+  SIM_CHECK(((v >> 7) & 0x7) == (uint32_t)in_precision, "CNA input and processing precision differ");
+  SIM_CHECK(in_precision == precision_float16 || in_precision == precision_int8, "unsupported CNA precision");
+  int esize = precision_size(in_precision);
+
+  SIM_REG(CNA_DATA_SIZE0, v);
+  SIM_CHECK((v >> 16) == 1, "feature width isn't 1");
+  int m = v & 0x7ff;
+  SIM_REG(CNA_DATA_SIZE1, v);
+  int k = v & 0xffff;
+  SIM_CHECK((v >> 16) == (uint32_t)(k - 1), "CNA_DATA_SIZE1 channel fields disagree");
+  SIM_REG(CNA_DATA_SIZE3, v);
+  SIM_CHECK(v == (uint32_t)m, "output atomics don't match the feature height");
+  SIM_REG(CNA_FC_DATA_SIZE0, v);
+  SIM_CHECK(v == (1u << 16 | (uint32_t)m), "feature dma size doesn't match the feature size");
+  SIM_REG(CNA_FC_DATA_SIZE1, v);
+  SIM_CHECK(v == (uint32_t)k, "feature dma channels don't match the feature channels");
+  SIM_CHECK(m > 0 && k > 0, "empty feature");
+
+  SIM_REG(CNA_WEIGHT_SIZE2, v);
+  SIM_CHECK((v >> 24) == 1 && ((v >> 16) & 0x1f) == 1, "kernel isn't 1x1");
+  int n = v & 0x3fff;
+  SIM_CHECK(n > 0, "no kernels");
+  SIM_REG(CNA_WEIGHT_SIZE1, v);
+  SIM_CHECK(v == (uint32_t)(k * esize), "weight bytes per kernel don't match the channels");
+  SIM_REG(CNA_WEIGHT_SIZE0, v);
+  SIM_CHECK(v == (uint32_t)(n * k * esize), "weight bytes don't match the kernels");
+
+  SIM_REG(CNA_CBUF_CON0, v);
+  int data_bank = v & 0xf;
+  int weight_bank = (v >> 4) & 0xf;
+  SIM_CHECK(data_bank + weight_bank <= NPU_CBUF_BANKS, "more cbuf banks than there are");
+  SIM_CHECK((size_t)data_bank * NPU_CBUF_BANK_SIZE >= (size_t)m * k * esize, "feature doesn't fit its cbuf banks");
+  SIM_CHECK(weight_bank > 0 && k * esize <= NPU_CBUF_BANK_SIZE, "a kernel doesn't fit a cbuf bank");
+
+  SIM_REG(CORE_MISC_CFG, v);
+  SIM_CHECK(((v >> 8) & 0x7) == (uint32_t)in_precision, "CORE precision differs from CNA");
+  SIM_REG(CORE_DATAOUT_SIZE_0, v);
+  SIM_CHECK(v == ((uint32_t)(m - 1) << 16), "CORE output size doesn't match the feature");
+  SIM_REG(CORE_DATAOUT_SIZE_1, v);
+  SIM_CHECK(v == (uint32_t)(n - 1), "CORE output channels don't match the kernels");
+
+  SIM_REG(DPU_DATA_FORMAT, v);
+  int out_precision = (v >> 29) & 0x7;
+  SIM_CHECK(((v >> 26) & 0x7) == (uint32_t)in_precision && (v & 0x7) == (uint32_t)in_precision,
+            "DPU precision differs from CNA");
+  SIM_REG(DPU_OUT_CVT_SCALE, v);
+  SIM_CHECK((v & 0xffff) == 1, "output conversion scale isn't simulated");
+  int fp32tofp16 = (v >> 16) & 0x1;
+  if (in_precision == precision_int8)
+    SIM_CHECK(out_precision == precision_int32 && !fp32tofp16, "int8 must write int32");
+  else
+    SIM_CHECK(out_precision == (fp32tofp16 ? precision_float16 : precision_float32),
+              "fp16 output precision doesn't match the fp32 to fp16 conversion");
+  SIM_REG(DPU_BS_CFG, v);
+  SIM_CHECK(v & 0x1, "BS isn't bypassed");
+  SIM_REG(DPU_BN_CFG, v);
+  SIM_CHECK(v & 0x1, "BN isn't bypassed");
+  SIM_REG(DPU_EW_CFG, v);
+  SIM_CHECK(v & 0x1, "EW isn't bypassed");
+
+  SIM_REG(DPU_DATA_CUBE_WIDTH, v);
+  SIM_CHECK(v == 0, "DPU cube width isn't 1");
+  SIM_REG(DPU_DATA_CUBE_HEIGHT, v);
+  SIM_CHECK(v == (uint32_t)(m - 1), "DPU cube height doesn't match the feature");
+  SIM_REG(DPU_DATA_CUBE_CHANNEL, v);
+  SIM_CHECK((v & 0x1fff) == (uint32_t)(n - 1), "DPU cube channels don't match the kernels");
+  SIM_REG(DPU_WDMA_SIZE_0, v);
+  SIM_CHECK(v == (uint32_t)(n - 1), "DPU write channels don't match the kernels");
+  SIM_REG(DPU_WDMA_SIZE_1, v);
+  SIM_CHECK(v == ((uint32_t)(m - 1) << 16), "DPU write size doesn't match the feature");
+  SIM_REG(DPU_DST_SURF_STRIDE, v);
+  mm->dst_surf_stride = v >> 4;
+  SIM_CHECK(mm->dst_surf_stride >= (uint32_t)m, "output surfaces overlap");
+
+  SIM_REG(CNA_FEATURE_DATA_ADDR, mm->input_dma);
+  SIM_REG(CNA_DCOMP_ADDR0, mm->weights_dma);
+  SIM_REG(DPU_DST_BASE_ADD, mm->output_dma);
+
+  mm->m = m;
+  mm->k = k;
+  mm->n = n;
+  mm->in_precision = in_precision;
+  mm->out_precision = out_precision;
+  mm->data_bank = data_bank;
+  mm->weight_bank = weight_bank;
+  return 0;
+}
+
+int npu_sim_decode(const uint64_t *ops, int nops, npu_sim_matmul *mm, const char **err) {
+  const char *dummy;
+  if (!err)
+    err = &dummy;
+  sim_regs *regs = (sim_regs *)malloc(sizeof(*regs));
+  int ret = sim_load(ops, nops, regs, err);
+  if (ret == 0)
+    ret = sim_decode(regs, mm, err);
+  free(regs);
+  return ret;
+}
+
+/* host address of [dma, dma + size), NULL unless one buffer covers all of it */
+static void *sim_map(const npu_sim_mem *mems, int nmem, uint32_t dma, size_t size) {
+  for (int i = 0; i < nmem; i++) {
+    if (dma >= mems[i].dma && dma - mems[i].dma <= mems[i].size && size <= mems[i].size - (dma - mems[i].dma))
+      return (uint8_t *)mems[i].ptr + (dma - mems[i].dma);
+  }
+  return NULL;
+}
+
+int npu_sim_run(const uint64_t *ops, int nops, const npu_sim_mem *mems, int nmem, const char **err) {
+  const char *dummy;
+  if (!err)
+    err = &dummy;
+  npu_sim_matmul mm;
+  int ret = npu_sim_decode(ops, nops, &mm, err);
+  if (ret)
+    return ret;
+
+  const int m = mm.m, k = mm.k, n = mm.n;
+  const int fp16 = mm.in_precision == precision_float16;
+  const int esize = precision_size(mm.in_precision);
+  const int osize = precision_size(mm.out_precision);
+  /* a 16 byte atom holds 8 fp16 or 16 int8 channels of one row */
+  const int in_c2 = 16 / esize;
+  const int out_c2 = 16 / osize;
+  /* kernels go in groups of 16 (fp16) or 32 (int8), each 32 channels at a time */
+  const int group = fp16 ? 16 : 32;
+  const int kpad = (k + 31) / 32 * 32;
+
+  size_t in_bytes = (size_t)((k + in_c2 - 1) / in_c2) * m * 16;
+  size_t w_bytes = (size_t)((n + group - 1) / group) * group * kpad * esize;
+  size_t out_bytes = (size_t)((n + out_c2 - 1) / out_c2 - 1) * mm.dst_surf_stride * 16 + (size_t)m * 16;
+  const uint8_t *in = (const uint8_t *)sim_map(mems, nmem, mm.input_dma, in_bytes);
+  const uint8_t *w = (const uint8_t *)sim_map(mems, nmem, mm.weights_dma, w_bytes);
+  uint8_t *out = (uint8_t *)sim_map(mems, nmem, mm.output_dma, out_bytes);
+  SIM_CHECK(in, "feature data runs past its buffer");
+  SIM_CHECK(w, "weights run past their buffer");
+  SIM_CHECK(out, "output runs past its buffer");
+
+  /* gather both operands row major, then multiply */
+  float *fa = NULL, *fb = NULL;
+  int32_t *ia = NULL, *ib = NULL;
+  if (fp16) {
+    fa = (float *)malloc((size_t)m * k * sizeof(*fa));
+    fb = (float *)malloc((size_t)n * k * sizeof(*fb));
+  } else {
+    ia = (int32_t *)malloc((size_t)m * k * sizeof(*ia));
+    ib = (int32_t *)malloc((size_t)n * k * sizeof(*ib));
+  }
+  for (int h = 0; h < m; h++)
+    for (int c = 0; c < k; c++) {
+      const uint8_t *p = in + ((size_t)(c / in_c2) * m + h) * 16 + (c % in_c2) * esize;
+      if (fp16) {
+        ggml_fp16_t x;
+        memcpy(&x, p, sizeof(x));
+        fa[(size_t)h * k + c] = GGML_COMPUTE_FP16_TO_FP32(x);
+      } else {
+        ia[(size_t)h * k + c] = (int8_t)*p;
+      }
+    }
+  for (int o = 0; o < n; o++)
+    for (int c = 0; c < k; c++) {
+      size_t idx = (size_t)(o / group) * group * kpad + (size_t)(c / 32) * 32 * group + (o % group) * 32 + c % 32;
+      const uint8_t *p = w + idx * esize;
+      if (fp16) {
+        ggml_fp16_t x;
+        memcpy(&x, p, sizeof(x));
+        fb[(size_t)o * k + c] = GGML_COMPUTE_FP16_TO_FP32(x);
+      } else {
+        ib[(size_t)o * k + c] = (int8_t)*p;
+      }
+    }
+
+  for (int h = 0; h < m; h++)
+    for (int o = 0; o < n; o++) {
+      uint8_t *p = out + ((size_t)(o / out_c2) * mm.dst_surf_stride + h) * 16 + (o % out_c2) * osize;
+      if (fp16) {
+        /* products of two fp16 are exact in fp32, the adder tree isn't modelled */
+        float acc = 0.0f;
+        for (int c = 0; c < k; c++)
+          acc += fa[(size_t)h * k + c] * fb[(size_t)o * k + c];
+        if (mm.out_precision == precision_float16) {
+          ggml_fp16_t x = GGML_COMPUTE_FP32_TO_FP16(acc);
+          memcpy(p, &x, sizeof(x));
+        } else {
+          memcpy(p, &acc, sizeof(acc));
+        }
+      } else {
+        int32_t acc = 0;
+        for (int c = 0; c < k; c++)
+          acc += ia[(size_t)h * k + c] * ib[(size_t)o * k + c];
+        memcpy(p, &acc, sizeof(acc));
+      }
+    }
+
+  free(fa);
+  free(fb);
+  free(ia);
+  free(ib);
+  return 0;
+}
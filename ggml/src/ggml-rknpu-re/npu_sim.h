@@ -0,0 +1,57 @@
+#ifndef NPU_SIM_H
+#define NPU_SIM_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Runs the register command streams gen_matmul_fp16() and gen_matmul_int8()
+ * emit on the CPU, so layouts and tilings can be checked without a board.
+ *
+ * The task list is decoded into a register file the way the PC block would
+ * load it, cross-checked (CNA, CORE and DPU must agree on the shape, the cbuf
+ * must hold the operands) and the matmul it describes is done over the
+ * emulated DMA buffers: input in the feature_data() layout, weights in the
+ * weight_fp16()/weight_int8() layout, output as 16 byte atoms per row and
+ * surface, the way rknpu2_matmul_post reads it back.
+ */
+
+/* host memory standing in for a buffer the NPU reaches at dma */
+typedef struct npu_sim_mem {
+  uint32_t dma;
+  void *ptr;
+  size_t size;
+} npu_sim_mem;
+
+/* what a task list asks for, in the units of npu_hw.h */
+typedef struct npu_sim_matmul {
+  int m;
+  int k;
+  int n;
+  int in_precision;
+  int out_precision;
+  uint32_t input_dma;
+  uint32_t weights_dma;
+  uint32_t output_dma;
+  /* 16 byte atoms from one output surface to the next */
+  uint32_t dst_surf_stride;
+  int data_bank;
+  int weight_bank;
+} npu_sim_matmul;
+
+/*
+ * Decodes the first task of ops, at most nops entries. Returns 0, or a
+ * negative value with *err describing the first inconsistency.
+ */
+int npu_sim_decode(const uint64_t *ops, int nops, npu_sim_matmul *mm, const char **err);
+
+/* decodes the task and runs it over the nmem buffers in mems */
+int npu_sim_run(const uint64_t *ops, int nops, const npu_sim_mem *mems, int nmem, const char **err);
+
+#ifdef __cplusplus
+}
+#endif
+#endif // NPU_SIM_H
@@ -2027,6 +2027,8 @@ struct ggml_threadpool {
     atomic_int n_barrier;
     atomic_int n_barrier_passed;
     atomic_int current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
+    atomic_int split_chunks_done; // CPU chunks of a split Mat_Mul finished so far
+    atomic_int split_cpu_us;      // when the last of them finished, from the start of the split
 
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
@@ -3659,6 +3661,40 @@ static inline int ggml_up32(int n) {
     return (n + 31) & ~31;
 }
 
+//
+// mul_mat split
+//
+
+// How a MUL_MAT an accelerator supports is shared with the CPU threads, from
+// GGML_MUL_MAT_SPLIT: unset or "off" gives the accelerator everything, "auto"
+// learns its share per shape, a number in [0, 1] fixes it.
+// GGML_FAKE_ACCEL_GFLOPS stands in an accelerator of that speed for any build.
+enum ggml_mul_mat_split_mode {
+    GGML_MUL_MAT_SPLIT_OFF,
+    GGML_MUL_MAT_SPLIT_FIXED,
+    GGML_MUL_MAT_SPLIT_AUTO,
+};
+
+static enum ggml_mul_mat_split_mode mul_mat_split_mode;
+static float mul_mat_split_fixed;
+static float fake_accel_gflops;
+
+static void ggml_mul_mat_split_init(void) {
+    const char * mode = getenv("GGML_MUL_MAT_SPLIT");
+    if (mode && strcmp(mode, "auto") == 0) {
+        mul_mat_split_mode = GGML_MUL_MAT_SPLIT_AUTO;
+    } else if (mode && strcmp(mode, "off") != 0) {
+        mul_mat_split_mode = GGML_MUL_MAT_SPLIT_FIXED;
+        mul_mat_split_fixed = atof(mode);
+        GGML_ASSERT(mul_mat_split_fixed >= 0.0f && mul_mat_split_fixed <= 1.0f);
+    }
+    const char * gflops = getenv("GGML_FAKE_ACCEL_GFLOPS");
+    if (gflops) {
+        fake_accel_gflops = atof(gflops);
+        GGML_ASSERT(fake_accel_gflops > 0.0f);
+    }
+}
+
 //static inline int ggml_up64(int n) {
 //    return (n + 63) & ~63;
 //}
@@ -3725,6 +3761,8 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
             GGML_PRINT_DEBUG("%s: g_state initialized in %f ms\n", __func__, (t_end - t_start)/1000.0f);
         }
 
+        ggml_mul_mat_split_init();
+
         is_first_call = false;
     }
 
@@ -12849,6 +12887,289 @@ extern void rknpu2_matmul_pre_scale(struct ggml_tensor * dst, int nth, int ith);
 extern void rknpu2_matmul_pre1(struct ggml_tensor * dst, int nth, int ith);
 extern void rknpu2_matmul_submit(struct ggml_tensor * dst, int nth, int ith);
 extern void rknpu2_matmul_post(struct ggml_tensor * dst, int nth, int ith);
+extern void rknpu2_matmul_tile(const struct ggml_tensor * dst, int64_t * tile, int64_t * align);
+extern void rknpu2_matmul_set_cpumask(const bool * cpumask);
+
+// ggml_compute_forward_mul_mat_split
+
+// An accelerator a MUL_MAT is shared with. Of every tile of src0 rows it takes
+// the first op_params[0], the CPU threads compute the rest through
+// current_chunk while it runs.
+struct ggml_mul_mat_accel {
+    // rows per tile and the granularity of the accelerator's share of a tile
+    void (*tile)(const struct ggml_tensor * dst, int64_t * tile, int64_t * align);
+    // all threads, before the accelerator starts
+    void (*prepare)(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+    // thread 0 only, returns once the accelerator is done
+    void (*run)(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+    // all threads, after the CPU rows are done too
+    void (*finish)(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+};
+
+#ifdef GGML_USE_RKNPURE
+static void ggml_rknpure_accel_prepare(const struct ggml_compute_params * params, struct ggml_tensor * dst) {
+    rknpu2_matmul_begin_measure(params->ith);
+    rknpu2_matmul_pre0(dst, params->nth, params->ith);
+    ggml_barrier(params->threadpool);
+    rknpu2_matmul_pre_scale(dst, params->nth, params->ith);
+    ggml_barrier(params->threadpool);
+    rknpu2_matmul_pre1(dst, params->nth, params->ith);
+}
+
+static void ggml_rknpure_accel_run(const struct ggml_compute_params * params, struct ggml_tensor * dst) {
+    rknpu2_matmul_begin_measure_npu(0);
+    rknpu2_matmul_submit(dst, params->nth, 0);
+    rknpu2_matmul_end_measure_npu(0);
+}
+
+static void ggml_rknpure_accel_finish(const struct ggml_compute_params * params, struct ggml_tensor * dst) {
+    rknpu2_matmul_post(dst, params->nth, params->ith);
+    rknpu2_matmul_end_measure(params->ith);
+}
+
+static const struct ggml_mul_mat_accel ggml_rknpure_accel = {
+    /*.tile    =*/ rknpu2_matmul_tile,
+    /*.prepare =*/ ggml_rknpure_accel_prepare,
+    /*.run     =*/ ggml_rknpure_accel_run,
+    /*.finish  =*/ ggml_rknpure_accel_finish,
+};
+#endif
+
+// Stands in for an accelerator: thread 0 computes the rows, then sleeps until
+// they took as long as they would at GGML_FAKE_ACCEL_GFLOPS.
+static bool ggml_fake_accel_supports(const struct ggml_tensor * dst) {
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    return fake_accel_gflops > 0.0f &&
+        ggml_n_dims(src0) <= 2 && src1->ne[2] == 1 && src1->ne[3] == 1 &&
+        ggml_is_contiguous(src1) && src1->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32 &&
+        type_traits[src0->type].vec_dot && !type_traits[src0->type].gemv;
+}
+
+static void ggml_fake_accel_tile(const struct ggml_tensor * dst, int64_t * tile, int64_t * align) {
+    *tile = dst->ne[0];
+    *align = 16;
+}
+
+static void ggml_fake_accel_prepare(const struct ggml_compute_params * params, struct ggml_tensor * dst) {
+    UNUSED(params);
+    UNUSED(dst);
+}
+
+static void ggml_compute_forward_mul_mat_one_chunk(
+    const struct ggml_compute_params * params, struct ggml_tensor * dst, const int64_t num_rows_per_vec_dot,
+    const int64_t ir0_start, const int64_t ir0_end, const int64_t ir1_start, const int64_t ir1_end);
+
+static void ggml_fake_accel_run(const struct ggml_compute_params * params, struct ggml_tensor * dst) {
+    const int64_t start = ggml_time_us();
+    const int64_t rows = ggml_get_op_params_i32(dst, 0);
+    ggml_compute_forward_mul_mat_one_chunk(params, dst, 1, 0, rows, 0, dst->ne[1]);
+
+    const double flops = 2.0 * rows * dst->src[0]->ne[0] * dst->ne[1];
+    const int64_t left = (int64_t)(flops / ((double)fake_accel_gflops * 1e3)) - (ggml_time_us() - start);
+    if (left > 0) {
+        struct timespec ts = { left / 1000000, left % 1000000 * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void ggml_fake_accel_finish(const struct ggml_compute_params * params, struct ggml_tensor * dst) {
+    UNUSED(params);
+    UNUSED(dst);
+}
+
+static const struct ggml_mul_mat_accel ggml_fake_accel = {
+    /*.tile    =*/ ggml_fake_accel_tile,
+    /*.prepare =*/ ggml_fake_accel_prepare,
+    /*.run     =*/ ggml_fake_accel_run,
+    /*.finish  =*/ ggml_fake_accel_finish,
+};
+
+// learned shares, direct mapped by shape
+#define GGML_MUL_MAT_SPLIT_NR 256
+
+struct ggml_mul_mat_split {
+    int64_t m, k, n;
+    enum ggml_type type;
+    // accelerator's share of the rows, moved towards both sides finishing together
+    float share;
+    int   runs;
+};
+
+static struct ggml_mul_mat_split mul_mat_splits[GGML_MUL_MAT_SPLIT_NR];
+
+// call in the critical section
+static struct ggml_mul_mat_split * ggml_mul_mat_split_find(const struct ggml_tensor * dst, bool create) {
+    const int64_t m = dst->ne[1];
+    const int64_t k = dst->src[0]->ne[0];
+    const int64_t n = dst->ne[0];
+    const enum ggml_type type = dst->src[0]->type;
+
+    const uint64_t h = (uint64_t)m * 0x9e3779b97f4a7c15ull ^ (uint64_t)k * 0xc2b2ae3d27d4eb4full ^
+                       (uint64_t)n * 0x165667b19e3779f9ull ^ (uint64_t)type;
+    struct ggml_mul_mat_split * split = &mul_mat_splits[h % GGML_MUL_MAT_SPLIT_NR];
+    if (split->runs && split->m == m && split->k == k && split->n == n && split->type == type) {
+        return split;
+    }
+    if (!create) {
+        return NULL;
+    }
+    // a new shape takes over the slot, starting from an even split
+    *split = (struct ggml_mul_mat_split) { m, k, n, type, 0.5f, 0 };
+    return split;
+}
+
+float ggml_mul_mat_split_share(int64_t m, int64_t k, int64_t n, enum ggml_type type) {
+    struct ggml_tensor src0 = { .type = type, .ne = { k, n, 1, 1 } };
+    struct ggml_tensor dst = { .ne = { n, m, 1, 1 }, .src = { &src0 } };
+
+    ggml_critical_section_start();
+    struct ggml_mul_mat_split * split = ggml_mul_mat_split_find(&dst, false);
+    float share = split ? split->share : -1.0f;
+    ggml_critical_section_end();
+    return share;
+}
+
+// accelerator rows per tile
+static int64_t ggml_mul_mat_split_rows(const struct ggml_tensor * dst, int64_t tile, int64_t align) {
+    if (mul_mat_split_mode == GGML_MUL_MAT_SPLIT_OFF) {
+        return tile;
+    }
+    if (mul_mat_split_mode == GGML_MUL_MAT_SPLIT_FIXED) {
+        return MIN((int64_t)(mul_mat_split_fixed * tile / align + 0.5f) * align, tile);
+    }
+    // both sides keep some rows, so both keep being measured
+    if (tile < 2 * align) {
+        return tile;
+    }
+    ggml_critical_section_start();
+    const float share = ggml_mul_mat_split_find(dst, true)->share;
+    ggml_critical_section_end();
+    const int64_t rows = (int64_t)(share * tile / align + 0.5f) * align;
+    return MIN(MAX(rows, align), (tile - align) / align * align);
+}
+
+static void ggml_mul_mat_split_learn(const struct ggml_tensor * dst, int64_t tile, int64_t rows, int64_t accel_us, int64_t cpu_us) {
+    const int64_t nr0 = dst->ne[0];
+
+    int64_t accel_rows = 0;
+    for (int64_t i0 = 0; i0 < nr0; i0 += tile) {
+        accel_rows += MIN(rows, nr0 - i0);
+    }
+    const int64_t cpu_rows = nr0 - accel_rows;
+    if (!accel_rows || !cpu_rows || accel_us <= 0 || cpu_us <= 0) {
+        return;
+    }
+
+    // the share that would have had both finish at once at these speeds
+    const double accel_speed = (double)accel_rows / accel_us;
+    const double cpu_speed = (double)cpu_rows / cpu_us;
+    const float target = accel_speed / (accel_speed + cpu_speed);
+
+    ggml_critical_section_start();
+    struct ggml_mul_mat_split * split = ggml_mul_mat_split_find(dst, true);
+    // the first measurement replaces the guess, later ones are averaged in
+    split->share += (split->runs ? 0.3f : 1.0f) * (target - split->share);
+    split->runs++;
+    ggml_critical_section_end();
+}
+
+static void ggml_compute_forward_mul_mat_split(
+        const struct ggml_compute_params * params,
+              struct ggml_tensor * dst,
+        const struct ggml_mul_mat_accel * accel) {
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+    struct ggml_threadpool * tp = params->threadpool;
+
+    enum ggml_type    const vec_dot_type = type_traits[src0->type].vec_dot_type;
+    ggml_from_float_t const from_float   = type_traits[vec_dot_type].from_float;
+
+    GGML_ASSERT(ne02 == 1 && ne03 == 1 && ne12 == 1 && ne13 == 1);
+    GGML_ASSERT(nb00 == ggml_type_size(src0->type));
+    GGML_ASSERT(nb0 == sizeof(float));
+
+    int64_t tile, align;
+    accel->tile(dst, &tile, &align);
+
+    const int64_t nr0 = ne0;
+    const int64_t nr1 = ne1;
+    const int64_t chunk_size = nr1 == 1 ? 64 : 16;
+    // CPU chunks: the rows of every tile past the accelerator's, times src1 columns
+    int64_t rows = 0;
+    int64_t nchunk0_tile = 0;
+    int64_t nchunk0 = 0;
+    int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
+
+    if (ith == 0) {
+        // a lone thread has to run the accelerator before it gets to any CPU rows
+        ggml_set_op_params_i32(dst, 0, (int32_t)(nth > 1 ? ggml_mul_mat_split_rows(dst, tile, align) : tile));
+        atomic_store_explicit(&tp->current_chunk, 0, memory_order_relaxed);
+        atomic_store_explicit(&tp->split_chunks_done, 0, memory_order_relaxed);
+        atomic_store_explicit(&tp->split_cpu_us, 0, memory_order_relaxed);
+    }
+
+    if (src1->type != vec_dot_type) {
+        const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
+        for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
+            from_float((float *)((char *) src1->data + i11*nb11), (void *)((char *) params->wdata + i11*nbw1), ne10);
+        }
+    }
+
+    ggml_barrier(tp);
+
+    rows = ggml_get_op_params_i32(dst, 0);
+    nchunk0_tile = (tile - rows + chunk_size - 1) / chunk_size;
+    nchunk0 = nchunk0_tile * ((nr0 + tile - 1) / tile);
+    if (rows) {
+        accel->prepare(params, dst);
+    }
+
+    ggml_barrier(tp);
+
+    const int64_t start = ggml_time_us();
+    int64_t accel_us = 0;
+    if (ith == 0 && rows) {
+        accel->run(params, dst);
+        accel_us = ggml_time_us() - start;
+    }
+
+    // thread 0 joins once the accelerator is done
+    for (int64_t chunk = atomic_fetch_add_explicit(&tp->current_chunk, 1, memory_order_relaxed);
+         chunk < nchunk0 * nchunk1;
+         chunk = atomic_fetch_add_explicit(&tp->current_chunk, 1, memory_order_relaxed)) {
+        const int64_t ith0 = chunk % nchunk0;
+        const int64_t ith1 = chunk / nchunk0;
+
+        const int64_t tile_start = ith0 / nchunk0_tile * tile;
+        const int64_t ir0_start = tile_start + rows + ith0 % nchunk0_tile * chunk_size;
+        const int64_t ir0_end = MIN(MIN(ir0_start + chunk_size, tile_start + tile), nr0);
+
+        const int64_t ir1_start = ith1 * chunk_size;
+        const int64_t ir1_end = MIN(ir1_start + chunk_size, nr1);
+
+        ggml_compute_forward_mul_mat_one_chunk(params, dst, 1, ir0_start, ir0_end, ir1_start, ir1_end);
+
+        if (atomic_fetch_add_explicit(&tp->split_chunks_done, 1, memory_order_relaxed) == nchunk0 * nchunk1 - 1) {
+            atomic_store_explicit(&tp->split_cpu_us, (int)(ggml_time_us() - start), memory_order_relaxed);
+        }
+    }
+
+    ggml_barrier(tp);
+
+    if (rows) {
+        accel->finish(params, dst);
+    }
+    if (ith == 0 && nth > 1 && mul_mat_split_mode == GGML_MUL_MAT_SPLIT_AUTO) {
+        ggml_mul_mat_split_learn(dst, tile, rows, accel_us, atomic_load_explicit(&tp->split_cpu_us, memory_order_relaxed));
+    }
+}
 
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
@@ -12862,6 +13183,10 @@ static void ggml_compute_forward_mul_mat(
     const int nth = params->nth;
 
 #ifdef GGML_USE_RKNPURE
+    if (ggml_backend_rknpure_supports_op_out(dst) && mul_mat_split_mode != GGML_MUL_MAT_SPLIT_OFF) {
+        ggml_compute_forward_mul_mat_split(params, dst, &ggml_rknpure_accel);
+        return;
+    }
     if (ggml_backend_rknpure_supports_op_out(dst)) {
         rknpu2_matmul_begin_measure(ith);
         rknpu2_matmul_pre0(dst, nth, ith);
@@ -12879,6 +13204,10 @@ static void ggml_compute_forward_mul_mat(
         return;
     }
 #endif
+    if (ggml_fake_accel_supports(dst)) {
+        ggml_compute_forward_mul_mat_split(params, dst, &ggml_fake_accel);
+        return;
+    }
 
     const enum ggml_type type = src0->type;
 
@@ -20265,6 +20594,11 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+#ifdef GGML_USE_RKNPURE
+    // the NPU submitters go on the threadpool's cpus too
+    rknpu2_matmul_set_cpumask(tpp->cpumask);
+#endif
+
     // Allocate and init workers state
     const size_t workers_size = sizeof(struct ggml_compute_state) * tpp->n_threads;
     struct ggml_compute_state * workers = GGML_ALIGNED_MALLOC(workers_size);
@@ -22970,6 +23304,12 @@ void gguf_set_val_u32(struct gguf_context * ctx, const char * key, uint32_t val)
 
     ctx->kv[idx].type         = GGUF_TYPE_UINT32;
     ctx->kv[idx].value.uint32 = val;
+
+    // offsets of tensors added from now on follow the new alignment
+    if (strcmp(key, "general.alignment") == 0) {
+        GGML_ASSERT(val > 0 && (val & (val - 1)) == 0);
+        ctx->alignment = val;
+    }
 }
 
 void gguf_set_val_i32(struct gguf_context * ctx, const char * key, int32_t val) {
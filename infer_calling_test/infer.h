@@ -9,6 +9,14 @@ extern "C" {
 int infer(int argc, char **argv, char *input, size_t input_len, char *output,
           size_t output_len);
 
+// Keeps the model, context and KV cache loaded between calls; a run only
+// evaluates the part of its prompt not shared with the previous one.
+struct infer_session;
+struct infer_session *infer_session_create(int argc, char **argv);
+int infer_session_run(struct infer_session *session, char *input,
+                      size_t input_len, char *output, size_t output_len);
+void infer_session_destroy(struct infer_session *session);
+
 #ifdef __cplusplus
 }
 #endif
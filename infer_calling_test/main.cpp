@@ -1,4 +1,5 @@
 #include "infer.h"
+#include <cstdlib>
 #include <iostream>
 
 // define a static buffer to store the input and output
@@ -6,17 +7,32 @@ static char input[1024] = "";
 static char output[1024] = "";
 
 int main(int argc, char *argv[]) {
+  // INFER_COLD=1 reloads everything per question, like the old client
+  const char *cold = getenv("INFER_COLD");
+  struct infer_session *session = NULL;
+  if (!cold || atoi(cold) == 0) {
+    session = infer_session_create(argc, argv);
+    if (!session) {
+      std::cerr << "failed to create infer session" << std::endl;
+      return 1;
+    }
+  }
+
   // infinite loop to keep the program running
   while (true) {
     // get the input from the user
     std::cout << "Please input your question" << std::endl;
-    std::cin.getline(input, 1024);
+    if (!std::cin.getline(input, 1024))
+      break;
 
     // call the infer function
-    int ret = infer(argc, argv, input, 1024, output, 1024);
+    output[0] = '\0';
+    int ret = session ? infer_session_run(session, input, 1024, output, 1024)
+                      : infer(argc, argv, input, 1024, output, 1024);
 
     std::cerr << "infer returned with error code: " << ret << std::endl;
     std::cout << "output: " << output << std::endl;
   }
+  infer_session_destroy(session);
   return 0;
 }
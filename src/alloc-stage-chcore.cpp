@@ -79,6 +79,7 @@ public:
     AllocTask(size_t size, vaddr_t vaddr, int cma_index = -1): size(size), vaddr(vaddr), cma_index(cma_index) {
 
     }
+    size_t bytes(void) override { return size; }
     void step(void) override {
 #ifdef TZ_LLM_MEASURE
         auto start = get_micro();
@@ -100,7 +101,7 @@ public:
 
 std::atomic<int> last_pos;
 
-AllocStage::AllocStage(size_t off, size_t len): addr(NULL) {
+AllocStage::AllocStage(size_t off, size_t len): Stage(STAGE_ALLOC), addr(NULL) {
     size = io_align_up(off + len) - io_align_down(off);
     addr = (void *)chcore_alloc_vaddr(size);
     msg.buf = addr;
@@ -162,18 +163,17 @@ std::pair<std::shared_ptr<Task>, bool> AllocStage::get_task(void *arg)
     }
     get_nr[cma_index]++;
 
-    auto task = std::make_shared<AllocTask>(ROUND_UP(std::min(BLOCK_SIZE, size - submit_pos), PAGE_SIZE), (vaddr_t)addr + submit_pos, cma_index);
+    auto task = make_task<AllocTask>(ROUND_UP(std::min(BLOCK_SIZE, size - submit_pos), PAGE_SIZE), (vaddr_t)addr + submit_pos, cma_index);
     submit_pos += BLOCK_SIZE;
     return { task, submit_pos >= size };
 }
 
 bool AllocStage::submit(std::shared_ptr<Task> task)
 {
-    AllocTask *alloc_task = dynamic_cast<AllocTask *>(task.get());
-    GGML_ASSERT(alloc_task);
+    AllocTask *alloc_task = static_cast<AllocTask *>(task.get());
     {
         std::lock_guard<std::mutex> _(gather_mtx);
-        msg.cma_indexes.push_back({alloc_task->cma_index, alloc_task->entry_index, alloc_task->vaddr - (vaddr_t)addr, alloc_task->size});
+        msg.cma_indexes.push_back({alloc_task->cma_index, alloc_task->entry_index, alloc_task->vaddr - (vaddr_t)addr, alloc_task->size, 0});
         msg.paddr[alloc_task->cma_index].push_back({
             tzasc_cma_meta_arr[alloc_task->cma_index].entry[alloc_task->entry_index].paddr,
             tzasc_cma_meta_arr[alloc_task->cma_index].entry[alloc_task->entry_index].paddr + alloc_task->size
@@ -8,20 +8,18 @@
 #include <thread>
 #include <mutex>
 #include "interface.h"
+#include "secure-mem.h"
 
-static int tzd_fd;
 static int shm_fd;
 static std::once_flag once_flag;
 static all_ring_buffer *task_queues;
 
-#define DEVICE_NAME "/dev/tc_ns_client"
-
 void ca_backend_init(const char *io_model_path) {
-    tzd_fd = open(DEVICE_NAME, O_RDWR);
-    GGML_ASSERT(tzd_fd >= 0);
-    void *addr = mmap(NULL, CMD_QUEUE_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, tzd_fd, 0);
-    GGML_ASSERT(addr != MAP_FAILED);
-    task_queues = (struct all_ring_buffer *)addr;
+    // the emulated queue lives in the frontend process, which runs the io
+    // backend itself
+    if (secure_mem_is_emulated())
+        GGML_ABORT("a separate CA backend can't be used with the TEE emulation");
+    task_queues = secure_mem_provider()->map_cmd_queue();
     task_queues->init();
     extern void io_init(const char *model_path);
     io_init(io_model_path);
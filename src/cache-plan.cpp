@@ -0,0 +1,130 @@
+#include "cache-plan.h"
+#include "crypto.h"
+#include "interface.h"
+#include "pipeline.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+// alloc, io round trip and scheduling of one tensor
+#define PLAN_TENSOR_OVERHEAD_US (200.0)
+
+struct plan_model {
+    // us per byte
+    double stream;
+    double compute;
+};
+
+static double env_mbps(const char *name, double def) {
+    const char *env = getenv(name);
+    return env && atof(env) > 0 ? atof(env) : def;
+}
+
+static double measure_decrypt_mbps(void) {
+    std::vector<unsigned char> buf(8UL << 20), out(buf.size());
+    // the first pass sets up the thread's cipher context
+    aes_256_ctr_crypt(out.data(), buf.data(), CRYPTO_CHUNK_DEFAULT, 0);
+    auto start = get_micro();
+    for (size_t off = 0; off < buf.size(); off += CRYPTO_CHUNK_DEFAULT)
+        aes_256_ctr_crypt(out.data() + off, buf.data() + off, CRYPTO_CHUNK_DEFAULT, off);
+    auto elapsed = std::max<int64_t>(get_micro() - start, 1);
+    return (double)buf.size() / elapsed;
+}
+
+static double simulate(const std::vector<cache_plan_tensor> &tensors, const plan_model &model) {
+    // request time at which streaming / compute reach the current tensor
+    double ready = 0, now = 0, stall = 0;
+    for (auto &tensor : tensors) {
+        if (!tensor.pinned) {
+            ready += PLAN_TENSOR_OVERHEAD_US + tensor.size * model.stream;
+            if (ready > now) {
+                stall += ready - now;
+                now = ready;
+            }
+        }
+        now += tensor.size * model.compute;
+    }
+    return stall;
+}
+
+static double plan(std::vector<cache_plan_tensor> &tensors, size_t budget);
+
+double cache_plan(std::vector<cache_plan_tensor> &tensors, size_t budget) {
+    std::vector<size_t> index(tensors.size());
+    for (size_t i = 0; i < index.size(); i++)
+        index[i] = i;
+    std::stable_sort(index.begin(), index.end(), [&tensors](size_t a, size_t b) {
+        return tensors[a].order < tensors[b].order;
+    });
+    std::vector<cache_plan_tensor> sorted;
+    for (size_t i : index)
+        sorted.push_back(tensors[i]);
+    double stall = plan(sorted, budget);
+    for (size_t i = 0; i < index.size(); i++)
+        tensors[index[i]].pinned = sorted[i].pinned;
+    return stall;
+}
+
+static double plan(std::vector<cache_plan_tensor> &tensors, size_t budget) {
+    double io_mbps = env_mbps("LLAMA_PLAN_IO_MBPS", 1000);
+    double decrypt_mbps = decrypt_enabled() ? env_mbps("LLAMA_PLAN_DECRYPT_MBPS", 0) : 0;
+    if (decrypt_enabled() && !decrypt_mbps)
+        decrypt_mbps = measure_decrypt_mbps();
+    double compute_mbps = env_mbps("LLAMA_PLAN_COMPUTE_MBPS", 2000);
+    // io and decryption overlap, the slower one sets the pace
+    plan_model model = {
+        std::max(1.0 / io_mbps, decrypt_mbps ? 1.0 / decrypt_mbps : 0.0),
+        1.0 / compute_mbps,
+    };
+
+    // what pinning in registration order would have given
+    size_t used = 0;
+    for (auto &tensor : tensors) {
+        tensor.pinned = used + tensor.size <= budget;
+        if (tensor.pinned)
+            used += tensor.size;
+    }
+    double prefix_stall = simulate(tensors, model);
+
+    for (auto &tensor : tensors)
+        tensor.pinned = false;
+    used = 0;
+    double stall = simulate(tensors, model);
+    while (stall > 0) {
+        int best = -1;
+        double best_gain = 0, best_stall = stall;
+        for (size_t i = 0; i < tensors.size(); i++) {
+            auto &tensor = tensors[i];
+            if (tensor.pinned || used + tensor.size > budget)
+                continue;
+            tensor.pinned = true;
+            double new_stall = simulate(tensors, model);
+            tensor.pinned = false;
+            double gain = (stall - new_stall) / tensor.size;
+            if (gain > best_gain) {
+                best = i;
+                best_gain = gain;
+                best_stall = new_stall;
+            }
+        }
+        if (best < 0)
+            break;
+        tensors[best].pinned = true;
+        used += tensors[best].size;
+        stall = best_stall;
+    }
+    // nothing stalls any more, spend the rest like before: earliest first
+    for (auto &tensor : tensors) {
+        if (!tensor.pinned && used + tensor.size <= budget) {
+            tensor.pinned = true;
+            used += tensor.size;
+        }
+    }
+
+    int pinned_nr = std::count_if(tensors.begin(), tensors.end(), [](const cache_plan_tensor &t) { return t.pinned; });
+    printf("cache_plan: pin %lu of %lu MB (%d tensors), io %.0f MB/s, decrypt %.0f MB/s, compute %.0f MB/s\n",
+           used >> 20, budget >> 20, pinned_nr, io_mbps, decrypt_mbps, compute_mbps);
+    printf("cache_plan: predicted use wait io time %.1f ms (%.1f ms pinning in order)\n", stall / 1000,
+           prefix_stall / 1000);
+    return stall;
+}
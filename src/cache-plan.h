@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Picks which tensors to load before the first request (the cache_p budget)
+// by simulating the request: compute consumes tensors in order, unpinned ones
+// stream in behind it, and each time a tensor isn't ready yet the compute
+// stalls. Tensors are pinned greedily by the stall they remove per byte.
+//
+// The model reads
+//   LLAMA_PLAN_IO_MBPS       read bandwidth (default 1000)
+//   LLAMA_PLAN_DECRYPT_MBPS  decrypt bandwidth (default: measured on one thread)
+//   LLAMA_PLAN_COMPUTE_MBPS  weight bytes compute consumes per second (default 2000)
+
+struct cache_plan_tensor {
+    size_t size;
+    // position in the compute timeline, smaller is consumed first
+    int64_t order;
+    bool pinned;
+};
+
+// sets pinned on the chosen tensors, returns the predicted stall in us
+double cache_plan(std::vector<cache_plan_tensor> &tensors, size_t budget);
@@ -1,179 +1,173 @@
 #include "crypto.h"
 #include "interface.h"
+#include <algorithm>
 #include <cstring>
-#include <optional>
-#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include "ggml.h"
 
 #include <openssl/evp.h>
 #include <openssl/aes.h>
+#include <openssl/rand.h>
 
-EVP_CIPHER_CTX* ctx = NULL;
 unsigned char my_key[256] = {0xA, 0xB, 0xC, 0xD, 0xE, 0xF, 0x0, 0x1};
-unsigned char initial_vector[128] = {0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0x10};
+// the low half of the counter block carries the offset
+static const unsigned char nonce_prefix[8] = {0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0x10};
 
-void decrypt_block(const unsigned char* ciphertext, unsigned char* plaintext, const unsigned char* key, const unsigned char* iv) {
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
-
-    int len;
-    EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, AES_BLOCK_SIZE);
+struct tensor_tags {
+    std::vector<unsigned char> tags;
+    size_t n_chunks;
+};
 
-    EVP_CIPHER_CTX_free(ctx);
+static bool container;
+static size_t container_chunk_size;
+static unsigned char container_salt[CRYPTO_KEY_SALT_SIZE];
+static std::unordered_map<size_t, tensor_tags> container_tags;
+
+bool crypto_load_container(const struct gguf_context *ctx) {
+    int cipher_id = gguf_find_key(ctx, CRYPTO_KV_CIPHER);
+    if (cipher_id < 0)
+        return false;
+    if (strcmp(gguf_get_val_str(ctx, cipher_id), CRYPTO_CIPHER_NAME) != 0)
+        GGML_ABORT("unsupported model cipher %s", gguf_get_val_str(ctx, cipher_id));
+
+    int chunk_id = gguf_find_key(ctx, CRYPTO_KV_CHUNK_SIZE);
+    int salt_id = gguf_find_key(ctx, CRYPTO_KV_KEY_SALT);
+    GGML_ASSERT(chunk_id >= 0 && salt_id >= 0);
+    container_chunk_size = gguf_get_val_u32(ctx, chunk_id);
+    GGML_ASSERT(gguf_get_arr_type(ctx, salt_id) == GGUF_TYPE_UINT8);
+    GGML_ASSERT(gguf_get_arr_n(ctx, salt_id) == CRYPTO_KEY_SALT_SIZE);
+    memcpy(container_salt, gguf_get_arr_data(ctx, salt_id), CRYPTO_KEY_SALT_SIZE);
+    GGML_ASSERT(container_chunk_size > 0 && container_chunk_size % 4096 == 0);
+
+    container_tags.clear();
+    size_t data_off = gguf_get_data_offset(ctx);
+    for (int i = 0; i < gguf_get_n_tensors(ctx); i++) {
+        std::string key = std::string(CRYPTO_KV_TAGS) + gguf_get_tensor_name(ctx, i);
+        int tags_id = gguf_find_key(ctx, key.c_str());
+        if (tags_id < 0)
+            GGML_ABORT("encrypted model has no tags for tensor %s", gguf_get_tensor_name(ctx, i));
+        GGML_ASSERT(gguf_get_arr_type(ctx, tags_id) == GGUF_TYPE_UINT8);
+        size_t n = gguf_get_arr_n(ctx, tags_id);
+        GGML_ASSERT(n % CRYPTO_GCM_TAG_SIZE == 0);
+        auto data = (const unsigned char *)gguf_get_arr_data(ctx, tags_id);
+        container_tags[data_off + gguf_get_tensor_offset(ctx, i)] = {
+            std::vector<unsigned char>(data, data + n),
+            n / CRYPTO_GCM_TAG_SIZE,
+        };
+    }
+    container = true;
+    printf("%s: aes-256-gcm container, %lu KB chunks, %lu tensors\n", __func__,
+           container_chunk_size >> 10, container_tags.size());
+    return true;
 }
 
-// Function to decrypt a range of blocks
-void decrypt_blocks(
-    const unsigned char *ciphertext,
-    unsigned char *plaintext,
-    const unsigned char* key,
-    const unsigned char* iv,
-    int start,
-    int end
-) {
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-
-    GGML_ASSERT(EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) == 1);
+bool crypto_is_container(void) {
+    return container;
+}
 
-    int len;
-    GGML_ASSERT(EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, end - start) == 1);
+const unsigned char *crypto_key_salt(void) {
+    return container_salt;
+}
 
-    if ((end - start) % AES_BLOCK_SIZE) {
-        GGML_ASSERT(EVP_DecryptFinal_ex(ctx, plaintext + len, &len) == 1);
-    }
+void crypto_new_key_salt(unsigned char *salt) {
+    GGML_ASSERT(RAND_bytes(salt, CRYPTO_KEY_SALT_SIZE) == 1);
+}
 
-    EVP_CIPHER_CTX_free(ctx);
+const unsigned char *crypto_tensor_tags(size_t off, size_t *n_chunks) {
+    auto iter = container_tags.find(off);
+    if (iter == container_tags.end())
+        return NULL;
+    *n_chunks = iter->second.n_chunks;
+    return iter->second.tags.data();
 }
 
-const size_t BLOCK_SIZE = 4096;
-thread_local unsigned char out[BLOCK_SIZE + 32];
-
-std::atomic<int64_t> decrypt_time = 0;
-std::atomic<size_t> decrypt_size = 0;
-
-void aes_256_ecb_decrypt(void *dst, const void *src, size_t count) {
-    auto start = get_micro();
-    unsigned char fake_iv[AES_BLOCK_SIZE];
-    decrypt_blocks((const unsigned char *)src, out, my_key, fake_iv, 0, count);
-    memcpy(dst, src, count);
-#ifdef TZ_LLM_MEASURE
-    decrypt_time += get_micro() - start;
-    decrypt_size += count;
-#endif
+size_t crypto_chunk_size(void) {
+    if (container)
+        return container_chunk_size;
+    static size_t chunk_size = [] {
+        const char *env = getenv("LLAMA_DECRYPT_CHUNK_KB");
+        size_t size = env ? (size_t)atol(env) << 10 : CRYPTO_CHUNK_DEFAULT;
+        size = std::clamp(size, CRYPTO_CHUNK_MIN, CRYPTO_CHUNK_MAX);
+        return size / 4096 * 4096;
+    }();
+    return chunk_size;
 }
 
-const char FAKE_KEY = 0;
-void fake_decrypt(void *dst, const void *src, size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        ((char *)dst)[i] = ((const char *)src)[i] ^ FAKE_KEY;
+static void put_be64(unsigned char *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
     }
 }
 
-struct decrypt_unit {
-    void *dst;
-    const void *src;
-    size_t count;
-
-    decrypt_unit(void *dst, const void *src, size_t count)
-        : dst(dst), src(src), count(count) {}
-};
-
-struct decrypt_state {
-    void *dst;
-    const void *src;
-    size_t count;
-    std::mutex lock;
-    std::queue<decrypt_unit> unit_queue;
-    std::atomic<int> unfinished;
-
-    decrypt_state(void *dst, const void *src, size_t count)
-        : dst(dst), src(src), count(count) {
-        for (size_t i = 0; i < count; i += BLOCK_SIZE) {
-            size_t remain = count - i;
-            if (remain > BLOCK_SIZE)
-                remain = BLOCK_SIZE;
-            unit_queue.emplace((char *)dst + i, (char *)src + i, remain);
-        }
-        this->unfinished = unit_queue.size();
+// One context per thread and cipher, keyed once; each chunk only sets a new IV.
+struct cipher_ctx {
+    EVP_CIPHER_CTX *ctx;
+    cipher_ctx(const EVP_CIPHER *cipher, bool encrypt) {
+        ctx = EVP_CIPHER_CTX_new();
+        GGML_ASSERT(ctx);
+        GGML_ASSERT(EVP_CipherInit_ex(ctx, cipher, NULL, my_key, NULL, encrypt) == 1);
     }
-
-    std::optional<decrypt_unit> next_unit(void) {
-        std::lock_guard<std::mutex> _(this->lock);
-        if (unit_queue.empty()) {
-            return std::nullopt;
-        } else {
-            auto unit = unit_queue.front();
-            unit_queue.pop();
-            return unit;
-        }
-    }
-
-    bool is_finished(void) {
-        return this->unfinished == 0;
+    ~cipher_ctx(void) {
+        EVP_CIPHER_CTX_free(ctx);
     }
 };
 
-static void do_decrypt(decrypt_unit &unit, std::shared_ptr<decrypt_state> state) {
-    // fake_decrypt(unit.dst, unit.src, unit.count);
-    aes_256_ecb_decrypt(unit.dst, unit.src, unit.count);
-    GGML_ASSERT(state->unfinished > 0);
-    state->unfinished--;
+void aes_256_ctr_crypt(void *dst, const void *src, size_t count, size_t off) {
+    static thread_local cipher_ctx ctr(EVP_aes_256_ctr(), false);
+    GGML_ASSERT(off % AES_BLOCK_SIZE == 0);
+
+    unsigned char iv[AES_BLOCK_SIZE];
+    memcpy(iv, nonce_prefix, sizeof(nonce_prefix));
+    put_be64(iv + sizeof(nonce_prefix), off / AES_BLOCK_SIZE);
+    GGML_ASSERT(EVP_CipherInit_ex(ctr.ctx, NULL, NULL, NULL, iv, -1) == 1);
+
+    int len;
+    GGML_ASSERT(EVP_CipherUpdate(ctr.ctx, (unsigned char *)dst, &len, (const unsigned char *)src, count) == 1);
 }
 
-void crypto_mgr::decrypt_step(void) {
-    std::shared_ptr<decrypt_state> state;
-    std::optional<decrypt_unit> unit;
-
-    {
-        std::lock_guard<std::mutex> _(task_queue_lock);
-        if (task_queue.empty()) {
-            unit = std::nullopt;
-        } else {
-            state = task_queue.front();
-            unit = state->next_unit();
-            if (!unit.has_value()) {
-                task_queue.pop();
-            }
+// A GCM context keyed for one container. The key only changes with the
+// salt, so the thread's context is re-keyed when it moves to another file.
+struct gcm_ctx : cipher_ctx {
+    unsigned char salt[CRYPTO_KEY_SALT_SIZE];
+    bool keyed = false;
+    gcm_ctx(bool encrypt) : cipher_ctx(EVP_aes_256_gcm(), encrypt) {}
+    void set_iv(const unsigned char *key_salt, size_t off) {
+        const unsigned char *key = NULL;
+        unsigned char file_key[32];
+        if (!keyed || memcmp(salt, key_salt, CRYPTO_KEY_SALT_SIZE) != 0) {
+            unsigned char material[sizeof(my_key) + CRYPTO_KEY_SALT_SIZE];
+            memcpy(material, my_key, sizeof(my_key));
+            memcpy(material + sizeof(my_key), key_salt, CRYPTO_KEY_SALT_SIZE);
+            GGML_ASSERT(EVP_Digest(material, sizeof(material), file_key, NULL, EVP_sha256(), NULL) == 1);
+            memcpy(salt, key_salt, CRYPTO_KEY_SALT_SIZE);
+            keyed = true;
+            key = file_key;
         }
+        unsigned char iv[12] = {0};
+        put_be64(iv + 4, off);
+        GGML_ASSERT(EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, -1) == 1);
     }
-    if (!unit.has_value()) {
-        return;
-    }
+};
 
-    do_decrypt(unit.value(), state);
-}
+void aes_256_gcm_encrypt(void *dst, const void *src, size_t count, size_t off, const unsigned char *key_salt, unsigned char *tag) {
+    static thread_local gcm_ctx gcm(true);
+    gcm.set_iv(key_salt, off);
 
-void crypto_mgr::launch_decrypt(void *dst, const void *src, size_t count) {
-    std::lock_guard<std::mutex> _(decrypt_states_lock);
-    if (decrypt_states.find(dst) != decrypt_states.end()) return;
-    GGML_ASSERT(decrypt_states.find(dst) == decrypt_states.end());
-    auto state = std::make_shared<decrypt_state>(dst, src, count);
-    decrypt_states.emplace(dst, state);
-    task_queue.push(state);
+    int len;
+    GGML_ASSERT(EVP_CipherUpdate(gcm.ctx, (unsigned char *)dst, &len, (const unsigned char *)src, count) == 1);
+    GGML_ASSERT(EVP_CipherFinal_ex(gcm.ctx, (unsigned char *)dst + len, &len) == 1);
+    GGML_ASSERT(EVP_CIPHER_CTX_ctrl(gcm.ctx, EVP_CTRL_GCM_GET_TAG, CRYPTO_GCM_TAG_SIZE, tag) == 1);
 }
 
-void crypto_mgr::wait_decrypt(void *dst) {
-    std::shared_ptr<decrypt_state> state;
-    {
-        std::lock_guard<std::mutex> _(decrypt_states_lock);
-        auto iter = decrypt_states.find(dst);
-        GGML_ASSERT(iter != decrypt_states.end());
-        state = iter->second;
-    }
-    while (true) {
-        if (state->unfinished == 0) {
-            return;
-        }
-        auto unit = state->next_unit();
-        if (unit.has_value()) {
-            do_decrypt(unit.value(), state);
-        }
-    }
-}
+bool aes_256_gcm_decrypt(void *dst, const void *src, size_t count, size_t off, const unsigned char *key_salt, const unsigned char *tag) {
+    static thread_local gcm_ctx gcm(false);
+    gcm.set_iv(key_salt, off);
 
-void crypto_mgr::finish_decrypt(void *dst) {
-    std::lock_guard<std::mutex> _(decrypt_states_lock);
-    auto iter = decrypt_states.find(dst);
-    GGML_ASSERT(iter != decrypt_states.end());
-    decrypt_states.erase(iter);
+    int len;
+    GGML_ASSERT(EVP_CipherUpdate(gcm.ctx, (unsigned char *)dst, &len, (const unsigned char *)src, count) == 1);
+    GGML_ASSERT(EVP_CIPHER_CTX_ctrl(gcm.ctx, EVP_CTRL_GCM_SET_TAG, CRYPTO_GCM_TAG_SIZE, (void *)tag) == 1);
+    return EVP_CipherFinal_ex(gcm.ctx, (unsigned char *)dst + len, &len) == 1;
 }
@@ -1,18 +1,52 @@
-#include <mutex>
-#include <queue>
-#include <unordered_map>
-#include <memory>
-
-struct decrypt_state;
-
-struct crypto_mgr {
-    std::mutex task_queue_lock;
-    std::queue<std::shared_ptr<decrypt_state>> task_queue;
-    std::mutex decrypt_states_lock;
-    std::unordered_map<void *, std::shared_ptr<decrypt_state>> decrypt_states;
-
-    void launch_decrypt(void *dst, const void *src, size_t count);
-    void wait_decrypt(void *dst);
-    void finish_decrypt(void *dst);
-    void decrypt_step(void);
-};
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Weights are encrypted with a seekable mode so every chunk decrypts on its
+// own: the AES-CTR counter and the AES-GCM nonce both derive from the chunk's
+// offset in the model file. Cipher contexts are created once per thread and
+// only re-IVed per chunk.
+
+#define CRYPTO_CHUNK_MIN (64UL << 10)
+#define CRYPTO_CHUNK_MAX (1UL << 20)
+#define CRYPTO_CHUNK_DEFAULT (256UL << 10)
+#define CRYPTO_GCM_TAG_SIZE (16)
+#define CRYPTO_KEY_SALT_SIZE (32)
+
+// Encrypted GGUF container. The file stays a valid GGUF whose tensor data is
+// AES-256-GCM ciphertext of the same length, cut into chunk_size pieces from
+// the start of each tensor. The header adds
+//   encryption.cipher      "aes-256-gcm"
+//   encryption.chunk_size  u32
+//   encryption.key_salt    u8 array, CRYPTO_KEY_SALT_SIZE random bytes
+//   encryption.tags.<name> u8 array, one tag per chunk of the tensor
+// The file is encrypted under its own key, SHA-256 of the device key and the
+// salt, so each chunk's nonce only has to be unique within the file and is
+// its offset in the file.
+#define CRYPTO_KV_CIPHER     "encryption.cipher"
+#define CRYPTO_KV_CHUNK_SIZE "encryption.chunk_size"
+#define CRYPTO_KV_KEY_SALT   "encryption.key_salt"
+#define CRYPTO_KV_TAGS       "encryption.tags."
+#define CRYPTO_CIPHER_NAME   "aes-256-gcm"
+
+struct gguf_context;
+
+// remembers the tag tables of an encrypted model, returns false for plaintext
+bool crypto_load_container(const struct gguf_context *ctx);
+bool crypto_is_container(void);
+const unsigned char *crypto_key_salt(void);
+// fills salt with CRYPTO_KEY_SALT_SIZE random bytes for a new container
+void crypto_new_key_salt(unsigned char *salt);
+// tags of the tensor whose data starts at file offset off, NULL if unknown
+const unsigned char *crypto_tensor_tags(size_t off, size_t *n_chunks);
+
+// bytes per decrypt task: the container's chunk size for encrypted models,
+// otherwise LLAMA_DECRYPT_CHUNK_KB clamped to [64 KiB, 1 MiB]
+size_t crypto_chunk_size(void);
+
+// CTR is its own inverse, off must be a multiple of the AES block size
+void aes_256_ctr_crypt(void *dst, const void *src, size_t count, size_t off);
+void aes_256_gcm_encrypt(void *dst, const void *src, size_t count, size_t off, const unsigned char *key_salt, unsigned char *tag);
+// returns false if the tag does not match, dst may equal src
+bool aes_256_gcm_decrypt(void *dst, const void *src, size_t count, size_t off, const unsigned char *key_salt, const unsigned char *tag);
@@ -3,96 +3,92 @@
 #include "interface.h"
 #include <atomic>
 #include <cstring>
-#include <openssl/evp.h>
-#include <openssl/aes.h>
-
-EVP_CIPHER_CTX* ctx = NULL;
-unsigned char my_key[256] = {0xA, 0xB, 0xC, 0xD, 0xE, 0xF, 0x0, 0x1};
-unsigned char initial_vector[128] = {0x3, 0x4, 0x5, 0x6, 0x7, 0x8, 0x9, 0x10};
-
-void decrypt_block(const unsigned char* ciphertext, unsigned char* plaintext, const unsigned char* key, const unsigned char* iv) {
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv);
+#include <vector>
+#include "crypto.h"
+#ifndef LLAMA_USE_CHCORE_API
+#include "secure-mem.h"
+#endif
 
-    int len;
-    EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, AES_BLOCK_SIZE);
+std::atomic<int64_t> decrypt_time = 0;
+std::atomic<size_t> decrypt_size = 0;
 
-    EVP_CIPHER_CTX_free(ctx);
-}
+// Plaintext models, and DUMMY_WEIGHT builds whose buffers never see the file,
+// decrypt into a scratch buffer: the stage pays the real cost without touching
+// the weights.
+static thread_local std::vector<unsigned char> scratch;
 
-struct decrypt_ctx {
-    EVP_CIPHER_CTX* ctx;
-    decrypt_ctx(
-        const unsigned char* key,
-        const unsigned char* iv
-    ) {
-        ctx = EVP_CIPHER_CTX_new();
-    }
-    ~decrypt_ctx(void) {
-        EVP_CIPHER_CTX_free(ctx);
-    }
-};
-static unsigned char fake_iv[AES_BLOCK_SIZE];
-static thread_local decrypt_ctx dctx(my_key, fake_iv);
-
-// Function to decrypt a range of blocks
-void decrypt_blocks(
-    const unsigned char *ciphertext,
-    unsigned char *plaintext,
-    const unsigned char* key,
-    const unsigned char* iv,
-    int start,
-    int end
-) {
-    auto ctx = dctx.ctx;
-
-    GGML_ASSERT(EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) == 1);
-    int len;
-    GGML_ASSERT(EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, end - start) == 1);
-
-    GGML_ASSERT((end - start) % AES_BLOCK_SIZE == 0);
+static void decrypt_chunk(void *buf, size_t count, size_t off) {
+#ifdef TZ_LLM_MEASURE
+    auto start = get_micro();
+#endif
+    if (scratch.size() < count)
+        scratch.resize(count);
+    aes_256_ctr_crypt(scratch.data(), buf, count, off);
+#ifdef TZ_LLM_MEASURE
+    decrypt_time += get_micro() - start;
+    decrypt_size += count;
+#endif
 }
 
-const size_t DEC_BLOCK_SIZE = 1 << 16;
-thread_local unsigned char in[DEC_BLOCK_SIZE + 32];
-thread_local unsigned char out[DEC_BLOCK_SIZE + 32];
-
-std::atomic<int64_t> decrypt_time = 0;
-std::atomic<size_t> decrypt_size = 0;
-
-void aes_256_ecb_decrypt(void *buf, size_t count) {
-    unsigned char fake_iv[AES_BLOCK_SIZE];
+// Authenticates one chunk of an encrypted container while decrypting it in
+// place, so tampering is caught right before the tensor is handed out.
+static void verify_chunk(void *buf, size_t count, size_t off, const unsigned char *tag) {
 #ifdef TZ_LLM_MEASURE
     auto start = get_micro();
 #endif
-    decrypt_blocks(in, out, my_key, fake_iv, 0, count);
+    if (!aes_256_gcm_decrypt(buf, buf, count, off, crypto_key_salt(), tag))
+        GGML_ABORT("model chunk at offset %lu failed authentication", off);
 #ifdef TZ_LLM_MEASURE
     decrypt_time += get_micro() - start;
     decrypt_size += count;
 #endif
 }
 
+bool decrypt_enabled(void) {
+#ifdef LLAMA_USE_CHCORE_API
+    return true;
+#else
+    // the REE baseline reads plaintext, the emulated TEE pays for decryption
+    return secure_mem_is_emulated();
+#endif
+}
+
 class DecryptTask : public Task {
 public:
     void *buf;
     size_t count;
-
-    DecryptTask(void *buf, size_t count)
-        : buf(buf), count(count) {}
+    // offset of buf in the model file, selects the CTR counter or GCM nonce
+    size_t off;
+    // tag of the first chunk, NULL for plaintext models
+    const unsigned char *tags;
+
+    DecryptTask(void *buf, size_t count, size_t off, const unsigned char *tags)
+        : buf(buf), count(count), off(off), tags(tags) {}
+    size_t bytes(void) override { return count; }
     void step(void) override {
-#ifdef LLAMA_USE_CHCORE_API
-        for (size_t i = 0; i < count; i += DEC_BLOCK_SIZE)
-            aes_256_ecb_decrypt(buf, std::min(DEC_BLOCK_SIZE, count - i));
+        size_t chunk = crypto_chunk_size();
+        for (size_t i = 0; i < count; i += chunk) {
+            size_t len = std::min(chunk, count - i);
+#if not(DUMMY_WEIGHT)
+            if (tags) {
+                verify_chunk((char *)buf + i, len, off + i, tags + i / chunk * CRYPTO_GCM_TAG_SIZE);
+                continue;
+            }
 #endif
+            if (decrypt_enabled())
+                decrypt_chunk((char *)buf + i, len, off + i);
+        }
     }
 };
 
 
 extern bool is_strawman;
-#define BLOCK_SIZE (is_strawman ? (8UL << 30) : (1UL << 16))
+#define BLOCK_SIZE (is_strawman ? (8UL << 30) : crypto_chunk_size())
 
-DecryptStage::DecryptStage(size_t size): buf(NULL), size(size) {
+DecryptStage::DecryptStage(size_t off, size_t size)
+    : Stage(STAGE_DECRYPT), buf(NULL), off(off), size(size), tags(NULL), received_all(0), started(false), queued(false) {
     block_nr = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    received.assign(block_nr, 0);
 }
 
 #ifdef LLAMA_USE_CHCORE_API
@@ -121,28 +117,90 @@ void commit_tzasc(int cma_index, unsigned long _base_addr, unsigned long _top_ad
 void DecryptStage::start(void *input)
 {
     auto msg = (io_decrypt_msg *)input;
+    std::lock_guard<std::mutex> _(ready_mtx);
     buf = msg->buf;
+    GGML_ASSERT(msg->off == off);
+    size_t n_chunks = 0;
+    tags = crypto_tensor_tags(off, &n_chunks);
+    if (tags)
+        GGML_ASSERT(n_chunks == (size + crypto_chunk_size() - 1) / crypto_chunk_size());
 #ifdef LLAMA_USE_CHCORE_API
-    for (int cma_index = 0; cma_index < msg->cma_region.size(); cma_index++) {
+    cma_region = msg->cma_region;
+    if (received_all == size)
+        release_all();
+#endif
+    finished_nr = 0;
+    started = true;
+}
+
+#ifdef LLAMA_USE_CHCORE_API
+// TZASC secures the tensor's whole cma span at once, so the REE has to be done
+// writing all of it before any block may be decrypted in place.
+void DecryptStage::release_all(void)
+{
+    for (int cma_index = 0; cma_index < cma_region.size(); cma_index++) {
         if (!is_strawman) {
             commit_tzasc(
                 cma_index,
-                msg->cma_region[cma_index].first,
-                msg->cma_region[cma_index].second
+                cma_region[cma_index].first,
+                cma_region[cma_index].second
             );
         }
     }
+    for (int block = 0; block < block_nr; block++)
+        ready.push_back(block);
+}
 #endif
-    finished_nr = 0;
-    submit_pos = 0;
+
+bool DecryptStage::io_done(size_t file_off, size_t len)
+{
+    std::lock_guard<std::mutex> _(ready_mtx);
+    // segments are page aligned and may spill over the tensor's ends
+    size_t begin = std::max(file_off, off);
+    size_t end = std::min(file_off + len, off + size);
+    if (begin >= end)
+        return false;
+    received_all += end - begin;
+#ifdef LLAMA_USE_CHCORE_API
+    if (received_all == size && started)
+        release_all();
+#else
+    for (size_t pos = begin; pos < end;) {
+        int block = (pos - off) / BLOCK_SIZE;
+        size_t block_begin = off + block * BLOCK_SIZE;
+        size_t block_end = std::min(block_begin + BLOCK_SIZE, off + size);
+        size_t n = std::min(end, block_end) - pos;
+        received[block] += n;
+        if (received[block] == block_end - block_begin)
+            ready.push_back(block);
+        pos += n;
+    }
+#endif
+    return started && !queued && !ready.empty();
+}
+
+bool DecryptStage::claim(void)
+{
+    std::lock_guard<std::mutex> _(ready_mtx);
+    if (!started || queued || ready.empty())
+        return false;
+    queued = true;
+    return true;
 }
 
 std::pair<std::shared_ptr<Task>, bool> DecryptStage::get_task(void *)
 {
-    GGML_ASSERT(submit_pos < size);
-    auto task = std::make_shared<DecryptTask>(buf + submit_pos, std::min(BLOCK_SIZE, size - submit_pos));
-    submit_pos += BLOCK_SIZE;
-    return { task, submit_pos >= size };
+    std::lock_guard<std::mutex> _(ready_mtx);
+    GGML_ASSERT(!ready.empty());
+    size_t pos = (size_t)ready.front() * BLOCK_SIZE;
+    ready.pop_front();
+    auto task = make_task<DecryptTask>((char *)buf + pos, std::min(BLOCK_SIZE, size - pos), off + pos,
+                                              tags ? tags + pos / crypto_chunk_size() * CRYPTO_GCM_TAG_SIZE : NULL);
+    // leave the decrypt queue until the next io completion makes blocks ready
+    bool drained = ready.empty();
+    if (drained)
+        queued = false;
+    return { task, drained };
 }
 
 bool DecryptStage::submit(std::shared_ptr<Task> task)
@@ -160,7 +218,11 @@ void *DecryptStage::get_msg(void)
 
 void DecryptStage::rollback(void)
 {
+    std::lock_guard<std::mutex> _(ready_mtx);
     finished_nr = 0;
-    submit_pos = 0;
+    received.assign(block_nr, 0);
+    received_all = 0;
+    ready.clear();
+    started = false;
+    queued = false;
 }
-
@@ -10,10 +10,14 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <atomic>
+#include <cstdint>
+#include <cstring>
 
 #define TZ_LLM_MEASURE
 
+#ifndef DUMMY_WEIGHT
 #define DUMMY_WEIGHT 1
+#endif
 
 #define ENABLE_PIPELINE 1
 
@@ -39,7 +43,9 @@ struct io_segs {
 struct io_task {
     int cma_index;
     int entry_index;
+    // bytes of the entry to map, the read lands at buf_off within them
     size_t len;
+    size_t buf_off;
     struct io_seg io_seg;
     void *pipeline;
 
@@ -88,53 +94,133 @@ struct page_result {
     size_t off;
 };
 
+#define CACHE_LINE_SIZE 64
+
+// Bounded MPMC queue shared between the REE and the TEE. Every slot carries a
+// sequence number: a producer may fill slot `pos` once its sequence equals
+// `pos` and publishes it by storing `pos + 1`; a consumer hands it back for the
+// next lap by storing `pos + BUFFER_SIZE`. head and tail live on separate cache
+// lines so the two sides do not ping-pong a shared one.
 template<typename T, int BUFFER_SIZE>
 struct ring_buffer {
-    T buffer[BUFFER_SIZE];
-    std::atomic<int> head;
-    std::atomic<int> tail;
-    std::atomic<int> count;
+    static_assert((BUFFER_SIZE & (BUFFER_SIZE - 1)) == 0, "BUFFER_SIZE must be a power of 2");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring_buffer must be lock-free to live in shared memory");
+
+    struct slot {
+        std::atomic<uint64_t> seq;
+        T item;
+    };
+
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail;
+    alignas(CACHE_LINE_SIZE) slot buffer[BUFFER_SIZE];
 
     void init(void) {
-        head = tail = count = 0;
+        for (uint64_t i = 0; i < BUFFER_SIZE; i++) {
+            buffer[i].seq.store(i, std::memory_order_relaxed);
+        }
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_release);
     }
 
-    ring_buffer(void): head(0), tail(0), count(0) {}
-    int produce(const T *item) {
-        GGML_ASSERT(this->count.load() != BUFFER_SIZE);
+    ring_buffer(void) {
+        init();
+    }
+
+    // Claims up to n free slots with a single CAS on head and returns how many
+    // items were enqueued, 0 if the queue is full.
+    int produce_batch(const T *items, int n) {
+        uint64_t pos = this->head.load(std::memory_order_relaxed);
         while (true) {
-            int _head = this->head.load();
-            bool success = this->head.compare_exchange_strong(_head, (_head + 1) % BUFFER_SIZE);
-            if (success) {
-                memcpy(this->buffer + _head, item, sizeof(T));
-                break;
+            int k = 0;
+            while (k < n && this->buffer[(pos + k) % BUFFER_SIZE].seq.load(std::memory_order_acquire) == pos + k) {
+                k++;
+            }
+            if (k == 0) {
+                uint64_t cur = this->head.load(std::memory_order_relaxed);
+                if (cur == pos) {
+                    return 0;
+                }
+                pos = cur;
+                continue;
+            }
+            if (this->head.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+                for (int i = 0; i < k; i++) {
+                    slot &s = this->buffer[(pos + i) % BUFFER_SIZE];
+                    memcpy(&s.item, items + i, sizeof(T));
+                    s.seq.store(pos + i + 1, std::memory_order_release);
+                }
+                return k;
             }
         }
-        this->count++;
-        return 0;
     }
 
-    int consume(T *item) {
-        if (this->count.load() == 0) {
-            return -1;
-        }
+    // Dequeues up to n published items, returns how many, 0 if empty.
+    int consume_batch(T *items, int n) {
+        uint64_t pos = this->tail.load(std::memory_order_relaxed);
         while (true) {
-            int _tail = this->tail.load();
-            bool success = this->tail.compare_exchange_strong(_tail, (_tail + 1) % BUFFER_SIZE);
-            if (success) {
-                memcpy(item, this->buffer + _tail, sizeof(T));
-                break;
+            int k = 0;
+            while (k < n && this->buffer[(pos + k) % BUFFER_SIZE].seq.load(std::memory_order_acquire) == pos + k + 1) {
+                k++;
+            }
+            if (k == 0) {
+                uint64_t cur = this->tail.load(std::memory_order_relaxed);
+                if (cur == pos) {
+                    return 0;
+                }
+                pos = cur;
+                continue;
+            }
+            if (this->tail.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed)) {
+                for (int i = 0; i < k; i++) {
+                    slot &s = this->buffer[(pos + i) % BUFFER_SIZE];
+                    memcpy(items + i, &s.item, sizeof(T));
+                    s.seq.store(pos + i + BUFFER_SIZE, std::memory_order_release);
+                }
+                return k;
             }
         }
-        this->count--;
+    }
+
+    int produce(const T *item) {
+        GGML_ASSERT(produce_batch(item, 1) == 1);
         return 0;
     }
+
+    int consume(T *item) {
+        return consume_batch(item, 1) == 1 ? 0 : -1;
+    }
 };
 
-const int IO_BUFFER_SIZE = 10240;
+const int IO_BUFFER_SIZE = 8192;
 const int NPU_BUFFER_SIZE = 128;
 const int PAGE_BUFFER_SIZE = 128;
 
+// io tasks/results moved per doorbell
+const int IO_BATCH_SIZE = 32;
+
+// Written by the io backend, read by dump_measure on the other side.
+struct io_stats {
+    std::atomic<uint64_t> read_bytes;
+    // bytes that went through the staging area instead of straight to the destination
+    std::atomic<uint64_t> copied_bytes;
+    std::atomic<uint64_t> direct_chunks;
+    std::atomic<uint64_t> staged_chunks;
+    // small segments read as part of the chunk before them
+    std::atomic<uint64_t> coalesced_segments;
+    // bytes two segments share at their boundary, read only once
+    std::atomic<uint64_t> overlap_bytes;
+
+    void init(void) {
+        read_bytes = 0;
+        copied_bytes = 0;
+        direct_chunks = 0;
+        staged_chunks = 0;
+        coalesced_segments = 0;
+        overlap_bytes = 0;
+    }
+};
+
 struct all_ring_buffer {
     char io_model_path[256];
     char cache_p[256];
@@ -145,6 +231,7 @@ struct all_ring_buffer {
 
     ring_buffer<io_task, IO_BUFFER_SIZE> io_tasks;
     ring_buffer<io_result, IO_BUFFER_SIZE> io_results;
+    struct io_stats io_stats;
     // ring_buffer<npu_task, NPU_BUFFER_SIZE> npu_tasks;
     // ring_buffer<npu_result, NPU_BUFFER_SIZE> npu_results;
     // ring_buffer<page_task, PAGE_BUFFER_SIZE> page_tasks;
@@ -154,6 +241,7 @@ struct all_ring_buffer {
         GGML_ASSERT(sizeof(all_ring_buffer) <= CMD_QUEUE_SHM_SIZE);
         io_tasks.init();
         io_results.init();
+        io_stats.init();
         // npu_tasks.init();
         // npu_results.init();
         // page_tasks.init();
@@ -6,122 +6,265 @@
 #include <cstring>
 #include <memory>
 #include <optional>
-#include <libaio.h>
+#include <map>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <algorithm>
 #include "my_assert.h"
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <cerrno>
+#include "secure-mem.h"
+#include "io-engine.h"
 
+// One io_task from the frontend, split into chunks that complete in any order.
 struct aio_task {
-    io_context_t ctx;
     void *pipeline;
-    void *cma_buf;
-    void *read_buf;
-    size_t len;
-    aio_task(io_context_t ctx, void *pipeline, void *cma_buf, void *read_buf, size_t len)
-        : ctx(ctx), pipeline(pipeline), cma_buf(cma_buf), read_buf(read_buf), len(len) {}
+    int remaining;
+    aio_task(void *pipeline): pipeline(pipeline), remaining(0) {}
 };
 
 #define IO_BLK_SIZE (2 << 20)
+#define IO_BLK_SIZE_MIN (256 << 10)
+#define IO_BLK_SIZE_MAX (8 << 20)
+#define IO_DEPTH_DEFAULT (64)
+#define IO_STAGING_MB_DEFAULT (128)
+// segments up to this size are merged into the pending read before them
+#define IO_COALESCE_KB_DEFAULT (1024)
+// bytes completed between two chunk size adjustments
+#define IO_TUNE_WINDOW (64UL << 20)
+#define PAGE_SIZE 0x1000
+#define ROUND_UP(x, n)   (((x) + (n)-1) & ~((n)-1))
 
-static std::queue<std::shared_ptr<aio_task>> tasks;
-static int fd, tzd_fd;
+static int fd;
+static bool o_direct;
+// cleared for good once the kernel refuses to read into a destination mapping
+static bool zero_copy = true;
+// points into the command queue once io_step runs
+static struct io_stats local_stats;
+static struct io_stats *stats = &local_stats;
 // static const char *model_path = "/data/ssd/tinyllama-1.1b-chat-v1.0.Q8_0.gguf";
-#if DUMMY_WEIGHT
-static void *global_read_buf;
-static size_t global_read_buf_len;
-#endif
 
-struct llm_client_op_pages {
-	int cma_index;
-	int entry_index;
-	unsigned long size;
-};
+// a single deep queue shared by every request
+static int io_depth = IO_DEPTH_DEFAULT;
+static int inflight_nr;
+static std::deque<io_chunk *> pending_chunks;
+static std::vector<void *> finished_pipelines;
 
-#define DEVICE_NAME "/dev/tc_ns_client"
-#define TC_NS_CLIENT_IOC_MAGIC  't'
-#define LLM_CLIENT_IOCTL_SET_PAGES \
-	_IOWR(TC_NS_CLIENT_IOC_MAGIC, 27, struct llm_client_op_pages)
+// Every read lands in one long-lived staging area so the engine can register
+// it with the kernel once, instead of mapping a bounce buffer per request.
+static char *staging;
+static size_t staging_len;
+static std::map<size_t, size_t> staging_free;
 
-static std::queue<io_context_t> ctxs;
+static void *staging_alloc(size_t len) {
+    len = ROUND_UP(len, PAGE_SIZE);
+    for (auto iter = staging_free.begin(); iter != staging_free.end(); iter++) {
+        if (iter->second < len)
+            continue;
+        auto [off, size] = *iter;
+        staging_free.erase(iter);
+        if (size > len)
+            staging_free.emplace(off + len, size - len);
+        return staging + off;
+    }
+    return NULL;
+}
 
-io_context_t get_ctx(void) {
-    if (ctxs.empty()) {
-        io_context_t new_ctx = NULL;
-        GGML_ASSERT(io_setup(1, &new_ctx) == 0);
-        ctxs.push(new_ctx);
+static void staging_release(void *buf, size_t len) {
+    size_t off = (char *)buf - staging;
+    len = ROUND_UP(len, PAGE_SIZE);
+    auto next = staging_free.lower_bound(off);
+    if (next != staging_free.end() && off + len == next->first) {
+        len += next->second;
+        next = staging_free.erase(next);
     }
-    auto ctx = ctxs.front();
-    ctxs.pop();
-    return ctx;
+    if (next != staging_free.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == off) {
+            prev->second += len;
+            return;
+        }
+    }
+    staging_free.emplace(off, len);
 }
 
-void put_ctx(io_context_t ctx) {
-    ctxs.push(ctx);
+// Chunk size hill-climbs on measured throughput unless LLAMA_IO_BLK_KB pins it.
+static size_t io_blk_size = IO_BLK_SIZE;
+static bool io_blk_fixed;
+static size_t tune_bytes;
+static int64_t tune_start;
+static double tune_last_bw;
+static bool tune_grow = true;
+
+static void tune_blk_size(size_t done) {
+    if (io_blk_fixed)
+        return;
+    tune_bytes += done;
+    if (tune_bytes < IO_TUNE_WINDOW)
+        return;
+    auto now = get_micro();
+    double bw = (double)tune_bytes / std::max<int64_t>(now - tune_start, 1);
+    if (bw < tune_last_bw * 0.95)
+        tune_grow = !tune_grow;
+    tune_last_bw = bw;
+    // keep a few chunks' worth of staging space so the queue never starves
+    size_t max_blk = std::min<size_t>(IO_BLK_SIZE_MAX, staging_len / 4);
+    io_blk_size = tune_grow ? std::min<size_t>(io_blk_size * 2, max_blk)
+                            : std::max<size_t>(io_blk_size / 2, IO_BLK_SIZE_MIN);
+    tune_bytes = 0;
+    tune_start = now;
 }
 
 static void *get_buf(int cma_index, int entry_index, size_t len) {
     if (cma_index == -1)
         return NULL;
-    struct llm_client_op_pages index = {
-        .cma_index = cma_index,
-        .entry_index = entry_index,
-    };
-    int ret = ioctl(tzd_fd, LLM_CLIENT_IOCTL_SET_PAGES, &index);
-    GGML_ASSERT(ret >= 0);
-
-    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, tzd_fd, 0);
-    GGML_ASSERT(addr != MAP_FAILED);
-
-    return addr;
+    return secure_mem_provider()->map_pages(cma_index, entry_index, len);
 }
 
-static void launch_io(void *dst, int fd, const io_seg &io_seg, void *pipeline) {
+// O_DIRECT needs buffer, offset and length aligned to the logical block size
+static bool can_read_direct(const io_chunk *chunk) {
 #if DUMMY_WEIGHT
-    if (io_seg.len > global_read_buf_len) {
-        printf("[warn] extend global read buffer from %ldB to %ldB\n", global_read_buf_len, io_seg.len);
-        // munmap(global_read_buf, global_read_buf_len);
-        global_read_buf = mmap(NULL, io_seg.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        global_read_buf_len = io_seg.len;
-    }
-    void *read_buf = global_read_buf;
+    return false;
 #else
-    void *read_buf = mmap(NULL, io_seg.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!zero_copy || !chunk->dst)
+        return false;
+    if (!o_direct)
+        return true;
+    return (uintptr_t)chunk->dst % PAGE_SIZE == 0 && chunk->off % PAGE_SIZE == 0 && chunk->len % PAGE_SIZE == 0;
 #endif
-    GGML_ASSERT(read_buf != MAP_FAILED);
-
-    auto task = std::make_shared<aio_task>(get_ctx(), pipeline, dst, read_buf, io_seg.len);
-    
-    struct iocb *cbs[1];
-    iocb cb;
-    memset(&cb, 0, sizeof(cb));
-    io_prep_pread(&cb, fd, read_buf, io_seg.len, io_seg.off);
-    cbs[0] = &cb;
-
-    GGML_ASSERT(io_submit(task->ctx, 1, cbs) == 1);
-    tasks.push(task);
 }
 
-static void *wait_io(void) {
-    struct io_event event;
-    timespec timeout = { .tv_sec = 0, .tv_nsec = 0 };
-    if (tasks.empty()) return NULL;
-    auto task = tasks.front();
-    int ret = io_getevents(task->ctx, 1, 1, &event, &timeout);
-    GGML_ASSERT(ret >= 0);
-    if (ret > 0) {
-        GGML_ASSERT((int)event.res >= 0);
+// Small tensors (norms, biases) and the tails of large ones would each be a
+// read of their own, and neighbours both read the page they share. A chunk
+// that is still pending absorbs the next segment when it starts within or
+// right after it, as long as the extent stays small; the copy out of the
+// staging area is cheaper than the extra request.
+static size_t io_coalesce_max = IO_COALESCE_KB_DEFAULT << 10;
+
+static bool coalesce_io(void *dst, size_t off, size_t len, std::shared_ptr<aio_task> &task) {
+    if (pending_chunks.empty())
+        return false;
+    auto last = pending_chunks.back();
+    size_t end = last->off + last->len;
+    if (off < last->off || off > end || off + len <= end || off + len - last->off > std::min(io_coalesce_max, io_blk_size))
+        return false;
+    if (last->parts.empty()) {
+        last->parts.push_back({last->task, last->dst, 0, last->len});
+        last->task = nullptr;
+        last->dst = NULL;
+    }
+    last->parts.push_back({task, dst, off - last->off, len});
+    last->len = off + len - last->off;
+    stats->coalesced_segments++;
+    stats->overlap_bytes += end - off;
+    task->remaining++;
+    return true;
+}
+
+static void launch_io(void *dst, const io_seg &io_seg, void *pipeline) {
+    auto task = std::make_shared<aio_task>(pipeline);
+    if (io_seg.len <= io_coalesce_max && coalesce_io(dst, io_seg.off, io_seg.len, task))
+        return;
+    for (size_t off = 0; off < io_seg.len; off += io_blk_size) {
+        auto chunk = new io_chunk;
+        chunk->task = task;
+        chunk->buf = NULL;
+        chunk->staged = false;
+        chunk->len = std::min(io_blk_size, io_seg.len - off);
+        chunk->off = io_seg.off + off;
+        chunk->dst = dst ? (char *)dst + off : NULL;
+        chunk->res = 0;
+        task->remaining++;
+        pending_chunks.push_back(chunk);
+    }
+}
+
+// hand the engine as many pending chunks as depth and staging space allow
+static void submit_io(void) {
+    int nr = std::min<int>(pending_chunks.size(), io_depth - inflight_nr);
+    if (nr <= 0)
+        return;
+
+    io_chunk *batch[IO_BATCH_SIZE];
+    nr = std::min(nr, IO_BATCH_SIZE);
+    int ready = 0;
+    while (ready < nr) {
+        io_chunk *chunk = pending_chunks[ready];
+        chunk->staged = !can_read_direct(chunk);
+        chunk->buf = chunk->staged ? staging_alloc(chunk->len) : chunk->dst;
+        if (!chunk->buf)
+            break;
+        batch[ready++] = chunk;
+    }
+    if (ready == 0)
+        return;
+    if (inflight_nr == 0)
+        tune_start = get_micro();
+
+    int ret = io_engine_submit(batch, ready);
+    for (int i = ret; i < ready; i++) {
+        if (batch[i]->staged)
+            staging_release(batch[i]->buf, batch[i]->len);
+        batch[i]->buf = NULL;
+    }
+    pending_chunks.erase(pending_chunks.begin(), pending_chunks.begin() + ret);
+    inflight_nr += ret;
+}
+
+static void finish_io(std::shared_ptr<aio_task> &task) {
+    if (--task->remaining == 0)
+        finished_pipelines.push_back(task->pipeline);
+}
+
+// harvest every completion available, whichever request it belongs to
+static void reap_io(void) {
+    io_chunk *done[IO_BATCH_SIZE];
+    int ret;
+    while (inflight_nr && (ret = io_engine_reap(done, IO_BATCH_SIZE)) > 0) {
+        inflight_nr -= ret;
+        for (int i = 0; i < ret; i++) {
+            auto chunk = done[i];
+            if (!chunk->staged && (chunk->res == -EFAULT || chunk->res == -EINVAL)) {
+                // e.g. a PFN mapping of CMA pages that O_DIRECT cannot pin
+                if (zero_copy)
+                    printf("[warn] direct read into destination failed (%ld), staging all reads\n", chunk->res);
+                zero_copy = false;
+                chunk->buf = NULL;
+                pending_chunks.push_front(chunk);
+                continue;
+            }
+            GGML_ASSERT(chunk->res >= 0);
+            stats->read_bytes += chunk->res;
+            if (chunk->staged) {
+                stats->staged_chunks++;
 #if not(DUMMY_WEIGHT)
-        memcpy(task->cma_buf, task->read_buf, task->len);
-        munmap(task->read_buf, task->len);
+                if (chunk->dst) {
+                    memcpy(chunk->dst, chunk->buf, chunk->res);
+                    stats->copied_bytes += chunk->res;
+                }
+                for (auto &part : chunk->parts) {
+                    if (!part.dst || (size_t)chunk->res <= part.skip)
+                        continue;
+                    size_t len = std::min<size_t>(part.len, chunk->res - part.skip);
+                    memcpy(part.dst, (char *)chunk->buf + part.skip, len);
+                    stats->copied_bytes += len;
+                }
 #endif
-        tasks.pop();
-        put_ctx(task->ctx);
-        return task->pipeline;
+                staging_release(chunk->buf, chunk->len);
+            } else {
+                stats->direct_chunks++;
+            }
+            tune_blk_size(chunk->len);
+            if (chunk->parts.empty())
+                finish_io(chunk->task);
+            for (auto &part : chunk->parts)
+                finish_io(part.task);
+            delete chunk;
+        }
     }
-    return NULL;
 }
 
 #define IO_TEST_FILE "/data/ssd/Meta-Llama-3-8B-Instruct.Q8_0.gguf"
@@ -130,34 +273,63 @@ static void *wait_io(void) {
 
 void io_init(const char *model_path) {
     printf("backend %s %d %s\n", __func__, __LINE__, model_path);
-    tzd_fd = open(DEVICE_NAME, O_RDWR);
-    GGML_ASSERT(tzd_fd > 0);
-
     fd = open(model_path, O_RDONLY | O_DIRECT);
+    o_direct = fd != -1;
+    if (fd == -1 && errno == EINVAL) {
+        // e.g. tmpfs on a build box without the board
+        printf("[warn] %s does not support O_DIRECT, falling back to buffered io\n", model_path);
+        fd = open(model_path, O_RDONLY);
+    }
     GGML_ASSERT(fd != -1);
 
+    const char *depth = getenv("LLAMA_IO_DEPTH");
+    if (depth)
+        io_depth = std::max(1, atoi(depth));
+    const char *staging_mb = getenv("LLAMA_IO_STAGING_MB");
+    staging_len = (size_t)(staging_mb ? std::max(4, atoi(staging_mb)) : IO_STAGING_MB_DEFAULT) << 20;
+    staging = (char *)mmap(NULL, staging_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    GGML_ASSERT(staging != MAP_FAILED);
+    staging_free.emplace(0, staging_len);
+    const char *blk_kb = getenv("LLAMA_IO_BLK_KB");
+    if (blk_kb) {
+        io_blk_size = (size_t)std::max(4, atoi(blk_kb) / 4 * 4) << 10;
+        io_blk_fixed = true;
+    }
+    io_blk_size = std::min(io_blk_size, staging_len / 4);
+    const char *coalesce_kb = getenv("LLAMA_IO_COALESCE_KB");
+    if (coalesce_kb)
+        io_coalesce_max = (size_t)std::max(0, atoi(coalesce_kb)) << 10;
+    const char *no_zero_copy = getenv("LLAMA_IO_ZERO_COPY");
+    if (no_zero_copy && !atoi(no_zero_copy))
+        zero_copy = false;
+    io_engine_init(fd, io_depth, staging, staging_len);
+    printf("backend %s: depth %d blk %lu KB staging %lu MB coalesce %lu KB%s%s\n", __func__, io_depth,
+           io_blk_size >> 10, staging_len >> 20, io_coalesce_max >> 10, io_blk_fixed ? "" : " (adaptive)",
+           zero_copy ? " zero-copy" : "");
+
 #if DUMMY_WEIGHT
-    global_read_buf = mmap(NULL, IO_BLK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    global_read_buf_len = IO_BLK_SIZE;
     if (0) {
         printf("begin io test\n");
         auto start = get_micro();
         fd = open(IO_TEST_FILE, O_RDONLY | O_DIRECT);
-        int all = 0, wait = 0;
+        int all = 0;
         for (size_t i = 0; i < IO_TEST_FILE_SIZE; i += IO_BLK_SIZE) {
             struct io_seg io_seg = {
                 .off = i,
                 .len = IO_BLK_SIZE,
             };
-            launch_io(global_read_buf, fd, io_seg, (void *)1);
-            if (++all >= IO_PRE_LAUNCH_CNT) {
-                while (wait_io());
-                ++wait;
+            launch_io(NULL, io_seg, (void *)1);
+            all++;
+            while (all - (int)finished_pipelines.size() >= IO_PRE_LAUNCH_CNT) {
+                submit_io();
+                reap_io();
             }
         }
-        for (; wait < all; wait++) {
-            while (wait_io());
+        while ((int)finished_pipelines.size() < all) {
+            submit_io();
+            reap_io();
         }
+        finished_pipelines.clear();
         printf("io test %ld us thpt %.2f GB/s\n", get_micro() - start, 0.001f * IO_TEST_FILE_SIZE / (get_micro() - start));
     }
 #endif
@@ -188,21 +360,39 @@ static void write_measurement(const io_task &task) {
 }
 
 void io_step(all_ring_buffer *task_queue) {
-    io_task task;
-    while (task_queue->io_tasks.consume(&task) == 0) {
-        if (task.is_measurement) {
-            write_measurement(task);
-            return;
-        } else {
-            void *buf = get_buf(task.cma_index, task.entry_index, task.len);
-            launch_io(buf, fd, task.io_seg, task.pipeline);
+    stats = &task_queue->io_stats;
+    io_task batch[IO_BATCH_SIZE];
+    int n;
+    while ((n = task_queue->io_tasks.consume_batch(batch, IO_BATCH_SIZE)) > 0) {
+        for (int i = 0; i < n; i++) {
+            auto &task = batch[i];
+            if (task.is_measurement) {
+                write_measurement(task);
+            } else {
+                void *buf = get_buf(task.cma_index, task.entry_index, task.len);
+                launch_io(buf ? (char *)buf + task.buf_off : NULL, task.io_seg, task.pipeline);
+            }
         }
     }
-    void *pipeline;
-    while (pipeline = wait_io()) {
-        io_result result = {
-            .pipeline = pipeline
-        };
-        task_queue->io_results.produce(&result);
+    submit_io();
+    reap_io();
+    submit_io();
+
+    // Results that do not fit stay for the next step: the frontend may be
+    // the thread running this one and only drains the ring once it returns.
+    io_result results[IO_BATCH_SIZE];
+    size_t done = 0;
+    while (done < finished_pipelines.size()) {
+        int nr = std::min(finished_pipelines.size() - done, (size_t)IO_BATCH_SIZE);
+        for (int i = 0; i < nr; i++) {
+            results[i] = {
+                .pipeline = finished_pipelines[done + i]
+            };
+        }
+        int k = task_queue->io_results.produce_batch(results, nr);
+        done += k;
+        if (k < nr)
+            break;
     }
+    finished_pipelines.erase(finished_pipelines.begin(), finished_pipelines.begin() + done);
 }
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "io.h"
+#include <memory>
+#include <vector>
+
+struct aio_task;
+
+// Bytes [skip, skip + len) of a coalesced chunk, belonging to task.
+struct io_part {
+    std::shared_ptr<aio_task> task;
+    void *dst;
+    size_t skip;
+    size_t len;
+};
+
+// One read handed to the kernel. buf is either a slice of the staging area
+// given to io_engine_init, which engines may register once up front, or the
+// destination itself when the read can skip the bounce copy.
+struct io_chunk {
+    void *buf;
+    bool staged;
+    size_t len;
+    size_t off;
+    // where the bytes end up once read
+    void *dst;
+    long res;
+    std::shared_ptr<aio_task> task;
+    // set instead of dst and task when the chunk covers several segments,
+    // such chunks are always staged and scattered on completion
+    std::vector<io_part> parts;
+};
+
+// Kernel side of the io backend, implemented by io-libaio.cpp or io-uring.cpp.
+void io_engine_init(int fd, int depth, void *staging, size_t staging_len);
+// queue chunks for reading, returns how many were accepted
+int io_engine_submit(io_chunk **chunks, int nr);
+// collect finished chunks without blocking, in completion order
+int io_engine_reap(io_chunk **chunks, int max);
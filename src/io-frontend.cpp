@@ -8,11 +8,14 @@
 #include <optional>
 #include "ggml.h"
 #include <map>
-#include <memory>
+#include <deque>
+#include <algorithm>
+#include <vector>
 #include "pipeline.h"
 #include <mutex>
-
-#define DEVICE_NAME "/dev/tc_ns_client"
+#ifndef LLAMA_USE_CHCORE_API
+#include "secure-mem.h"
+#endif
 
 #define ROUND_UP(x, n)   (((x) + (n)-1) & ~((n)-1))
 #define ROUND_DOWN(x, n) ((x) & ~((n)-1))
@@ -21,8 +24,14 @@
 static all_ring_buffer *task_queue;
 static std::once_flag task_queue_once;
 
+struct inflight_io {
+    task_entry entry;
+    size_t len;
+    inflight_io(task_entry entry, size_t len): entry(entry), len(len) {}
+};
+
 static std::mutex tasks_lock;
-static std::map<void *, task_entry> tasks;
+static std::map<void *, inflight_io> tasks;
 
 #ifdef LLAMA_USE_CHCORE_API
 void *cmd_queue_addr;
@@ -33,11 +42,7 @@ static void init(void)
 #else
 static void init(void)
 {
-    int tzd_fd = open(DEVICE_NAME, O_RDWR);
-    GGML_ASSERT(tzd_fd >= 0);
-    void *addr = mmap(NULL, CMD_QUEUE_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, tzd_fd, 0);
-    GGML_ASSERT(addr != MAP_FAILED);
-    task_queue = (struct all_ring_buffer *)addr;
+    task_queue = secure_mem_provider()->map_cmd_queue();
 }
 #endif
 
@@ -69,12 +74,8 @@ void io_rpc(void) {
     BUG_ON(ret != 0);
 }
 #else
-static std::once_flag io_init_once;
 void io_rpc(void) {
-    extern void io_init(const char *model_path);
-    std::call_once(io_init_once, io_init, task_queue->io_model_path);
-    extern void io_step(all_ring_buffer *task_queue);
-    io_step(task_queue);
+    secure_mem_provider()->io_rpc(task_queue);
 }
 #endif
 
@@ -83,7 +84,69 @@ std::atomic<size_t> io_size;
 
 int on_fly_cnt = 0;
 
-void io_launch(size_t off, size_t size, int cma_index, int entry_index, task_entry entry)
+// io tasks launched since the last doorbell, guarded by tasks_lock
+static std::vector<io_task> pending_tasks;
+
+// The scheduler keeps about IO_INFLIGHT_TARGET_US worth of the measured
+// device bandwidth in flight, so faster storage gets a deeper queue.
+#define IO_INFLIGHT_TARGET_US (50000)
+#define IO_INFLIGHT_INIT (128UL << 20)
+#define IO_INFLIGHT_MIN (16UL << 20)
+#define IO_INFLIGHT_MAX (1UL << 30)
+#define IO_BW_WINDOW_US (10000)
+
+static size_t inflight_bytes;
+static size_t inflight_limit = IO_INFLIGHT_INIT;
+static double io_bw;
+static size_t bw_bytes;
+static int64_t bw_start;
+
+static void update_inflight_limit(size_t done)
+{
+    bw_bytes += done;
+    auto now = get_micro();
+    if (now - bw_start < IO_BW_WINDOW_US)
+        return;
+    double bw = (double)bw_bytes / (now - bw_start);
+    io_bw = io_bw ? 0.7 * io_bw + 0.3 * bw : bw;
+    inflight_limit = std::clamp((size_t)(io_bw * IO_INFLIGHT_TARGET_US), IO_INFLIGHT_MIN, IO_INFLIGHT_MAX);
+    bw_bytes = 0;
+    bw_start = now;
+}
+
+bool io_can_launch(void)
+{
+    return inflight_bytes < inflight_limit;
+}
+
+double io_bandwidth(void)
+{
+    return io_bw;
+}
+
+void io_dump_measure(void)
+{
+    printf("io bandwidth %.2f GB/s\n", io_bw * 1e-3);
+    printf("io inflight limit %lu MB\n", inflight_limit / 1024 / 1024);
+    if (!task_queue)
+        return;
+    auto &stats = task_queue->io_stats;
+    printf("io read %lu MB, copied %lu MB (%lu direct / %lu staged chunks)\n",
+           stats.read_bytes.load() >> 20, stats.copied_bytes.load() >> 20,
+           stats.direct_chunks.load(), stats.staged_chunks.load());
+    printf("io coalesced %lu segments into the read before them, %lu KB of shared pages read once\n",
+           stats.coalesced_segments.load(), stats.overlap_bytes.load() >> 10);
+}
+
+void io_clear_measure(void)
+{
+    if (task_queue)
+        task_queue->io_stats.init();
+}
+// results harvested by the last doorbell but not handed out yet
+static std::deque<void *> ready_results;
+
+void io_launch(size_t off, size_t size, int cma_index, int entry_index, size_t buf_off, task_entry entry)
 {
 #ifdef TZ_LLM_MEASURE
     auto start = get_micro();
@@ -94,7 +157,8 @@ void io_launch(size_t off, size_t size, int cma_index, int entry_index, task_ent
     io_task task = {
         .cma_index = cma_index,
         .entry_index = entry_index,
-        .len = seg_end - seg_begin,
+        .len = buf_off + seg_end - seg_begin,
+        .buf_off = buf_off,
         .io_seg = {
             .off = seg_begin,
             .len = seg_end - seg_begin,
@@ -104,33 +168,83 @@ void io_launch(size_t off, size_t size, int cma_index, int entry_index, task_ent
     };
     {
         std::lock_guard<std::mutex> _(tasks_lock);
-        tasks.emplace(entry.task.get(), entry);
+        tasks.emplace(entry.task.get(), inflight_io(entry, task.io_seg.len));
+        pending_tasks.push_back(task);
     }
-    task_queue->io_tasks.produce(&task);
+    if (inflight_bytes == 0) {
+        // the device was idle, don't count that towards its bandwidth
+        bw_bytes = 0;
+        bw_start = get_micro();
+    }
+    inflight_bytes += task.io_seg.len;
     ++on_fly_cnt;
-
-    io_rpc();
 #ifdef TZ_LLM_MEASURE
     io_size += size;
     io_time += get_micro() - start;
 #endif
 }
 
+static bool push_pending_tasks(void)
+{
+    std::vector<io_task> batch;
+    {
+        std::lock_guard<std::mutex> _(tasks_lock);
+        batch.swap(pending_tasks);
+    }
+    size_t done = 0;
+    while (done < batch.size()) {
+        int n = task_queue->io_tasks.produce_batch(batch.data() + done, batch.size() - done);
+        if (n == 0) {
+            // full, let the backend drain it
+            io_rpc();
+        }
+        done += n;
+    }
+    return !batch.empty();
+}
+
+void io_flush(void)
+{
+#ifdef TZ_LLM_MEASURE
+    auto start = get_micro();
+#endif
+    std::call_once(task_queue_once, init);
+    if (push_pending_tasks())
+        io_rpc();
+#ifdef TZ_LLM_MEASURE
+    io_time += get_micro() - start;
+#endif
+}
+
 static std::optional<task_entry> __io_try_get(void)
 {
     std::call_once(task_queue_once, init);
-    io_result result;
     if (!on_fly_cnt)
         return std::nullopt;
-    io_rpc();
-    if (task_queue->io_results.consume(&result) == 0) {
-        --on_fly_cnt;
-        {
-            std::lock_guard<std::mutex> _(tasks_lock);
-            return tasks.at(result.pipeline);
-        }
+    if (ready_results.empty()) {
+        push_pending_tasks();
+        io_rpc();
+        io_result results[IO_BATCH_SIZE];
+        int n = task_queue->io_results.consume_batch(results, IO_BATCH_SIZE);
+        for (int i = 0; i < n; i++)
+            ready_results.push_back(results[i].pipeline);
+    }
+    if (ready_results.empty())
+        return std::nullopt;
+
+    void *key = ready_results.front();
+    ready_results.pop_front();
+    --on_fly_cnt;
+    {
+        std::lock_guard<std::mutex> _(tasks_lock);
+        auto iter = tasks.find(key);
+        GGML_ASSERT(iter != tasks.end());
+        auto entry = iter->second.entry;
+        inflight_bytes -= iter->second.len;
+        update_inflight_limit(iter->second.len);
+        tasks.erase(iter);
+        return entry;
     }
-    return std::nullopt;
 }
 
 std::optional<task_entry> io_try_get(void)
@@ -138,10 +252,11 @@ std::optional<task_entry> io_try_get(void)
 #ifdef TZ_LLM_MEASURE
     auto start = get_micro();
 #endif
-    return __io_try_get();
+    auto entry = __io_try_get();
 #ifdef TZ_LLM_MEASURE
     io_time += get_micro() - start;
 #endif
+    return entry;
 }
 
 void record_measure(double ttft, double decoding_thpt)
@@ -15,5 +15,14 @@ struct task_entry {
 
 size_t io_align_up(size_t off);
 size_t io_align_down(size_t off);
-void io_launch(size_t off, size_t size, int cma_index, int entry_index, task_entry entry);
+// read [off, off + size) of the model into the cma entry, starting buf_off bytes into it
+void io_launch(size_t off, size_t size, int cma_index, int entry_index, size_t buf_off, task_entry entry);
+// hand every io_launch()ed task to the backend with one doorbell
+void io_flush(void);
+// whether the bytes in flight are below the bandwidth-derived limit
+bool io_can_launch(void);
+// measured read bandwidth in bytes per us, 0 before the first reads
+double io_bandwidth(void);
+void io_dump_measure(void);
+void io_clear_measure(void);
 std::optional<task_entry> io_try_get(void);
\ No newline at end of file
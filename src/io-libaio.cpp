@@ -1,51 +1,69 @@
-#include "io.h"
-#include "ggml.h"
-#include <fcntl.h>
-#include <unistd.h>
+#include "io-engine.h"
 #include <libaio.h>
-#include <unordered_map>
-#include <string>
-#include <mutex>
-#include <iostream>
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
-#include <memory>
-#include <optional>
+#include <vector>
 
-std::mutex lock;
-std::unordered_map<void *, io_context_t> aios;
-int counter = 0;
-
-void launch_io(void *dst, int fd, size_t off, size_t len) {
-    std::lock_guard<std::mutex> _(lock);
-
-    GGML_ASSERT(aios.find(dst) == aios.end());
-
-    io_context_t ctx;
-    memset(&ctx, 0, sizeof(ctx));
-    GGML_ASSERT(io_setup(1, &ctx) == 0);
-    
+struct aio_slot {
     iocb cb;
-    struct iocb *cbs[1];
-    memset(&cb, 0, sizeof(cb));
-    io_prep_pread(&cb, fd, dst, len, off);
-    cbs[0] = &cb;
+    io_chunk *chunk;
+};
 
-    GGML_ASSERT(io_submit(ctx, 1, cbs) == 1);
+static int fd;
+static io_context_t ctx;
+static std::vector<aio_slot> slots;
+static std::vector<aio_slot *> free_slots;
+static std::vector<iocb *> cbs;
+static std::vector<io_event> events;
 
-    aios[dst] = ctx;
+void io_engine_init(int file_fd, int depth, void *staging, size_t staging_len) {
+    (void)staging;
+    (void)staging_len;
+    fd = file_fd;
+    GGML_ASSERT(io_setup(depth, &ctx) == 0);
+    slots.resize(depth);
+    for (auto &slot : slots)
+        free_slots.push_back(&slot);
+    cbs.resize(depth);
+    events.resize(depth);
+    printf("%s: libaio depth %d\n", __func__, depth);
 }
 
-void wait_io(void *dst) {
-    io_context_t ctx;
-    struct io_event events[1];
-
-    {
-        std::lock_guard<std::mutex> _(lock);
-        GGML_ASSERT(aios.find(dst) != aios.end());
-        ctx = aios[dst];
-        aios.erase(aios.find(dst));
+int io_engine_submit(io_chunk **chunks, int nr) {
+    nr = std::min<int>(nr, free_slots.size());
+    for (int i = 0; i < nr; i++) {
+        aio_slot *slot = free_slots.back();
+        free_slots.pop_back();
+        slot->chunk = chunks[i];
+        io_prep_pread(&slot->cb, fd, chunks[i]->buf, chunks[i]->len, chunks[i]->off);
+        slot->cb.data = slot;
+        cbs[i] = &slot->cb;
     }
+    if (nr <= 0)
+        return 0;
 
-    GGML_ASSERT(io_getevents(ctx, 1, 1, events, NULL) == 1);
-    // GGML_ASSERT(events[0].res == events[0].obj->u.c.nbytes);
+    int ret = io_submit(ctx, nr, cbs.data());
+    if (ret == -EAGAIN)
+        ret = 0;
+    GGML_ASSERT(ret >= 0);
+    for (int i = ret; i < nr; i++)
+        free_slots.push_back((aio_slot *)cbs[i]->data);
+    return ret;
+}
+
+int io_engine_reap(io_chunk **chunks, int max) {
+    int inflight = slots.size() - free_slots.size();
+    if (inflight == 0)
+        return 0;
+    timespec timeout = { .tv_sec = 0, .tv_nsec = 0 };
+    int ret = io_getevents(ctx, 0, std::min(max, inflight), events.data(), &timeout);
+    GGML_ASSERT(ret >= 0);
+    for (int i = 0; i < ret; i++) {
+        auto slot = (aio_slot *)events[i].data;
+        slot->chunk->res = (long)events[i].res;
+        chunks[i] = slot->chunk;
+        free_slots.push_back(slot);
+    }
+    return ret;
 }
@@ -2,6 +2,7 @@
 #include "pipeline.h"
 #include "interface.h"
 #include "io-frontend.h"
+#include "trace.h"
 #include <algorithm>
 
 class IOTask : public std::enable_shared_from_this<IOTask>, public Task {
@@ -10,12 +11,17 @@ public:
     size_t len;
     int cma_index;
     int entry_index;
+    size_t buf_off;
     std::shared_ptr<Pipeline> pipeline;
-    IOTask(size_t off, size_t len, int cma_index, int entry_index, std::shared_ptr<Pipeline> pipeline)
-        : off(off), len(len), cma_index(cma_index), entry_index(entry_index), pipeline(pipeline) {}
+    int64_t launched;
+    IOTask(size_t off, size_t len, int cma_index, int entry_index, size_t buf_off, std::shared_ptr<Pipeline> pipeline)
+        : off(off), len(len), cma_index(cma_index), entry_index(entry_index), buf_off(buf_off), pipeline(pipeline), launched(0) {}
+    size_t bytes(void) override { return len; }
     void step(void) override {
         std::shared_ptr<Task> self = shared_from_this();
-        io_launch(off, len, cma_index, entry_index, task_entry(pipeline, self));
+        if (trace_enabled())
+            launched = get_micro();
+        io_launch(off, len, cma_index, entry_index, buf_off, task_entry(pipeline, self));
     }
 };
 
@@ -27,7 +33,22 @@ void IOStage::start(void *input)
     auto msg = (alloc_io_msg *)input;
     buf = msg->buf;
     cma_indexes.swap(msg->cma_indexes);
-    cnt_to_finish = cma_indexes.size() * 2;
+    // don't hand last run's entries back to the alloc stage
+    msg->cma_indexes.clear();
+    // cut every cma entry into segments so decryption can start on the first
+    // ones while the rest are still in flight
+    segments.clear();
+    for (auto &extent : cma_indexes) {
+        for (size_t pos = 0; pos < extent.size; pos += BLOCK_SIZE) {
+            segments.push_back({extent.cma_index, extent.entry_index, (off_t)(extent.off + pos), extent.entry_off + pos,
+                                std::min(BLOCK_SIZE, extent.size - pos)});
+        }
+    }
+    std::sort(segments.begin(), segments.end(), [](const io_segment &a, const io_segment &b) {
+        return a.file_off < b.file_off;
+    });
+    launch_pos = 0;
+    cnt_to_launch = segments.size();
 #ifdef LLAMA_USE_CHCORE_API
     if (!msg->paddr.empty()) {
         id_msg.cma_region.resize(msg->paddr.size());
@@ -45,30 +66,40 @@ void IOStage::start(void *input)
 std::pair<std::shared_ptr<Task>, bool> IOStage::get_task(void *)
 {
     GGML_ASSERT(pipeline);
-    GGML_ASSERT(!cma_indexes.empty());
-    auto [cma_index, entry_index, cma_offset, cma_size] = cma_indexes.back();
-    cma_indexes.pop_back();
-    return { std::make_shared<IOTask>(io_align_down(off) + cma_offset, cma_size, cma_index, entry_index, pipeline), cma_indexes.empty() };
+    GGML_ASSERT(launch_pos < segments.size());
+    auto &seg = segments[launch_pos++];
+    auto task = make_task<IOTask>(io_align_down(off) + seg.file_off, seg.len, seg.cma_index, seg.entry_index, seg.buf_off, pipeline);
+    return { task, launch_pos == segments.size() };
 }
 
+// called once an io task has been launched
 bool IOStage::submit(std::shared_ptr<Task> task)
 {
-    auto old_nr = cnt_to_finish.fetch_sub(1);
+    auto old_nr = cnt_to_launch.fetch_sub(1);
     if (old_nr == 1)
         return true;
     return false;
 }
 
+std::pair<size_t, size_t> IOStage::complete(std::shared_ptr<Task> task)
+{
+    auto io_task = std::static_pointer_cast<IOTask>(task);
+    if (trace_enabled())
+        trace_event(TRACE_IO, (int64_t)io_task->pipeline->get_sched_info(), io_task->launched, get_micro(), io_task->len);
+    return { io_task->off, io_task->len };
+}
+
 void *IOStage::get_msg(void)
 {
     GGML_ASSERT(buf);
     id_msg.buf = buf + off - io_align_down(off);
+    id_msg.off = off;
     return &id_msg;
 }
 
 void IOStage::rollback(void)
 {
-
+    launch_pos = 0;
 }
 
 void IOStage::set_pipeline(std::shared_ptr<Pipeline> pipe)
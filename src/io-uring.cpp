@@ -0,0 +1,169 @@
+#include "io-engine.h"
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/uio.h>
+
+// Talks to io_uring through the raw syscalls so the CA needs no extra library.
+// The staging area is registered as fixed buffer 0 and the model fd as fixed
+// file 0; LLAMA_IO_SQPOLL=1 lets a kernel thread poll the SQ so submission
+// normally needs no syscall at all.
+
+#define SQPOLL_IDLE_MS (50)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned op, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, ring_fd, op, arg, nr);
+}
+
+struct uring {
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_flags;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static uring ring;
+static int fd;
+static bool fixed_file;
+static bool fixed_buf;
+static bool sqpoll;
+static char *staging_begin;
+static int inflight;
+static int max_inflight;
+
+static void map_rings(const struct io_uring_params &p) {
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_len = cq_len = std::max(sq_len, cq_len);
+
+    char *sq = (char *)mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.ring_fd, IORING_OFF_SQ_RING);
+    GGML_ASSERT(sq != MAP_FAILED);
+    char *cq = sq;
+    if (!single) {
+        cq = (char *)mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.ring_fd, IORING_OFF_CQ_RING);
+        GGML_ASSERT(cq != MAP_FAILED);
+    }
+    ring.sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring.ring_fd, IORING_OFF_SQES);
+    GGML_ASSERT(ring.sqes != MAP_FAILED);
+
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_flags = (unsigned *)(sq + p.sq_off.flags);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+}
+
+void io_engine_init(int file_fd, int depth, void *staging, size_t staging_len) {
+    fd = file_fd;
+    staging_begin = (char *)staging;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    const char *env = getenv("LLAMA_IO_SQPOLL");
+    if (env && atoi(env)) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    ring.ring_fd = sys_io_uring_setup(depth, &p);
+    if (ring.ring_fd < 0 && (p.flags & IORING_SETUP_SQPOLL)) {
+        printf("[warn] %s: SQPOLL unavailable (%d), using plain submission\n", __func__, errno);
+        p.flags &= ~IORING_SETUP_SQPOLL;
+        ring.ring_fd = sys_io_uring_setup(depth, &p);
+    }
+    GGML_ASSERT(ring.ring_fd >= 0);
+    sqpoll = p.flags & IORING_SETUP_SQPOLL;
+    map_rings(p);
+    max_inflight = std::min<int>(p.sq_entries, p.cq_entries);
+
+    fixed_file = sys_io_uring_register(ring.ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+
+    struct iovec iov = { .iov_base = staging, .iov_len = staging_len };
+    fixed_buf = sys_io_uring_register(ring.ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+    printf("%s: io_uring depth %d%s%s%s\n", __func__, max_inflight,
+           sqpoll ? " sqpoll" : "", fixed_file ? " fixed-file" : "", fixed_buf ? " fixed-buf" : "");
+}
+
+int io_engine_submit(io_chunk **chunks, int nr) {
+    unsigned tail = *ring.sq_tail;
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    nr = std::min<int>({ nr, (int)(ring.sq_entries - (tail - head)), max_inflight - inflight });
+    if (nr <= 0)
+        return 0;
+
+    for (int i = 0; i < nr; i++) {
+        io_chunk *chunk = chunks[i];
+        unsigned index = (tail + i) & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        bool use_fixed_buf = fixed_buf && chunk->staged;
+        sqe->opcode = use_fixed_buf ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = fixed_file ? 0 : fd;
+        if (fixed_file)
+            sqe->flags |= IOSQE_FIXED_FILE;
+        sqe->addr = (unsigned long)chunk->buf;
+        sqe->len = chunk->len;
+        sqe->off = chunk->off;
+        sqe->buf_index = 0;
+        sqe->user_data = (unsigned long)chunk;
+        ring.sq_array[index] = index;
+    }
+    __atomic_store_n(ring.sq_tail, tail + nr, __ATOMIC_RELEASE);
+    inflight += nr;
+
+    if (sqpoll) {
+        // the tail store must be visible before the flag is read, or the poller
+        // may go to sleep on entries it never saw, same as liburing
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(ring.sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+            sys_io_uring_enter(ring.ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+    } else {
+        // entries the kernel has not consumed yet, including earlier leftovers
+        unsigned pending = tail + nr - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        int ret = sys_io_uring_enter(ring.ring_fd, pending, 0, 0);
+        GGML_ASSERT(ret >= 0 || errno == EAGAIN || errno == EBUSY);
+    }
+    return nr;
+}
+
+int io_engine_reap(io_chunk **chunks, int max) {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    int nr = 0;
+    while (head != tail && nr < max) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        io_chunk *chunk = (io_chunk *)cqe->user_data;
+        chunk->res = cqe->res;
+        chunks[nr++] = chunk;
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    inflight -= nr;
+    return nr;
+}
@@ -1,24 +1,80 @@
 #include "pipeline.h"
 #include "ggml.h"
 #include "io-frontend.h"
+#include "pipeline-workers.h"
+#include "trace.h"
+#include <algorithm>
+#include <sched.h>
 #ifdef LLAMA_USE_CHCORE_API
 #include <chcore/llm.h>
 #endif
 
-std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>> LayerScheduler::get_task(layer_queue_t &queue, void *arg)
+// polls of a busy bucket before its waiter yields the cpu
+#define BUCKET_SPIN_NR (128)
+
+static int layer_bucket(int layer)
 {
-    while (true) {
-        if (queue.empty()) {
-            return std::make_pair(nullptr, nullptr);
+    // the embeddings (-1) go first and the output (999) last
+    return std::clamp(layer, -1, SCHED_LAYER_NR - 2) + 1;
+}
+
+static int layer_bucket(std::shared_ptr<Pipeline> &pipeline)
+{
+    return layer_bucket((int)((int64_t)pipeline->get_sched_info() >> 32));
+}
+
+void LayerScheduler::set_alloc_limit(int layer)
+{
+    alloc_limit = layer_bucket(layer);
+}
+
+void LayerScheduler::bucket::lock(void)
+{
+    // holders are short, but one may have been preempted
+    int spins = 0;
+    while (!try_lock()) {
+        while (busy.load(std::memory_order_relaxed)) {
+            if (++spins >= BUCKET_SPIN_NR) {
+                sched_yield();
+                spins = 0;
+            }
         }
-        auto pipeline = queue.top();
-        GGML_ASSERT(!pipeline->is_finished());
-        auto task = pipeline->get_current_stage()->get_task(arg);
-        if (task.second) {
-            queue.pop();
+    }
+}
+
+std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>> LayerScheduler::get_task(stage_queue &queue, void *arg, bool spread, int last_bucket)
+{
+    for (int word = 0; word < SCHED_LAYER_NR / 64; word++) {
+        uint64_t mask = queue.nonempty[word].load(std::memory_order_acquire);
+        while (mask) {
+            int index = word * 64 + __builtin_ctzll(mask);
+            mask &= mask - 1;
+            if (index > last_bucket)
+                return std::make_pair(nullptr, nullptr);
+            auto &bucket = queue.buckets[index];
+            if (spread) {
+                if (!bucket.try_lock())
+                    continue;
+            } else {
+                bucket.lock();
+            }
+            if (bucket.pipelines.empty()) {
+                bucket.unlock();
+                continue;
+            }
+            auto pipeline = bucket.pipelines.back();
+            GGML_ASSERT(!pipeline->is_finished());
+            auto task = pipeline->get_current_stage()->get_task(arg);
+            if (task.second) {
+                bucket.pipelines.pop_back();
+                if (bucket.pipelines.empty())
+                    queue.nonempty[word].fetch_and(~(1UL << (index % 64)), std::memory_order_release);
+            }
+            bucket.unlock();
+            return std::make_pair(pipeline, task.first);
         }
-        return std::make_pair(pipeline, task.first);
     }
+    return std::make_pair(nullptr, nullptr);
 }
 
 pid_t main_tid = -1;
@@ -41,7 +97,22 @@ int get_cma_index(void) {
 }
 #endif
 
-int io_cnt = 0;
+static void run_task(std::shared_ptr<Pipeline> &pipeline, std::shared_ptr<Task> &task, stage_tag kind)
+{
+#ifdef TZ_LLM_MEASURE
+    auto start = get_micro();
+#else
+    auto start = trace_enabled() ? get_micro() : 0;
+#endif
+    task->step();
+#ifdef TZ_LLM_MEASURE
+    pipeline_count_task(kind, get_micro() - start);
+#endif
+    static const trace_kind trace_kinds[STAGE_NR] = { TRACE_ALLOC, TRACE_IO, TRACE_DECRYPT, TRACE_RELAYOUT };
+    // io is traced from launch to completion in IOStage::complete
+    if (trace_enabled() && kind != STAGE_IO)
+        trace_event(trace_kinds[kind], (int64_t)pipeline->get_sched_info(), start, get_micro(), task->bytes());
+}
 
 std::mutex io_lock;
 bool LayerScheduler::step(void) {
@@ -51,54 +122,68 @@ if (!is_strawman) {
     if (gettid() == main_tid) {
         auto entry = io_try_get();
         if (entry.has_value()) {
-            io_cnt--;
-            auto pipeline = entry->pipeline;
-            auto task = entry->task;
-            if (pipeline->get_current_stage()->submit(task)) {
-                pipeline->finish_stage();
-                if (!pipeline->is_finished()) {
-                    enqueue(pipeline);
-                }
-            }
+            // the segment's bytes can be decrypted right away
+            if (entry->pipeline->io_complete(entry->task))
+                enqueue(entry->pipeline);
             // return false;
         }
     }
 
     std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>> res;
-    {
-        std::lock_guard<std::mutex> _(lock);
-
-        while (true) {
-            if (gettid() == main_tid && io_cnt <= 32) {
-                res = get_task(io, NULL);
-                if (res.first) {
-                    io_cnt++;
+    std::vector<std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>>> io_batch;
+    stage_tag kind = STAGE_DECRYPT;
+    while (true) {
+        if (gettid() == main_tid) {
+            while (io_can_launch() && io_batch.size() < IO_BATCH_SIZE) {
+                res = get_task(queues[STAGE_IO], NULL, false);
+                if (!res.first)
                     break;
-                }
+                io_batch.push_back(res);
             }
-            res = get_task(decrypt, NULL);
-            if (res.first) break;
-            GGML_ASSERT(main_tid != -1);
+            if (!io_batch.empty())
+                break;
+        }
+        // relayout finishes tensors, take it before starting to decrypt more
+        kind = STAGE_RELAYOUT;
+        res = get_task(queues[STAGE_RELAYOUT], NULL, true);
+        if (res.first) break;
+        kind = STAGE_DECRYPT;
+        res = get_task(queues[STAGE_DECRYPT], NULL, true);
+        if (res.first) break;
+        GGML_ASSERT(main_tid != -1);
+        kind = STAGE_ALLOC;
 #ifdef LLAMA_USE_CHCORE_API
-            res = get_task(alloc, (void *)(long)get_cma_index());
+        res = get_task(queues[STAGE_ALLOC], (void *)(long)get_cma_index(), false, alloc_limit);
 #else
-            if (gettid() == main_tid) {
-                res = get_task(alloc, (void *)(long)get_cma_index());
-            }
+        if (gettid() == main_tid) {
+            res = get_task(queues[STAGE_ALLOC], (void *)(long)get_cma_index(), false, alloc_limit);
+        }
 #endif
-            if (res.first) break;
-            return false;
+        if (res.first) break;
+        return false;
+    }
+
+    if (!io_batch.empty()) {
+        for (auto &[pipeline, task] : io_batch) {
+            run_task(pipeline, task, STAGE_IO);
+            if (pipeline->get_current_stage()->submit(task)) {
+                if (!pipeline->finish_stage()) {
+                    enqueue(pipeline);
+                }
+            }
         }
+        io_flush();
+        return true;
     }
 
     auto pipeline = res.first;
     auto task = res.second;
     GGML_ASSERT(pipeline && task);
 
-    task->step();
+    run_task(pipeline, task, kind);
     if (pipeline->get_current_stage()->submit(task)) {
-        pipeline->finish_stage();
-        if (!pipeline->is_finished()) {
+        // not is_finished(): a finished pipeline may already be reset and restarted
+        if (!pipeline->finish_stage()) {
             enqueue(pipeline);
         }
     }
@@ -106,46 +191,43 @@ if (!is_strawman) {
     return true;
 } else {
     bool is_io = false;
+    stage_tag kind = STAGE_ALLOC;
 
     {
         std::lock_guard<std::mutex> _(io_lock);
         auto entry = io_try_get();
         if (entry.has_value()) {
-            auto pipeline = entry->pipeline;
-            auto task = entry->task;
-            if (pipeline->get_current_stage()->submit(task)) {
-                pipeline->finish_stage();
-                if (!pipeline->is_finished()) {
-                    enqueue(pipeline);
-                }
-            }
+            if (entry->pipeline->io_complete(entry->task))
+                enqueue(entry->pipeline);
             return true;
         }
     }
 
     std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>> res;
-    {
-        std::lock_guard<std::mutex> _(lock);
-        GGML_ASSERT(main_tid != -1);
-        while (true) {
+    GGML_ASSERT(main_tid != -1);
+    while (true) {
 #ifdef LLAMA_USE_CHCORE_API
-            res = get_task(alloc, (void *)(long)get_cma_index());
+        res = get_task(queues[STAGE_ALLOC], (void *)(long)get_cma_index(), false, alloc_limit);
 #else
-            if (gettid() == main_tid) {
-                res = get_task(alloc, (void *)(long)get_cma_index());
-            }
+        if (gettid() == main_tid) {
+            res = get_task(queues[STAGE_ALLOC], (void *)(long)get_cma_index(), false, alloc_limit);
+        }
 #endif
-            if (res.first) break;
-            res = get_task(io, NULL);
-            if (res.first) {
-                is_io = true;
-                break;
-            }
-            
-            res = get_task(decrypt, NULL);
-            if (res.first) break;
-            return false;
+        if (res.first) break;
+        res = get_task(queues[STAGE_IO], NULL, false);
+        if (res.first) {
+            is_io = true;
+            kind = STAGE_IO;
+            break;
         }
+
+        kind = STAGE_RELAYOUT;
+        res = get_task(queues[STAGE_RELAYOUT], NULL, true);
+        if (res.first) break;
+        kind = STAGE_DECRYPT;
+        res = get_task(queues[STAGE_DECRYPT], NULL, true);
+        if (res.first) break;
+        return false;
     }
 
     auto pipeline = res.first;
@@ -153,11 +235,11 @@ if (!is_strawman) {
     GGML_ASSERT(pipeline && task);
 
     if (is_io) io_lock.lock();
-    task->step();
+    run_task(pipeline, task, kind);
+    if (is_io) io_flush();
     if (is_io) io_lock.unlock();
     if (pipeline->get_current_stage()->submit(task)) {
-        pipeline->finish_stage();
-        if (!pipeline->is_finished()) {
+        if (!pipeline->finish_stage()) {
             enqueue(pipeline);
         }
     }
@@ -170,15 +252,23 @@ void LayerScheduler::enqueue(std::shared_ptr<Pipeline> pipeline)
 {
     auto current_stage = pipeline->get_current_stage();
     GGML_ASSERT(current_stage);
+    GGML_ASSERT(current_stage->tag < STAGE_NR);
 
-    std::lock_guard<std::mutex> _(lock);
-    if (std::dynamic_pointer_cast<AllocStage>(current_stage)) {
-        alloc.push(pipeline);
-    } else if (std::dynamic_pointer_cast<IOStage>(current_stage)) {
-        io.push(pipeline);
-    } else if (std::dynamic_pointer_cast<DecryptStage>(current_stage)) {
-        decrypt.push(pipeline);
-    } else {
-        GGML_ASSERT(false);
+    auto &queue = queues[current_stage->tag];
+    int index = layer_bucket(pipeline);
+    auto &bucket = queue.buckets[index];
+    bucket.lock();
+    // only while it has ready blocks, see DecryptStage::get_task
+    if (current_stage->tag == STAGE_DECRYPT && !std::static_pointer_cast<DecryptStage>(current_stage)->claim()) {
+        bucket.unlock();
+        return;
     }
-}
\ No newline at end of file
+    auto pos = std::upper_bound(bucket.pipelines.begin(), bucket.pipelines.end(), pipeline,
+        [](const std::shared_ptr<Pipeline> &left, const std::shared_ptr<Pipeline> &right) {
+            return (int64_t)left->get_sched_info() > (int64_t)right->get_sched_info();
+        });
+    bucket.pipelines.insert(pos, pipeline);
+    queue.nonempty[index / 64].fetch_or(1UL << (index % 64), std::memory_order_release);
+    bucket.unlock();
+    pipeline_notify_work();
+}
@@ -5,6 +5,8 @@
 #include "unicode.h"
 
 #include "prefetch.h"
+#include "crypto.h"
+#include "stream-order.h"
 
 #include "ggml.h"
 #include "ggml-alloc.h"
@@ -102,6 +104,7 @@
 #include <set>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 
@@ -4448,6 +4451,10 @@ struct llama_model_loader {
         uint16_t n_split = 0;
         get_key(llm_kv(LLM_KV_SPLIT_COUNT), n_split, false);
 
+        if (crypto_load_container(meta) && n_split > 1) {
+            throw std::runtime_error(format("%s: encrypted models cannot be split", __func__));
+        }
+
         // Load additional GGML contexts
         if (n_split > 1) {
             uint16_t idx = 0;
@@ -4523,6 +4530,28 @@ struct llama_model_loader {
         LLAMA_LOG_INFO("%s: loaded meta data with %d key-value pairs and %d tensors from %s (version %s)\n",
                 __func__, n_kv, n_tensors, fname.c_str(), llama_file_version_name(fver));
 
+        // weights are streamed in first-use order, anything else makes the reads seek
+        {
+            std::vector<std::tuple<uint16_t, size_t, int64_t>> by_offset;
+            for (const auto & w : weights) {
+                by_offset.emplace_back(w.idx, w.offs, stream_order_rank(w.tensor->name));
+            }
+            std::sort(by_offset.begin(), by_offset.end());
+            int n_unordered = 0;
+            int64_t max_rank = INT64_MIN;
+            for (size_t i = 0; i < by_offset.size(); i++) {
+                if (i > 0 && std::get<0>(by_offset[i]) != std::get<0>(by_offset[i - 1])) {
+                    max_rank = INT64_MIN;
+                }
+                n_unordered += std::get<2>(by_offset[i]) < max_rank;
+                max_rank = std::max(max_rank, std::get<2>(by_offset[i]));
+            }
+            if (n_unordered > 0) {
+                LLAMA_LOG_WARN("%s: %d of %d tensors are not stored in first-use order, weight streaming will seek; "
+                        "rewrite the model with llama-gguf-reorder\n", __func__, n_unordered, n_tensors);
+            }
+        }
+
         // determine file type based on the number of tensors for each quantization and print meta data
         // TODO: make optional
         {
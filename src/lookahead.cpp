@@ -0,0 +1,179 @@
+#include "lookahead.h"
+#include "io-frontend.h"
+#include "pipeline.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+// a wait shorter than this doesn't count as a stall
+#define LOOKAHEAD_STALL_US (200)
+// stall-free layers before the window may shrink by one
+#define LOOKAHEAD_CALM_LAYERS (4)
+#define LOOKAHEAD_INIT (4)
+
+extern Scheduler *sched;
+extern std::atomic<int64_t> decrypt_time;
+extern std::atomic<size_t> decrypt_size;
+
+static std::once_flag lookahead_once;
+static bool enabled;
+static bool adaptive;
+
+static std::mutex lookahead_mtx;
+static std::map<int, size_t> layer_size;
+static int cur_layer = INT_MIN;
+static int64_t layer_start;
+static int64_t cur_wait;
+// moving average of the time compute spends on one layer, without waits
+static double compute_us;
+// the window and how it came about
+static int window = LOOKAHEAD_INIT;
+static int model_window;
+static int bias;
+static int calm;
+
+static int stall_nr;
+static int64_t stall_us;
+static size_t ahead_bytes;
+static size_t ahead_peak;
+
+static void init_lookahead(void) {
+    const char *env = getenv("LLAMA_PREFETCH_LOOKAHEAD");
+    if (!env)
+        return;
+    adaptive = !strcmp(env, "auto");
+    if (!adaptive)
+        window = std::max(atoi(env), 1);
+    enabled = true;
+    printf("%s: %s lookahead of %d layers\n", __func__, adaptive ? "adaptive" : "fixed", window);
+}
+
+bool lookahead_enabled(void) {
+    std::call_once(lookahead_once, init_lookahead);
+    return enabled;
+}
+
+// layers ahead needed to stream one layer while compute runs on the others
+static int estimate_window(size_t size) {
+    double bw = io_bandwidth();
+    int64_t dec_time = decrypt_time, dec_size = decrypt_size;
+    // per-thread rate, conservative when several threads decrypt
+    if (decrypt_enabled() && dec_time > 0)
+        bw = bw ? std::min(bw, (double)dec_size / dec_time) : (double)dec_size / dec_time;
+    if (!bw || !compute_us)
+        return window;
+    return (int)ceil(size / bw / compute_us);
+}
+
+// let the alloc stage run up to window layers past cur_layer
+static void apply_window(void) {
+    auto iter = layer_size.find(cur_layer);
+    ahead_bytes = 0;
+    int limit = cur_layer;
+    for (int i = 0; i < window && iter != layer_size.end(); i++) {
+        if (++iter == layer_size.end())
+            break;
+        limit = iter->first;
+        ahead_bytes += iter->second;
+    }
+    // the window reaches past the output, nothing left to hold back
+    if (iter == layer_size.end())
+        limit = INT_MAX;
+    ahead_peak = std::max(ahead_peak, ahead_bytes);
+    sched->set_alloc_limit(limit);
+}
+
+void lookahead_register(int layer, size_t size) {
+    if (!lookahead_enabled())
+        return;
+    std::lock_guard<std::mutex> _(lookahead_mtx);
+    layer_size[layer] += size;
+    if (cur_layer == INT_MIN) {
+        // before the first use, count from the embeddings
+        sched->set_alloc_limit(layer_size.begin()->first + window);
+    }
+}
+
+void lookahead_use(int layer) {
+    if (!enabled || layer == cur_layer)
+        return;
+    std::lock_guard<std::mutex> _(lookahead_mtx);
+    if (layer == cur_layer)
+        return;
+
+    auto now = get_micro();
+    if (cur_layer != INT_MIN) {
+        double busy = std::max<int64_t>(now - layer_start - cur_wait, 0);
+        compute_us = compute_us ? 0.8 * compute_us + 0.2 * busy : busy;
+        if (cur_wait > LOOKAHEAD_STALL_US) {
+            stall_nr++;
+            stall_us += cur_wait;
+            bias = std::min(bias + 1, (int)layer_size.size());
+            calm = 0;
+        } else if (++calm >= LOOKAHEAD_CALM_LAYERS) {
+            bias--;
+            calm = 0;
+        }
+    }
+    cur_layer = layer;
+    layer_start = now;
+    cur_wait = 0;
+
+    if (adaptive) {
+        auto next = layer_size.upper_bound(layer);
+        model_window = estimate_window(next == layer_size.end() ? layer_size.begin()->second : next->second);
+        // the correction never takes the window below one layer
+        bias = std::max(bias, 1 - model_window);
+        window = std::clamp(model_window + bias, 1, (int)layer_size.size());
+    }
+    apply_window();
+}
+
+void lookahead_waited(int layer, int64_t wait_us) {
+    if (!enabled)
+        return;
+    std::lock_guard<std::mutex> _(lookahead_mtx);
+    if (layer == cur_layer)
+        cur_wait += wait_us;
+}
+
+void lookahead_restart(bool forget) {
+    if (!enabled)
+        return;
+    std::lock_guard<std::mutex> _(lookahead_mtx);
+    cur_layer = INT_MIN;
+    if (forget) {
+        compute_us = 0;
+        bias = 0;
+        calm = 0;
+    }
+    if (!layer_size.empty())
+        sched->set_alloc_limit(layer_size.begin()->first + window);
+}
+
+void lookahead_dump_measure(void) {
+    if (!enabled)
+        return;
+    std::lock_guard<std::mutex> _(lookahead_mtx);
+    if (adaptive) {
+        printf("lookahead %d layers (model %d, bias %+d), %.2f ms compute per layer\n", window, model_window, bias,
+               compute_us / 1000);
+    } else {
+        printf("lookahead %d layers, %.2f ms compute per layer\n", window, compute_us / 1000);
+    }
+    printf("lookahead stalls %d (%ld ms), ahead of compute %lu MB (peak %lu MB)\n", stall_nr, stall_us / 1000,
+           ahead_bytes >> 20, ahead_peak >> 20);
+}
+
+void lookahead_clear_measure(void) {
+    std::lock_guard<std::mutex> _(lookahead_mtx);
+    stall_nr = 0;
+    stall_us = 0;
+    ahead_peak = ahead_bytes;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Bounds how many layers past the one being computed may be allocated and
+// streamed, so weights are ready just in time instead of the whole model
+// piling up ahead of compute. The window follows a model (a layer's bytes
+// over the measured io and decrypt bandwidth, divided by the time compute
+// spends on one layer) plus a correction that grows on every stall and
+// slowly shrinks while compute runs without waiting.
+//
+//   LLAMA_PREFETCH_LOOKAHEAD=auto  adaptive window
+//   LLAMA_PREFETCH_LOOKAHEAD=N     fixed window of N layers
+//   unset                          no limit, every pipeline starts at once
+
+bool lookahead_enabled(void);
+void lookahead_register(int layer, size_t size);
+// compute needs a tensor of layer, called before waiting for it
+void lookahead_use(int layer);
+// compute waited wait_us for a tensor of layer
+void lookahead_waited(int layer, int64_t wait_us);
+// the next use starts a new pass from the embeddings, forget drops what was
+// learned so far
+void lookahead_restart(bool forget);
+void lookahead_dump_measure(void);
+void lookahead_clear_measure(void);
@@ -14,9 +14,7 @@ struct cma_region {
     size_t len;
     std::function<void(void)> destructor;
 
-    int tzd_fd;
-
-    cma_region(int tzd_fd, size_t size, std::function<void(void)> destructor);
+    cma_region(size_t size, std::function<void(void)> destructor);
     void ready(void);
     ~cma_region();
 };
@@ -25,7 +23,6 @@ struct mappings {
     std::unordered_map<size_t, std::weak_ptr<cma_region>> cma_regions;
     std::mutex tensors_mutex;
     std::vector<std::shared_ptr<cma_region>> tensors;
-    int fd;
     std::mutex work_queue_mutex;
     std::queue<std::shared_ptr<cma_region>> work_queue;
 
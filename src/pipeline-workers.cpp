@@ -0,0 +1,213 @@
+#include "pipeline-workers.h"
+#include "pipeline.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// how long an idle thread sleeps before looking again on its own
+#define IDLE_WAIT_NS (1000 * 1000)
+
+extern Scheduler *sched;
+extern pid_t main_tid;
+extern int on_fly_cnt;
+
+static std::once_flag start_once;
+static std::vector<std::thread> workers;
+static std::atomic<bool> running;
+static std::atomic<bool> stop;
+static bool compute_helps = true;
+
+static std::atomic<uint32_t> work_seq;
+static std::atomic<int> work_sleepers;
+static std::atomic<uint32_t> done_seq;
+static std::atomic<int> done_sleepers;
+
+static thread_local pipeline_thread_class thread_class = PIPELINE_THREAD_HELPER;
+
+static std::atomic<int64_t> task_nr[PIPELINE_THREAD_CLASS_NR][STAGE_NR];
+static std::atomic<int64_t> task_time[PIPELINE_THREAD_CLASS_NR][STAGE_NR];
+
+static void futex_wait(std::atomic<uint32_t> *addr, uint32_t val) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = IDLE_WAIT_NS };
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> *addr) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static std::vector<int> parse_cpus(const char *list) {
+    std::vector<int> cpus;
+    std::string str(list);
+    size_t pos = 0;
+    while (pos < str.size()) {
+        size_t end = str.find(',', pos);
+        if (end == std::string::npos)
+            end = str.size();
+        std::string item = str.substr(pos, end - pos);
+        size_t dash = item.find('-');
+        int first = atoi(item.c_str());
+        int last = dash == std::string::npos ? first : atoi(item.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+static void pin_to(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        printf("[warn] %s: cannot pin pipeline worker to cpu %d\n", __func__, cpu);
+}
+
+static void worker_main(int id, int cpu, std::promise<pid_t> *tid) {
+    if (cpu >= 0)
+        pin_to(cpu);
+    thread_class = PIPELINE_THREAD_WORKER;
+    if (tid)
+        tid->set_value(gettid());
+    while (!running && !stop)
+        sched_yield();
+
+    while (!stop.load(std::memory_order_relaxed)) {
+        uint32_t seq = work_seq.load(std::memory_order_acquire);
+        if (sched->step())
+            continue;
+        // the io owner has to keep polling for completions
+        if (id == 0 && on_fly_cnt) {
+            sched_yield();
+            continue;
+        }
+        work_sleepers++;
+        if (work_seq.load(std::memory_order_acquire) == seq)
+            futex_wait(&work_seq, seq);
+        work_sleepers--;
+    }
+}
+
+static void stop_workers(void) {
+    stop = true;
+    pipeline_notify_work();
+    for (auto &worker : workers)
+        worker.join();
+    workers.clear();
+    running = false;
+}
+
+static void start_workers(void) {
+    const char *help = getenv("LLAMA_PIPELINE_HELP");
+    compute_helps = !help || atoi(help);
+
+    const char *nr_env = getenv("LLAMA_PIPELINE_WORKERS");
+    int nr = nr_env ? atoi(nr_env) : 0;
+    if (nr <= 0) {
+        // nobody else would make progress
+        compute_helps = true;
+        return;
+    }
+    const char *cpus_env = getenv("LLAMA_PIPELINE_WORKER_CPUS");
+    std::vector<int> cpus = cpus_env ? parse_cpus(cpus_env) : std::vector<int>();
+
+    std::promise<pid_t> io_tid;
+    for (int i = 0; i < nr; i++) {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        workers.emplace_back(worker_main, i, cpu, i == 0 ? &io_tid : nullptr);
+    }
+    // alloc and io belong to worker 0 from now on
+    main_tid = io_tid.get_future().get();
+    running = true;
+    atexit(stop_workers);
+    printf("%s: %d pipeline workers%s%s, compute threads %s\n", __func__, nr,
+           cpus_env ? " on cpus " : "", cpus_env ? cpus_env : "", compute_helps ? "help" : "only wait");
+}
+
+void pipeline_workers_start(void) {
+    std::call_once(start_once, start_workers);
+}
+
+bool pipeline_workers_running(void) {
+    return running;
+}
+
+bool pipeline_compute_helps(void) {
+    return compute_helps;
+}
+
+void pipeline_set_thread_class(pipeline_thread_class cls) {
+    thread_class = cls;
+}
+
+pipeline_thread_class pipeline_get_thread_class(void) {
+    return thread_class;
+}
+
+void pipeline_count_task(stage_tag kind, int64_t us) {
+    task_nr[thread_class][kind].fetch_add(1, std::memory_order_relaxed);
+    task_time[thread_class][kind].fetch_add(us, std::memory_order_relaxed);
+}
+
+int64_t pipeline_tasks_run(void) {
+    int64_t nr = 0;
+    for (int cls = 0; cls < PIPELINE_THREAD_CLASS_NR; cls++) {
+        for (int kind = 0; kind < STAGE_NR; kind++)
+            nr += task_nr[cls][kind].load();
+    }
+    return nr;
+}
+
+void pipeline_notify_work(void) {
+    work_seq.fetch_add(1, std::memory_order_release);
+    if (work_sleepers.load(std::memory_order_relaxed))
+        futex_wake(&work_seq);
+}
+
+void pipeline_notify_done(void) {
+    done_seq.fetch_add(1, std::memory_order_release);
+    if (done_sleepers.load(std::memory_order_relaxed))
+        futex_wake(&done_seq);
+}
+
+uint32_t pipeline_done_seq(void) {
+    return done_seq.load(std::memory_order_acquire);
+}
+
+void pipeline_wait_done(uint32_t seq) {
+    done_sleepers++;
+    if (done_seq.load(std::memory_order_acquire) == seq)
+        futex_wait(&done_seq, seq);
+    done_sleepers--;
+}
+
+void pipeline_workers_dump_measure(void) {
+    static const char *class_name[PIPELINE_THREAD_CLASS_NR] = { "waiter", "helper", "worker" };
+    for (int cls = 0; cls < PIPELINE_THREAD_CLASS_NR; cls++) {
+        printf("pipeline %s tasks: alloc %ld (%ld ms) io %ld (%ld ms) decrypt %ld (%ld ms) relayout %ld (%ld ms)\n",
+               class_name[cls],
+               task_nr[cls][STAGE_ALLOC].load(), task_time[cls][STAGE_ALLOC].load() / 1000,
+               task_nr[cls][STAGE_IO].load(), task_time[cls][STAGE_IO].load() / 1000,
+               task_nr[cls][STAGE_DECRYPT].load(), task_time[cls][STAGE_DECRYPT].load() / 1000,
+               task_nr[cls][STAGE_RELAYOUT].load(), task_time[cls][STAGE_RELAYOUT].load() / 1000);
+    }
+}
+
+void pipeline_workers_clear_measure(void) {
+    for (int cls = 0; cls < PIPELINE_THREAD_CLASS_NR; cls++) {
+        for (int kind = 0; kind < STAGE_NR; kind++) {
+            task_nr[cls][kind] = 0;
+            task_time[cls][kind] = 0;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include "pipeline.h"
+
+// Optional pool of pipeline workers that keeps weights streaming while every
+// compute thread is busy.
+//   LLAMA_PIPELINE_WORKERS=N       start N workers, the first one owns alloc and io
+//   LLAMA_PIPELINE_WORKER_CPUS=L   pin them to the cpus in L, e.g. "0-3" or "0,2"
+//   LLAMA_PIPELINE_HELP=0          compute threads never step the scheduler
+//                                  themselves, they only wait for the workers
+
+enum pipeline_thread_class {
+    // compute thread blocked in use_param_tensor
+    PIPELINE_THREAD_WAITER,
+    // compute thread spinning in ggml's polling routine
+    PIPELINE_THREAD_HELPER,
+    PIPELINE_THREAD_WORKER,
+    PIPELINE_THREAD_CLASS_NR,
+};
+
+void pipeline_workers_start(void);
+bool pipeline_workers_running(void);
+bool pipeline_compute_helps(void);
+
+void pipeline_set_thread_class(pipeline_thread_class cls);
+pipeline_thread_class pipeline_get_thread_class(void);
+// account a task run by the calling thread
+void pipeline_count_task(stage_tag kind, int64_t us);
+// tasks run by all threads since the last clear
+int64_t pipeline_tasks_run(void);
+
+// work was queued for the scheduler
+void pipeline_notify_work(void);
+// some pipeline finished its last stage
+void pipeline_notify_done(void);
+uint32_t pipeline_done_seq(void);
+// sleep until pipeline_notify_done() moves past seq, or a short timeout
+void pipeline_wait_done(uint32_t seq);
+
+void pipeline_workers_dump_measure(void);
+void pipeline_workers_clear_measure(void);
@@ -1,34 +1,59 @@
 #include "ggml.h"
 #include "pipeline.h"
+#include "pipeline-workers.h"
 
 void Pipeline::rollback(void)
 {
+    relayout->rollback();
     decrypt->rollback();
     io->rollback();
     alloc->rollback();
     current_stage = alloc;
 }
 
+bool Pipeline::io_complete(std::shared_ptr<Task> task)
+{
+    auto [file_off, len] = io->complete(task);
+    return decrypt->io_done(file_off, len);
+}
+
 std::shared_ptr<Stage> Pipeline::get_current_stage(void)
 {
     return current_stage;
 }
 
-void Pipeline::finish_stage(void)
+bool Pipeline::finish_stage(void)
 {
     GGML_ASSERT(current_stage);
-    if (std::dynamic_pointer_cast<AllocStage>(current_stage)) {
+    switch (current_stage->tag) {
+    case STAGE_ALLOC:
         io->start(alloc->get_msg());
         current_stage = io;
-    } else if (std::dynamic_pointer_cast<IOStage>(current_stage)) {
-        decrypt->start(io->get_msg());
+        break;
+    case STAGE_IO:
+        // switch first: once started, io_complete may queue us as decrypting
         current_stage = decrypt;
-    } else if (std::dynamic_pointer_cast<DecryptStage>(current_stage)) {
+        decrypt->start(io->get_msg());
+        break;
+    case STAGE_DECRYPT:
+        relayout->start(decrypt->get_msg());
+        if (!relayout->empty()) {
+            current_stage = relayout;
+            break;
+        }
         final_msg = decrypt->get_msg();
         current_stage = nullptr;
-    } else {
-        GGML_ASSERT(false);
+        pipeline_notify_done();
+        return true;
+    case STAGE_RELAYOUT:
+        final_msg = relayout->get_msg();
+        current_stage = nullptr;
+        pipeline_notify_done();
+        return true;
+    default:
+        GGML_ABORT("unknown stage %d", current_stage->tag);
     }
+    return false;
 }
 
 bool Pipeline::is_finished(void)
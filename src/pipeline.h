@@ -6,16 +6,92 @@
 #include <queue>
 #include <mutex>
 #include <atomic>
+#include <deque>
+#include <vector>
+#include <cstdint>
+
+struct ggml_tensor;
 
 class Task {
 public:
     virtual ~Task() = default;
 
     virtual void step(void) = 0;
+    // bytes the task works on, for tracing
+    virtual size_t bytes(void) { return 0; }
+};
+
+// Tasks are created and dropped for every block of every tensor. Their memory
+// is recycled through a per-thread free list instead of going back to malloc;
+// a task freed by another thread simply joins that thread's list. Tasks
+// dropped by other thread_local destructors after the list is gone at thread
+// exit go straight back to malloc.
+template <typename T>
+struct task_allocator {
+    typedef T value_type;
+    enum { FREE_LIST_MAX = 1024 };
+
+    task_allocator() = default;
+    template <typename U> task_allocator(const task_allocator<U> &) {}
+
+    struct free_list_holder {
+        std::vector<void *> list;
+        ~free_list_holder() {
+            for (void *ptr : list)
+                ::operator delete(ptr);
+            destroyed() = true;
+        }
+    };
+    // trivially destructible, so still readable while thread_locals die
+    static bool &destroyed(void) {
+        static thread_local bool flag;
+        return flag;
+    }
+    static std::vector<void *> *free_list(void) {
+        if (destroyed())
+            return nullptr;
+        static thread_local free_list_holder holder;
+        return &holder.list;
+    }
+    T *allocate(size_t n) {
+        auto list = free_list();
+        if (n != 1 || !list || list->empty())
+            return (T *)::operator new(n * sizeof(T));
+        T *ptr = (T *)list->back();
+        list->pop_back();
+        return ptr;
+    }
+    void deallocate(T *ptr, size_t n) {
+        auto list = free_list();
+        if (n != 1 || !list || list->size() >= FREE_LIST_MAX) {
+            ::operator delete(ptr);
+            return;
+        }
+        list->push_back(ptr);
+    }
+    template <typename U> bool operator==(const task_allocator<U> &) const { return true; }
+    template <typename U> bool operator!=(const task_allocator<U> &) const { return false; }
+};
+
+template <typename T, typename... Args>
+std::shared_ptr<T> make_task(Args&&... args) {
+    return std::allocate_shared<T>(task_allocator<T>(), std::forward<Args>(args)...);
+}
+
+enum stage_tag {
+    STAGE_ALLOC,
+    STAGE_IO,
+    STAGE_DECRYPT,
+    STAGE_RELAYOUT,
+    STAGE_NR,
 };
 
 class Stage {
 public:
+    // what the stage is, so the scheduler needs no RTTI to route a pipeline
+    const stage_tag tag;
+
+    Stage(stage_tag tag): tag(tag) {}
     virtual ~Stage() = default;
 
     virtual void start(void *input) = 0;
@@ -27,9 +103,20 @@ public:
 
 struct Pipeline;
 
+// part of a tensor's buffer that lives in one cma entry
+struct cma_extent {
+    int cma_index;
+    int entry_index;
+    // offset in the tensor's buffer
+    off_t off;
+    size_t size;
+    // where that part starts within the entry
+    size_t entry_off;
+};
+
 struct alloc_io_msg {
     void *buf;
-    std::vector<std::tuple<int, int, off_t, size_t>> cma_indexes;
+    std::vector<cma_extent> cma_indexes;
     std::vector<std::vector<std::pair<unsigned long, size_t>>> paddr;
 };
 
@@ -38,7 +125,6 @@ private:
     size_t size;
     void *addr;
     alloc_io_msg msg;
-    int tzd_fd;
 
     std::mutex submit_pos_mtx;
     size_t submit_pos;
@@ -59,47 +145,116 @@ public:
 
 struct io_decrypt_msg {
     void *buf;
+    // file offset of buf
+    size_t off;
     std::vector<std::pair<unsigned long, unsigned long>> cma_region;
 };
 
+// Reads the tensor in segments. The stage is done once every segment has been
+// launched; completions are reported through complete() and feed the decrypt
+// stage chunk by chunk.
 class IOStage : public Stage {
 private:
+    struct io_segment {
+        int cma_index;
+        int entry_index;
+        // offset from io_align_down(off) in the file
+        off_t file_off;
+        // offset within the cma entry
+        size_t buf_off;
+        size_t len;
+    };
+
     size_t off;
     size_t size;
     std::shared_ptr<Pipeline> pipeline;
     io_decrypt_msg id_msg;
 
     void *buf;
-    std::vector<std::tuple<int, int, off_t, size_t>> cma_indexes;
+    std::vector<cma_extent> cma_indexes;
+    std::vector<io_segment> segments;
+    size_t launch_pos;
 
-    std::atomic<int> cnt_to_finish;
+    std::atomic<int> cnt_to_launch;
 
 public:
-    IOStage(size_t off, size_t size): off(off), size(size), pipeline(nullptr) {}
+    IOStage(size_t off, size_t size): Stage(STAGE_IO), off(off), size(size), pipeline(nullptr), launch_pos(0) {}
     void start(void *input) override;
     std::pair<std::shared_ptr<Task>, bool> get_task(void *) override;
     bool submit(std::shared_ptr<Task> task) override;
     void *get_msg(void) override;
     void rollback(void) override;
     void set_pipeline(std::shared_ptr<Pipeline> pipeline);
+    // file range [first, first + second) of a finished io task
+    std::pair<size_t, size_t> complete(std::shared_ptr<Task> task);
 
 };
 
+// whether decrypt tasks do real work in this build and environment
+bool decrypt_enabled(void);
+
+// Blocks become ready as the io segments covering them complete, so a tensor
+// is decrypted while its later segments are still being read. The pipeline
+// sits in the scheduler's decrypt queue only while it has ready blocks.
 class DecryptStage : public Stage {
 private:
     void *buf;
+    size_t off;
     size_t size;
+    // per-chunk GCM tags when the model is an encrypted container
+    const unsigned char *tags;
     int block_nr;
     std::atomic<int> finished_nr;
-    size_t submit_pos;
+
+    std::mutex ready_mtx;
+    // bytes read so far of every block
+    std::vector<size_t> received;
+    size_t received_all;
+    std::deque<int> ready;
+    bool started;
+    bool queued;
+#ifdef LLAMA_USE_CHCORE_API
+    std::vector<std::pair<unsigned long, unsigned long>> cma_region;
+    void release_all(void);
+#endif
+
+public:
+    DecryptStage(size_t off, size_t size);
+    void start(void *input) override;
+    std::pair<std::shared_ptr<Task>, bool> get_task(void *) override;
+    bool submit(std::shared_ptr<Task> task) override;
+    void *get_msg(void) override;
+    void rollback(void) override;
+    // account a finished read of file range [file_off, file_off + len),
+    // returns whether the pipeline may now need to be queued for decryption
+    bool io_done(size_t file_off, size_t len);
+    // take the right to sit in the decrypt queue, false if nothing to do yet
+    bool claim(void);
+
+};
+
+// Packs the decrypted weight into the layout the accelerator reads, one task
+// per tile, so matmuls stop repacking it on every call. Tensors the backend
+// doesn't take have no tiles and skip the stage.
+class RelayoutStage : public Stage {
+private:
+    const ggml_tensor *tensor;
+    void *buf;
+    int tile_nr;
+    std::atomic<int> next_tile;
+    std::atomic<int> finished_nr;
 
 public:
-    DecryptStage(size_t size);
+    RelayoutStage(const ggml_tensor *tensor): Stage(STAGE_RELAYOUT), tensor(tensor), buf(NULL), tile_nr(0) {}
     void start(void *input) override;
     std::pair<std::shared_ptr<Task>, bool> get_task(void *) override;
     bool submit(std::shared_ptr<Task> task) override;
     void *get_msg(void) override;
     void rollback(void) override;
+    // nothing to pack since start()
+    bool empty(void) { return tile_nr == 0; }
+    // memory the packed copy holds on top of the weight once finished
+    size_t packed_size(void);
 
 };
 
@@ -108,6 +263,7 @@ private:
     std::shared_ptr<AllocStage> alloc;
     std::shared_ptr<IOStage> io;
     std::shared_ptr<DecryptStage> decrypt;
+    std::shared_ptr<RelayoutStage> relayout;
     void *sched_info;
     std::shared_ptr<Stage> current_stage;
     void *final_msg;
@@ -117,12 +273,16 @@ public:
         std::shared_ptr<AllocStage> alloc,
         std::shared_ptr<IOStage> io,
         std::shared_ptr<DecryptStage> decrypt,
+        std::shared_ptr<RelayoutStage> relayout,
         void *sched_info
-    ) : alloc(alloc), io(io), decrypt(decrypt), sched_info(sched_info), current_stage(alloc) {}
+    ) : alloc(alloc), io(io), decrypt(decrypt), relayout(relayout), sched_info(sched_info), current_stage(alloc) {}
 
     void rollback(void);
+    // route an io completion to the decrypt stage, true if it has work now
+    bool io_complete(std::shared_ptr<Task> task);
     std::shared_ptr<Stage> get_current_stage(void);
-    void finish_stage(void);
+    // true if that was the last stage
+    bool finish_stage(void);
     bool is_finished(void);
     void *get_sched_info(void);
     void *get_final_msg(void);
@@ -135,26 +295,43 @@ public:
 
     virtual bool step(void) = 0;
     virtual void enqueue(std::shared_ptr<Pipeline> pipeline) = 0;
+    // don't start allocating pipelines of layers after layer
+    virtual void set_alloc_limit(int layer) { (void)layer; }
 };
 
+// Pipelines wait in one bucket per stage and layer, ordered by sched_info
+// within the bucket. Each bucket has its own spin lock and a bitmap tracks the
+// non-empty ones, so threads only meet when they want the same layer.
+#define SCHED_LAYER_NR (256)
+
 class LayerScheduler : public Scheduler {
-    struct pipeline_cmp {
-        bool operator()(const std::shared_ptr<Pipeline> &left, const std::shared_ptr<Pipeline> &right) {
-            auto left_sched_info = (int64_t)left->get_sched_info();
-            auto right_sched_info = (int64_t)right->get_sched_info();
-            return left_sched_info > right_sched_info;
-        }
+    struct bucket {
+        std::atomic<bool> busy{false};
+        // sorted by descending sched_info, the next pipeline is at the back
+        std::vector<std::shared_ptr<Pipeline>> pipelines;
+
+        bool try_lock(void) { return !busy.exchange(true, std::memory_order_acquire); }
+        void lock(void);
+        void unlock(void) { busy.store(false, std::memory_order_release); }
+    };
+
+    struct stage_queue {
+        bucket buckets[SCHED_LAYER_NR];
+        std::atomic<uint64_t> nonempty[SCHED_LAYER_NR / 64];
     };
-    typedef std::priority_queue<std::shared_ptr<Pipeline>, std::vector<std::shared_ptr<Pipeline>>, pipeline_cmp> layer_queue_t;
 
 private:
-    layer_queue_t alloc, io, decrypt;
-    std::mutex lock;
+    stage_queue queues[STAGE_NR];
+    // last bucket the alloc stage may take pipelines from
+    std::atomic<int> alloc_limit{SCHED_LAYER_NR - 1};
 
 public:
     bool step(void) override;
     void enqueue(std::shared_ptr<Pipeline> pipeline) override;
+    void set_alloc_limit(int layer) override;
 
 private:
-    std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>> get_task(layer_queue_t &queue, void *arg);
+    // busy buckets are skipped when spread is set, else waited for
+    std::pair<std::shared_ptr<Pipeline>, std::shared_ptr<Task>> get_task(stage_queue &queue, void *arg, bool spread,
+                                                                         int last_bucket = SCHED_LAYER_NR - 1);
 };
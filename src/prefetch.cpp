@@ -16,6 +16,15 @@
 #include <mutex>
 #include <thread>
 #include "pipeline.h"
+#include "pipeline-workers.h"
+#include "residency.h"
+#include "cache-plan.h"
+#include "stream-window.h"
+#include "lookahead.h"
+#include "trace.h"
+#ifndef LLAMA_USE_CHCORE_API
+#include "secure-slab.h"
+#endif
 
 bool is_strawman = false;
 
@@ -59,6 +68,9 @@ static std::pair<std::string, int> parse_name(const char *tensor_name) {
 int64_t use_wait_time;
 int64_t use_wait_cpu_time;
 int64_t base_time;
+// whether the cache budget was planned, and the stall the plan predicts
+static bool planned;
+static double planned_stall;
 
 extern "C" {
 
@@ -75,7 +87,24 @@ void use_param_tensor(
     GGML_ASSERT(desc_iter != param_tensors.end());
     use_mtx.unlock();
     auto pipeline = desc_iter->second->pipeline;
+    int layer = (int64_t)pipeline->get_sched_info() >> 32;
+    int64_t wait_start = 0;
+    if (ith == 0) {
+        stream_window_use(layer);
+        lookahead_use(layer);
+        residency_use(pipeline.get());
+        wait_start = get_micro();
+    }
+    auto cls = pipeline_get_thread_class();
+    pipeline_set_thread_class(PIPELINE_THREAD_WAITER);
     while (!pipeline->is_finished()) {
+        if (!pipeline_compute_helps()) {
+            // the workers do everything, just sleep until some tensor is ready
+            uint32_t seq = pipeline_done_seq();
+            if (!pipeline->is_finished())
+                pipeline_wait_done(seq);
+            continue;
+        }
 #ifdef TZ_LLM_MEASURE
         auto start = get_micro();
 #endif
@@ -86,8 +115,13 @@ void use_param_tensor(
         }
 #endif
     }
-    if (ith == 0)
+    pipeline_set_thread_class(cls);
+    if (ith == 0) {
+        auto wait_end = get_micro();
+        lookahead_waited(layer, wait_end - wait_start);
+        trace_event(TRACE_WAIT, (int64_t)pipeline->get_sched_info(), wait_start, wait_end, ggml_nbytes(tensor));
         tensor->data = pipeline->get_final_msg();
+    }
 #ifdef TZ_LLM_MEASURE
     if (ith == 0)
         use_wait_time += get_micro() - start;
@@ -97,12 +131,18 @@ void use_param_tensor(
 }
 
 void reset_param_tensor(void) {
-    for (auto &desc: param_tensors) {
-        desc.second->pipeline->rollback();
+    // the window already wrapped around to the first layers
+    if (stream_window_enabled())
+        return;
+    // resident tensors stay decrypted for the next request
+    auto evicted = residency_next_request();
+    lookahead_restart(false);
+    for (auto &pipeline: evicted) {
+        pipeline->rollback();
     }
-    for (auto &desc: param_tensors) {
-        desc.second->pipeline->get_current_stage()->start(NULL);
-        sched->enqueue(desc.second->pipeline);
+    for (auto &pipeline: evicted) {
+        pipeline->get_current_stage()->start(NULL);
+        sched->enqueue(pipeline);
     }
 }
 
@@ -133,30 +173,88 @@ void clear_measure(void) {
     io_size = 0;
     use_wait_time = 0;
     use_wait_cpu_time = 0;
+    io_clear_measure();
+    lookahead_clear_measure();
+    pipeline_workers_clear_measure();
+    stream_window_clear_measure();
 }
 
 void dump_measure(void) {
     printf("decrypt time %d ms\n", decrypt_time / 1000);
     printf("decrypt size %d MB\n", decrypt_size / 1024 / 1024);
+    // summed over threads, so this is what one core sustains
+    printf("decrypt bandwidth %.2f GB/s per thread\n", decrypt_time ? 1e-3 * decrypt_size / decrypt_time : 0.0);
     printf("cma time %d ms\n", cma_time / 1000);
     printf("cma size %d MB\n", cma_size / 1024 / 1024);
     printf("io time %d ms\n", io_time / 1000);
     printf("io size %d MB\n", io_size / 1024 / 1024);
     printf("use wait io time %d ms\n", (use_wait_time - use_wait_cpu_time) / 1000);
     printf("use wait cpu time %d ms\n", use_wait_cpu_time / 1000);
+    if (planned)
+        printf("use wait io time predicted %.0f ms\n", planned_stall / 1000);
+    io_dump_measure();
+    lookahead_dump_measure();
+    pipeline_workers_dump_measure();
+    residency_dump_measure();
+    stream_window_dump_measure();
+#ifndef LLAMA_USE_CHCORE_API
+    slab_dump_measure();
+#endif
 }
 
 size_t all = 0;
+static size_t recorded_nr = 0;
 
 void record_tensor_size(size_t size) {
     all += size;
+    recorded_nr++;
 }
 
-static int cache_p = 0;
+// percent of the model loaded before the first request
+static int cache_percent = 0;
 
 void set_cache_proportion(int p) {
     printf("%s to %d\n", __func__, p);
-    cache_p = p;
+    cache_percent = p * 20;
+}
+
+void set_cache_percent(int p) {
+    printf("%s to %d\n", __func__, p);
+    GGML_ASSERT(p >= 0 && p <= 100);
+    cache_percent = p;
+}
+
+// With a cache budget, pipelines wait here until every tensor is registered
+// and the planner has picked which of them to load up front.
+static std::vector<std::shared_ptr<param_tensor_desc>> unplanned;
+
+static void pin_planned(void) {
+    std::vector<cache_plan_tensor> plan;
+    for (auto &desc : unplanned)
+        plan.push_back({ggml_nbytes(desc->tensor), (int64_t)desc->pipeline->get_sched_info(), false});
+    planned_stall = cache_plan(plan, all * cache_percent / 100);
+    planned = true;
+
+    size_t used = 0;
+    for (size_t i = 0; i < unplanned.size(); i++) {
+        if (plan[i].pinned)
+            sched->enqueue(unplanned[i]->pipeline);
+    }
+    for (size_t i = 0; i < unplanned.size(); i++) {
+        if (!plan[i].pinned)
+            continue;
+        used += plan[i].size;
+        printf("use %lu MB of %lu MB\n", used / 1024 / 1024, all / 1024 / 1024);
+        residency_pin(unplanned[i]->pipeline.get());
+        use_param_tensor(unplanned[i]->tensor, 0);
+    }
+    for (size_t i = 0; i < unplanned.size(); i++) {
+        if (!plan[i].pinned)
+            sched->enqueue(unplanned[i]->pipeline);
+    }
+    unplanned.clear();
+    // loading isn't compute, don't learn from it
+    lookahead_restart(true);
 }
 
 void register_param_tensor(
@@ -166,9 +264,12 @@ void register_param_tensor(
     int fd
 ) {
     extern pid_t main_tid;
-    main_tid = gettid();
+    pipeline_workers_start();
+    // otherwise worker 0 owns alloc and io
+    if (!pipeline_workers_running())
+        main_tid = gettid();
     extern bool is_strawman;
-    if (!is_strawman) {
+    if (!is_strawman && pipeline_compute_helps()) {
         ggml_set_polling_routine(sched_step);
     }
     if (tensor == NULL) return;
@@ -176,24 +277,36 @@ void register_param_tensor(
 
     int layer = parse_name(tensor->name).second;
     static int cnt = 0;
+    auto relayout = std::make_shared<RelayoutStage>(tensor);
     auto pipeline = std::make_shared<Pipeline>(
         std::make_shared<AllocStage>(off, len),
         std::make_shared<IOStage>(off, len),
-        std::make_shared<DecryptStage>(len),
+        std::make_shared<DecryptStage>(off, len),
+        relayout,
         (void *)((int64_t)layer << 32 | (cnt++))
     );
+    // the packed copy stays next to the weight, so the budgets pay for both
+    size_t resident = len + relayout->packed_size();
     // printf("%s %d: %s %p\n", __func__, __LINE__, tensor->name, pipeline->get_sched_info());
     pipeline->set_self();
+    trace_name((int64_t)pipeline->get_sched_info(), tensor->name);
     auto desc = std::make_shared<param_tensor_desc>(tensor, pipeline);
     param_tensors.emplace(tensor, desc);
+    residency_register(pipeline, resident);
 
     pipeline->get_current_stage()->start(NULL);
-    sched->enqueue(pipeline);
-    static size_t used = 0;
-    used += len;
-    if (used <= all * cache_p / 5) {
-        printf("use %lu MB of %lu MB\n", used / 1024 / 1024, all / 1024 / 1024);
-        use_param_tensor(tensor, 0);
+    if (stream_window_enabled()) {
+        // no cache budget here, everything takes turns in the window
+        if (stream_window_register(pipeline, layer, resident))
+            sched->enqueue(pipeline);
+    } else if (!cache_percent || planned || !recorded_nr) {
+        lookahead_register(layer, len);
+        sched->enqueue(pipeline);
+    } else {
+        lookahead_register(layer, len);
+        unplanned.push_back(desc);
+        if (unplanned.size() == recorded_nr)
+            pin_planned();
     }
     clear_measure();
     base_time = get_micro();
@@ -0,0 +1,76 @@
+#include "ggml.h"
+#include "pipeline.h"
+#ifdef GGML_USE_RKNPURE
+#include "ggml-rknpu-re.h"
+#endif
+
+class RelayoutTask : public Task {
+public:
+    const ggml_tensor *tensor;
+    const void *data;
+    int tile;
+    size_t size;
+
+    RelayoutTask(const ggml_tensor *tensor, const void *data, int tile, size_t size)
+        : tensor(tensor), data(data), tile(tile), size(size) {}
+    size_t bytes(void) override { return size; }
+    void step(void) override {
+#ifdef GGML_USE_RKNPURE
+        ggml_rknpure_relayout_tile(tensor, data, tile);
+#endif
+    }
+};
+
+void RelayoutStage::start(void *input)
+{
+    buf = input;
+#ifdef GGML_USE_RKNPURE
+    tile_nr = ggml_rknpure_relayout_begin(tensor);
+#else
+    tile_nr = 0;
+#endif
+    next_tile = 0;
+    finished_nr = 0;
+}
+
+std::pair<std::shared_ptr<Task>, bool> RelayoutStage::get_task(void *)
+{
+    int tile = next_tile++;
+    GGML_ASSERT(tile < tile_nr);
+    auto task = make_task<RelayoutTask>(tensor, buf, tile, ggml_nbytes(tensor) / tile_nr);
+    return { task, tile + 1 == tile_nr };
+}
+
+bool RelayoutStage::submit(std::shared_ptr<Task> task)
+{
+    if (finished_nr.fetch_add(1) + 1 < tile_nr)
+        return false;
+#ifdef GGML_USE_RKNPURE
+    ggml_rknpure_relayout_end(tensor);
+#endif
+    return true;
+}
+
+size_t RelayoutStage::packed_size(void)
+{
+#ifdef GGML_USE_RKNPURE
+    return ggml_rknpure_relayout_size(tensor);
+#else
+    return 0;
+#endif
+}
+
+void *RelayoutStage::get_msg(void)
+{
+    // the plain weight stays, for whatever still runs on the cpu
+    return buf;
+}
+
+void RelayoutStage::rollback(void)
+{
+#ifdef GGML_USE_RKNPURE
+    if (tile_nr)
+        ggml_rknpure_relayout_drop(tensor);
+#endif
+    tile_nr = 0;
+}
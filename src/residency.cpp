@@ -0,0 +1,130 @@
+#include "residency.h"
+#include "ggml.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <unordered_map>
+
+struct residency_entry {
+    std::shared_ptr<Pipeline> pipeline;
+    size_t size;
+    // position of the first use within the last request, -1 if unused
+    int64_t first_use;
+    // kept decrypted since the previous request
+    bool resident;
+    bool pinned;
+};
+
+static std::mutex residency_mtx;
+static std::vector<residency_entry> entries;
+static std::unordered_map<Pipeline *, size_t> entry_index;
+
+static size_t budget;
+static std::once_flag budget_once;
+
+static int request_nr;
+static int64_t use_seq;
+static size_t hit_bytes;
+static size_t miss_bytes;
+// rolled back at the start of the current request
+static size_t restream_bytes;
+
+static void init_budget(void) {
+    const char *env = getenv("LLAMA_RESIDENCY_MB");
+    budget = env ? (size_t)atol(env) << 20 : 0;
+    if (budget)
+        printf("%s: keep up to %lu MB of weights across requests\n", __func__, budget >> 20);
+}
+
+void residency_register(std::shared_ptr<Pipeline> pipeline, size_t size) {
+    std::call_once(budget_once, init_budget);
+    std::lock_guard<std::mutex> _(residency_mtx);
+    GGML_ASSERT(entry_index.find(pipeline.get()) == entry_index.end());
+    entry_index.emplace(pipeline.get(), entries.size());
+    entries.push_back({pipeline, size, -1, false, false});
+}
+
+void residency_pin(Pipeline *pipeline) {
+    std::lock_guard<std::mutex> _(residency_mtx);
+    auto iter = entry_index.find(pipeline);
+    GGML_ASSERT(iter != entry_index.end());
+    entries[iter->second].pinned = true;
+    entries[iter->second].resident = true;
+}
+
+void residency_use(Pipeline *pipeline) {
+    std::lock_guard<std::mutex> _(residency_mtx);
+    auto iter = entry_index.find(pipeline);
+    GGML_ASSERT(iter != entry_index.end());
+    auto &entry = entries[iter->second];
+    if (entry.first_use >= 0)
+        return;
+    entry.first_use = use_seq++;
+    if (entry.resident)
+        hit_bytes += entry.size;
+    else
+        miss_bytes += entry.size;
+}
+
+std::vector<std::shared_ptr<Pipeline>> residency_next_request(void) {
+    std::call_once(budget_once, init_budget);
+    std::lock_guard<std::mutex> _(residency_mtx);
+
+    size_t used = hit_bytes + miss_bytes;
+    if (budget) {
+        printf("residency: request %d hit %.1f%% (%lu of %lu MB resident), re-streamed %lu MB\n", request_nr,
+               used ? 100.0 * hit_bytes / used : 0.0, hit_bytes >> 20, used >> 20, restream_bytes >> 20);
+    }
+
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    // unused tensors go last
+    std::stable_sort(order.begin(), order.end(), [](size_t a, size_t b) {
+        return (uint64_t)entries[a].first_use < (uint64_t)entries[b].first_use;
+    });
+
+    size_t total = 0;
+    for (auto &entry : entries)
+        total += entry.size;
+    size_t kept = 0;
+    std::vector<std::shared_ptr<Pipeline>> evicted;
+    restream_bytes = 0;
+    for (size_t i : order) {
+        auto &entry = entries[i];
+#ifdef LLAMA_USE_CHCORE_API
+        // the cma pool is a stack and TZASC regions only grow, so keep
+        // everything or nothing
+        bool keep = budget && total <= budget;
+#else
+        bool keep = budget && kept + entry.size <= budget;
+#endif
+        // without a budget nothing survives the request, pinned or not
+        bool pinned = entry.pinned && budget;
+        // a pipeline still in flight can't be rolled back yet, keep it too
+        if (pinned || !entry.pipeline->is_finished())
+            keep = true;
+        if (!keep) {
+            evicted.push_back(entry.pipeline);
+            restream_bytes += entry.size;
+        } else if (!pinned) {
+            kept += entry.size;
+        }
+        entry.resident = keep;
+        entry.first_use = -1;
+    }
+
+    request_nr++;
+    use_seq = 0;
+    hit_bytes = 0;
+    miss_bytes = 0;
+    return evicted;
+}
+
+void residency_dump_measure(void) {
+    std::lock_guard<std::mutex> _(residency_mtx);
+    size_t used = hit_bytes + miss_bytes;
+    printf("residency hit %.1f%% (%lu of %lu MB), re-streamed %lu MB\n", used ? 100.0 * hit_bytes / used : 0.0,
+           hit_bytes >> 20, used >> 20, restream_bytes >> 20);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "pipeline.h"
+
+// Keeps decrypted tensors alive across requests. Instead of rolling back
+// every pipeline, reset_param_tensor() only rolls back what does not fit in
+// LLAMA_RESIDENCY_MB and streams that part again for the next request.
+//
+// Tensors consumed early in the forward pass are kept first: nothing runs
+// before them to hide their re-streaming, so they decide TTFT, while later
+// layers load behind the compute of earlier ones.
+
+void residency_register(std::shared_ptr<Pipeline> pipeline, size_t size);
+// loaded up front for the cache budget, not charged to it and only evicted
+// when LLAMA_RESIDENCY_MB is 0
+void residency_pin(Pipeline *pipeline);
+// the current request needs the tensor of pipeline
+void residency_use(Pipeline *pipeline);
+// end the current request, returns the pipelines to roll back and restart
+std::vector<std::shared_ptr<Pipeline>> residency_next_request(void);
+void residency_dump_measure(void);
@@ -0,0 +1,289 @@
+#include "secure-mem.h"
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include <sys/ioctl.h>
+
+#define ROUND_UP(x, n)   (((x) + (n)-1) & ~((n)-1))
+#define PAGE_SIZE 0x1000
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+struct llm_client_op_pages {
+	int cma_index;
+	int entry_index;
+	unsigned long size;
+};
+
+#define DEVICE_NAME "/dev/tc_ns_client"
+#define TC_NS_CLIENT_IOC_MAGIC  't'
+#define LLM_CLIENT_IOCTL_PUSH_PAGES \
+	_IOWR(TC_NS_CLIENT_IOC_MAGIC, 25, struct llm_client_op_pages)
+#define LLM_CLIENT_IOCTL_POP_PAGES \
+	_IOWR(TC_NS_CLIENT_IOC_MAGIC, 26, struct llm_client_op_pages)
+#define LLM_CLIENT_IOCTL_SET_PAGES \
+	_IOWR(TC_NS_CLIENT_IOC_MAGIC, 27, struct llm_client_op_pages)
+
+#define EMU_POOL_DEFAULT_MB (16384)
+
+extern void io_init(const char *model_path);
+extern void io_step(all_ring_buffer *task_queue);
+
+class DriverSecureMem : public SecureMemProvider {
+private:
+    int tzd_fd;
+    // SET_PAGES selects what the next mmap on the fd maps
+    std::mutex set_pages_mtx;
+    std::once_flag io_init_once;
+
+public:
+    DriverSecureMem(void) {
+        tzd_fd = open(DEVICE_NAME, O_RDWR);
+        GGML_ASSERT(tzd_fd >= 0);
+    }
+
+    all_ring_buffer *map_cmd_queue(void) override {
+        int fd = open(DEVICE_NAME, O_RDWR);
+        GGML_ASSERT(fd >= 0);
+        void *addr = mmap(NULL, CMD_QUEUE_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        GGML_ASSERT(addr != MAP_FAILED);
+        return (all_ring_buffer *)addr;
+    }
+
+    void *alloc_pages(size_t size, int *cma_index, int *entry_index) override {
+        std::lock_guard<std::mutex> _(set_pages_mtx);
+        struct llm_client_op_pages index;
+
+        int ret;
+        index.size = size;
+        ret = ioctl(tzd_fd, LLM_CLIENT_IOCTL_PUSH_PAGES, &index);
+        GGML_ASSERT(ret == 0);
+
+        ret = ioctl(tzd_fd, LLM_CLIENT_IOCTL_SET_PAGES, &index);
+        GGML_ASSERT(ret == 0);
+
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, tzd_fd, 0);
+        GGML_ASSERT(addr != MAP_FAILED);
+
+        *cma_index = index.cma_index;
+        *entry_index = index.entry_index;
+        return addr;
+    }
+
+    void free_pages(void *addr, size_t size) override {
+        int ret;
+
+        ret = munmap(addr, size);
+        GGML_ASSERT(ret == 0);
+
+        ret = ioctl(tzd_fd, LLM_CLIENT_IOCTL_POP_PAGES, &size);
+        GGML_ASSERT(ret == 0);
+    }
+
+    void *map_pages(int cma_index, int entry_index, size_t size) override {
+        std::lock_guard<std::mutex> _(set_pages_mtx);
+        struct llm_client_op_pages index = {
+            .cma_index = cma_index,
+            .entry_index = entry_index,
+        };
+        int ret = ioctl(tzd_fd, LLM_CLIENT_IOCTL_SET_PAGES, &index);
+        GGML_ASSERT(ret >= 0);
+
+        void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, tzd_fd, 0);
+        GGML_ASSERT(addr != MAP_FAILED);
+        return addr;
+    }
+
+    void unmap_pages(void *addr, size_t size) override {
+        GGML_ASSERT(munmap(addr, size) == 0);
+    }
+
+    // the io backend lives in this process and is driven synchronously
+    void io_rpc(all_ring_buffer *queue) override {
+        std::call_once(io_init_once, io_init, queue->io_model_path);
+        io_step(queue);
+    }
+};
+
+// One reserved region stands in for the CMA pool. Allocations are carved out
+// of it first-fit, and the io backend sees them at the same address since it
+// runs as a thread of this process.
+//
+// Everything here is private to the process: the pool, its entry table and
+// the command queue. A separately started CA process (fake_ca) would get a
+// queue and pool of its own, so the emulation only works with the built-in
+// backend thread.
+class EmulatedSecureMem : public SecureMemProvider {
+private:
+    std::mutex lock;
+    char *pool;
+    size_t pool_size;
+    bool is_hugetlb;
+    std::map<size_t, size_t> free_extents;
+    std::vector<std::pair<void *, size_t>> entries;
+
+    std::once_flag cmd_queue_once;
+    all_ring_buffer *cmd_queue;
+
+    std::once_flag backend_once;
+    std::thread backend;
+    std::atomic<bool> stop;
+
+    void reserve_pool(void) {
+        const char *env = getenv("LLAMA_TEE_EMULATION_POOL_MB");
+        pool_size = ROUND_UP((size_t)(env ? atol(env) : EMU_POOL_DEFAULT_MB) << 20, HUGE_PAGE_SIZE);
+
+        void *addr = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        is_hugetlb = addr != MAP_FAILED;
+        if (!is_hugetlb) {
+            addr = mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            GGML_ASSERT(addr != MAP_FAILED);
+            madvise(addr, pool_size, MADV_HUGEPAGE);
+        }
+        printf("%s: emulated cma pool %lu MB (%s)\n", __func__, pool_size >> 20, is_hugetlb ? "hugetlb" : "anonymous");
+
+        pool = (char *)addr;
+        free_extents.emplace(0, pool_size);
+    }
+
+public:
+    EmulatedSecureMem(void): cmd_queue(NULL), stop(false) {
+        reserve_pool();
+    }
+
+    ~EmulatedSecureMem() override {
+        stop = true;
+        if (backend.joinable())
+            backend.join();
+        munmap(pool, pool_size);
+    }
+
+    // not visible to other processes, see above
+    all_ring_buffer *map_cmd_queue(void) override {
+        std::call_once(cmd_queue_once, [this] {
+            void *addr = mmap(NULL, CMD_QUEUE_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            GGML_ASSERT(addr != MAP_FAILED);
+            cmd_queue = (all_ring_buffer *)addr;
+            cmd_queue->init();
+        });
+        return cmd_queue;
+    }
+
+    void *alloc_pages(size_t size, int *cma_index, int *entry_index) override {
+        std::lock_guard<std::mutex> _(lock);
+        size = ROUND_UP(size, PAGE_SIZE);
+
+        auto iter = free_extents.begin();
+        while (iter != free_extents.end() && iter->second < size)
+            iter++;
+        if (iter == free_extents.end())
+            GGML_ABORT("emulated cma pool exhausted allocating %lu bytes", size);
+
+        auto [off, len] = *iter;
+        free_extents.erase(iter);
+        if (len > size)
+            free_extents.emplace(off + size, len - size);
+
+        int index = 0;
+        while (index < (int)entries.size() && entries[index].first)
+            index++;
+        if (index == (int)entries.size())
+            entries.emplace_back();
+        entries[index] = { pool + off, size };
+
+        *cma_index = 0;
+        *entry_index = index;
+        return pool + off;
+    }
+
+    bool frees_in_any_order(void) override {
+        return true;
+    }
+
+    void free_pages(void *addr, size_t size) override {
+        std::lock_guard<std::mutex> _(lock);
+        size = ROUND_UP(size, PAGE_SIZE);
+        for (auto &entry : entries) {
+            if (entry.first == addr) {
+                GGML_ASSERT(entry.second == size);
+                entry = { NULL, 0 };
+                break;
+            }
+        }
+
+        size_t off = (char *)addr - pool;
+        GGML_ASSERT(off + size <= pool_size);
+        // hand the pages back, as the driver does when popping cma entries
+        if (!is_hugetlb)
+            madvise(addr, size, MADV_DONTNEED);
+
+        auto next = free_extents.lower_bound(off);
+        if (next != free_extents.end() && off + size == next->first) {
+            size += next->second;
+            next = free_extents.erase(next);
+        }
+        if (next != free_extents.begin()) {
+            auto prev = std::prev(next);
+            if (prev->first + prev->second == off) {
+                prev->second += size;
+                return;
+            }
+        }
+        free_extents.emplace(off, size);
+    }
+
+    void *map_pages(int cma_index, int entry_index, size_t size) override {
+        std::lock_guard<std::mutex> _(lock);
+        GGML_ASSERT(cma_index == 0);
+        GGML_ASSERT(entry_index >= 0 && entry_index < (int)entries.size());
+        GGML_ASSERT(entries[entry_index].first && size <= entries[entry_index].second);
+        return entries[entry_index].first;
+    }
+
+    void unmap_pages(void *addr, size_t size) override {
+        // aliases the pool, nothing to undo
+        (void)addr;
+        (void)size;
+    }
+
+    // the io backend loop runs in its own thread, standing in for the CA
+    void io_rpc(all_ring_buffer *queue) override {
+        std::call_once(backend_once, [this, queue] {
+            backend = std::thread([this, queue] {
+                io_init(queue->io_model_path);
+                while (!stop.load(std::memory_order_relaxed)) {
+                    io_step(queue);
+                    sched_yield();
+                }
+            });
+        });
+    }
+};
+
+static SecureMemProvider *override_provider = NULL;
+
+bool secure_mem_is_emulated(void) {
+#ifdef LLAMA_USE_TEE_EMULATION
+    return true;
+#else
+    const char *env = getenv("LLAMA_TEE_EMULATION");
+    return env && atoi(env) != 0;
+#endif
+}
+
+SecureMemProvider *secure_mem_provider(void) {
+    if (override_provider)
+        return override_provider;
+    static std::unique_ptr<SecureMemProvider> provider(
+        secure_mem_is_emulated() ? (SecureMemProvider *)new EmulatedSecureMem() : new DriverSecureMem()
+    );
+    return provider.get();
+}
+
+void set_secure_mem_provider(SecureMemProvider *provider) {
+    override_provider = provider;
+}
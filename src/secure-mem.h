@@ -0,0 +1,34 @@
+#pragma once
+
+#include "interface.h"
+
+// Source of secure (CMA-backed) memory and of the shared command queue used to
+// talk to the io backend. The default provider goes through the tc_ns_client
+// driver; the emulated one backs everything with anonymous memory and runs the
+// io backend loop in a thread so the pipeline can run on a plain Linux box.
+// Its memory and command queue are not shared with other processes, so it
+// cannot serve a separately started CA backend.
+class SecureMemProvider {
+public:
+    virtual ~SecureMemProvider() = default;
+
+    virtual all_ring_buffer *map_cmd_queue(void) = 0;
+    // PUSH_PAGES + SET_PAGES + mmap
+    virtual void *alloc_pages(size_t size, int *cma_index, int *entry_index) = 0;
+    // munmap + POP_PAGES
+    virtual void free_pages(void *addr, size_t size) = 0;
+    // POP_PAGES releases the newest allocation, so by default frees have to
+    // come in reverse allocation order
+    virtual bool frees_in_any_order(void) { return false; }
+    // map an allocation made by the other side of the command queue
+    virtual void *map_pages(int cma_index, int entry_index, size_t size) = 0;
+    virtual void unmap_pages(void *addr, size_t size) = 0;
+    // let the io backend make progress on the command queue
+    virtual void io_rpc(all_ring_buffer *queue) = 0;
+};
+
+// LLAMA_USE_TEE_EMULATION at build time or LLAMA_TEE_EMULATION=1 at run time
+// selects the emulated provider.
+SecureMemProvider *secure_mem_provider(void);
+void set_secure_mem_provider(SecureMemProvider *provider);
+bool secure_mem_is_emulated(void);
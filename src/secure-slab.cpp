@@ -0,0 +1,124 @@
+#include "secure-slab.h"
+#include "secure-mem.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+#define ROUND_UP(x, n)   (((x) + (n)-1) & ~((n)-1))
+#define PAGE_SIZE 0x1000
+#define SLAB_MB_DEFAULT (32)
+
+extern std::atomic<int64_t> cma_time;
+extern std::atomic<size_t> cma_size;
+
+struct slab {
+    char *addr;
+    size_t size;
+    int cma_index;
+    int entry_index;
+    // bytes handed out, tensors are carved from the front
+    size_t used;
+    int live;
+    // holds a single large tensor
+    bool dedicated;
+};
+
+static std::mutex slab_mtx;
+// in allocation order, so the newest is at the back
+static std::vector<slab> slabs;
+
+static size_t tensor_nr;
+static size_t provider_alloc_nr;
+static size_t provider_free_nr;
+
+static size_t slab_size(void) {
+    static size_t size = [] {
+        const char *env = getenv("LLAMA_SECURE_SLAB_MB");
+        return ROUND_UP((size_t)(env ? std::max(0, atoi(env)) : SLAB_MB_DEFAULT) << 20, PAGE_SIZE);
+    }();
+    return size;
+}
+
+static slab &new_slab(size_t size, bool dedicated) {
+#ifdef TZ_LLM_MEASURE
+    auto start = get_micro();
+#endif
+    slab s = {};
+    s.addr = (char *)secure_mem_provider()->alloc_pages(size, &s.cma_index, &s.entry_index);
+    s.size = size;
+    s.dedicated = dedicated;
+    provider_alloc_nr++;
+#ifdef TZ_LLM_MEASURE
+    cma_size += size;
+    cma_time += get_micro() - start;
+#endif
+    slabs.push_back(s);
+    return slabs.back();
+}
+
+static void release_slab(size_t index) {
+    secure_mem_provider()->free_pages(slabs[index].addr, slabs[index].size);
+    provider_free_nr++;
+    slabs.erase(slabs.begin() + index);
+}
+
+void *slab_alloc(size_t size, int *cma_index, int *entry_index, size_t *entry_off) {
+    std::lock_guard<std::mutex> _(slab_mtx);
+    size = ROUND_UP(size, PAGE_SIZE);
+    tensor_nr++;
+
+    slab *target = NULL;
+    if (size * 2 >= slab_size()) {
+        target = &new_slab(size, true);
+    } else {
+        for (auto &s : slabs) {
+            if (!s.dedicated && s.size - s.used >= size) {
+                target = &s;
+                break;
+            }
+        }
+        if (!target)
+            target = &new_slab(slab_size(), false);
+    }
+
+    *cma_index = target->cma_index;
+    *entry_index = target->entry_index;
+    *entry_off = target->used;
+    target->used += size;
+    target->live++;
+    return target->addr + *entry_off;
+}
+
+void slab_free(void *addr, size_t size) {
+    std::lock_guard<std::mutex> _(slab_mtx);
+    size_t index = 0;
+    while (index < slabs.size() && !((char *)addr >= slabs[index].addr &&
+                                     (char *)addr + size <= slabs[index].addr + slabs[index].size))
+        index++;
+    GGML_ASSERT(index < slabs.size());
+    auto &s = slabs[index];
+    GGML_ASSERT(s.live > 0);
+    if (--s.live)
+        return;
+    s.used = 0;
+
+    if (secure_mem_provider()->frees_in_any_order()) {
+        release_slab(index);
+        return;
+    }
+    while (!slabs.empty() && !slabs.back().live)
+        release_slab(slabs.size() - 1);
+}
+
+void slab_dump_measure(void) {
+    std::lock_guard<std::mutex> _(slab_mtx);
+    size_t reserved = 0, used = 0;
+    for (auto &s : slabs) {
+        reserved += s.size;
+        used += s.used;
+    }
+    printf("secure slabs %lu (%lu MB, %lu MB carved), %lu tensors in %lu allocs / %lu frees\n", slabs.size(),
+           reserved >> 20, used >> 20, tensor_nr, provider_alloc_nr, provider_free_nr);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+
+// Sub-allocates tensors out of large secure memory slabs, so most tensors
+// cost neither PUSH_PAGES + SET_PAGES + mmap nor munmap + POP_PAGES. A slab
+// goes back to the provider once its last tensor is freed; with a provider
+// that frees newest first, empty slabs wait until the ones after them are
+// gone too, and are reused meanwhile.
+//
+//   LLAMA_SECURE_SLAB_MB=N   slab size (default 32), 0 gives every tensor
+//                            its own allocation as before
+//
+// Tensors of half a slab or more get a slab of their own.
+
+// entry_off is where the tensor starts within the cma entry
+void *slab_alloc(size_t size, int *cma_index, int *entry_index, size_t *entry_off);
+void slab_free(void *addr, size_t size);
+void slab_dump_measure(void);
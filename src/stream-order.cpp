@@ -0,0 +1,49 @@
+#include "stream-order.h"
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// suffixes of a decoder block in graph order, biases follow their weights
+static const char *block_order[] = {
+    "attn_norm", "attn_norm_2", "attn_qkv", "attn_q", "attn_k", "attn_v", "attn_q_norm", "attn_k_norm",
+    "attn_output", "attn_post_norm", "ffn_norm", "ffn_gate_inp", "ffn_up", "ffn_up_exps", "ffn_gate",
+    "ffn_gate_exps", "ffn_down", "ffn_down_exps", "ffn_gate_inp_shexp", "ffn_up_shexp", "ffn_gate_shexp",
+    "ffn_down_shexp", "ffn_post_norm", "layer_output_norm",
+};
+static const char *input_order[] = { "token_embd", "token_embd_norm" };
+static const char *output_order[] = { "output_norm", "output" };
+
+#define ORDER_NR(table) ((int)(sizeof(table) / sizeof(table[0])))
+// after the blocks, like parse_name() in prefetch.cpp
+#define OUTPUT_GROUP (1 << 20)
+
+static int64_t rank_in(const char **table, int nr, const std::string &name) {
+    std::string base = name;
+    int is_bias = 0;
+    size_t dot = base.rfind('.');
+    if (dot != std::string::npos) {
+        is_bias = base.compare(dot, std::string::npos, ".bias") == 0;
+        base.resize(dot);
+    }
+    int index = 0;
+    while (index < nr && base != table[index])
+        index++;
+    return index * 2 + is_bias;
+}
+
+int64_t stream_order_rank(const char *name) {
+    int64_t group;
+    int64_t rank;
+    if (strncmp(name, "blk.", 4) == 0) {
+        const char *suffix = strchr(name + 4, '.');
+        group = atoi(name + 4) + 1;
+        rank = rank_in(block_order, ORDER_NR(block_order), suffix ? suffix + 1 : "");
+    } else if (strstr(name, "output")) {
+        group = OUTPUT_GROUP;
+        rank = rank_in(output_order, ORDER_NR(output_order), name);
+    } else {
+        group = 0;
+        rank = rank_in(input_order, ORDER_NR(input_order), name);
+    }
+    return group << 16 | rank;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+
+// Where a tensor falls in the order the forward pass first uses it: the
+// embeddings, then every block from attention to ffn, then the output. Lower
+// ranks are used earlier, equal ranks keep their file order. Weight streaming
+// reads a model front to back when its tensors are stored in this order.
+int64_t stream_order_rank(const char *name);
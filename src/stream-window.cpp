@@ -0,0 +1,164 @@
+#include "stream-window.h"
+#include "io-frontend.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+#ifndef LLAMA_USE_CHCORE_API
+#include "secure-mem.h"
+#endif
+
+#define STREAM_WINDOW_AUTO_INIT (2)
+
+extern Scheduler *sched;
+
+struct window_layer {
+    std::vector<std::shared_ptr<Pipeline>> pipelines;
+    size_t size = 0;
+    bool admitted = false;
+};
+
+static std::once_flag window_once;
+static bool enabled;
+static bool auto_k;
+static int k;
+
+static std::mutex window_mtx;
+// by layer, which is also the order compute visits them in
+static std::map<int, window_layer> layers;
+static int cur_layer = INT32_MIN;
+static int64_t layer_start;
+// moving average of the time compute spends in one layer
+static double layer_us;
+
+static size_t resident_bytes;
+static size_t peak_bytes;
+static size_t restream_bytes;
+
+static void init_window(void) {
+    const char *env = getenv("LLAMA_STREAM_WINDOW");
+    if (!env || !strcmp(env, "0"))
+        return;
+#ifdef LLAMA_USE_CHCORE_API
+    printf("%s: the cma pool frees in stack order, streaming mode disabled\n", __func__);
+    return;
+#else
+    if (!secure_mem_provider()->frees_in_any_order()) {
+        printf("%s: secure memory frees in stack order, streaming mode disabled\n", __func__);
+        return;
+    }
+#endif
+    auto_k = !strcmp(env, "auto");
+    k = auto_k ? STREAM_WINDOW_AUTO_INIT : std::max(atoi(env), 1);
+    enabled = true;
+    printf("%s: streaming with %s window of %d layers\n", __func__, auto_k ? "an adaptive" : "a", k);
+}
+
+bool stream_window_enabled(void) {
+    std::call_once(window_once, init_window);
+    return enabled;
+}
+
+bool stream_window_register(std::shared_ptr<Pipeline> pipeline, int layer, size_t size) {
+    std::lock_guard<std::mutex> _(window_mtx);
+    auto &entry = layers[layer];
+    entry.pipelines.push_back(pipeline);
+    entry.size += size;
+    // the first pass starts at the embeddings
+    entry.admitted = layer < k;
+    if (entry.admitted) {
+        resident_bytes += size;
+        peak_bytes = std::max(peak_bytes, resident_bytes);
+    }
+    return entry.admitted;
+}
+
+static void update_k(void) {
+    double bw = io_bandwidth();
+    // with a single layer there is nothing to stream ahead
+    if (!bw || !layer_us || layers.size() < 2)
+        return;
+    size_t size = 0;
+    for (auto &[layer, entry] : layers)
+        size = std::max(size, entry.size);
+    // a layer has to be read while the ones before it compute
+    int want = (int)ceil(size / bw / layer_us);
+    k = std::clamp(want, 1, (int)layers.size() - 1);
+}
+
+// whether layer lies in [cur_layer, cur_layer + k] going round the model
+static bool in_window(std::map<int, window_layer>::iterator iter) {
+    auto pos = layers.find(cur_layer);
+    for (int i = 0; i <= k; i++) {
+        if (pos == iter)
+            return true;
+        if (++pos == layers.end())
+            pos = layers.begin();
+    }
+    return false;
+}
+
+void stream_window_use(int layer) {
+    if (!enabled)
+        return;
+    std::lock_guard<std::mutex> _(window_mtx);
+    if (layer == cur_layer)
+        return;
+
+    auto now = get_micro();
+    if (cur_layer != INT32_MIN) {
+        double elapsed = now - layer_start;
+        layer_us = layer_us ? 0.8 * layer_us + 0.2 * elapsed : elapsed;
+    }
+    layer_start = now;
+    cur_layer = layer;
+    if (auto_k)
+        update_k();
+
+    // release first, the admitted layers need the memory
+    for (auto iter = layers.begin(); iter != layers.end(); iter++) {
+        auto &entry = iter->second;
+        if (!entry.admitted || in_window(iter))
+            continue;
+        bool idle = std::all_of(entry.pipelines.begin(), entry.pipelines.end(),
+                                [](const std::shared_ptr<Pipeline> &p) { return p->is_finished(); });
+        // a layer that is still streaming stays until next time
+        if (!idle)
+            continue;
+        for (auto &pipeline : entry.pipelines)
+            pipeline->rollback();
+        entry.admitted = false;
+        resident_bytes -= entry.size;
+    }
+    for (auto iter = layers.begin(); iter != layers.end(); iter++) {
+        auto &entry = iter->second;
+        if (entry.admitted || !in_window(iter))
+            continue;
+        for (auto &pipeline : entry.pipelines) {
+            pipeline->get_current_stage()->start(NULL);
+            sched->enqueue(pipeline);
+        }
+        entry.admitted = true;
+        resident_bytes += entry.size;
+        restream_bytes += entry.size;
+    }
+    peak_bytes = std::max(peak_bytes, resident_bytes);
+}
+
+void stream_window_dump_measure(void) {
+    if (!enabled)
+        return;
+    std::lock_guard<std::mutex> _(window_mtx);
+    printf("stream window %d layers, %.2f ms per layer, %lu MB in window (peak %lu MB), re-streamed %lu MB\n", k,
+           layer_us / 1000, resident_bytes >> 20, peak_bytes >> 20, restream_bytes >> 20);
+}
+
+void stream_window_clear_measure(void) {
+    std::lock_guard<std::mutex> _(window_mtx);
+    peak_bytes = resident_bytes;
+    restream_bytes = 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <memory>
+#include "pipeline.h"
+
+// Streaming mode for models larger than secure memory. Only a window of
+// layers is resident: when compute enters layer N, the layers before it are
+// rolled back to the pool and layers N..N+k are queued, wrapping around to
+// the embeddings for the next token.
+//
+//   LLAMA_STREAM_WINDOW=k     keep k layers ahead of the current one
+//   LLAMA_STREAM_WINDOW=auto  pick k from the measured io bandwidth and the
+//                             time compute spends per layer
+//
+// Needs a secure memory provider that frees in any order.
+
+bool stream_window_enabled(void);
+// returns whether the pipeline may be queued right away
+bool stream_window_register(std::shared_ptr<Pipeline> pipeline, int layer, size_t size);
+// compute is about to use a tensor of layer
+void stream_window_use(int layer);
+void stream_window_dump_measure(void);
+void stream_window_clear_measure(void);
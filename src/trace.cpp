@@ -0,0 +1,178 @@
+#include "trace.h"
+#include "pipeline-workers.h"
+#include "interface.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <sched.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#define TRACE_THREAD_MAX (256)
+#define TRACE_EVENTS_DEFAULT (1 << 16)
+
+static const char *trace_path = getenv("LLAMA_PIPELINE_TRACE");
+bool pipeline_trace_on = trace_path != NULL;
+
+struct trace_record {
+    int64_t start;
+    int64_t end;
+    int64_t sched_info;
+    size_t bytes;
+    trace_kind kind;
+};
+
+// written only by its thread, read by trace_export()
+struct trace_ring {
+    pid_t tid;
+    bool worker;
+    std::atomic<uint64_t> head{0};
+    // set while the thread writes a record, trace_export() waits for it
+    std::atomic<bool> writing{false};
+    std::vector<trace_record> records;
+};
+
+// slots are claimed through ring_nr and filled after, so a claimed one may still be NULL
+static std::atomic<trace_ring *> rings[TRACE_THREAD_MAX];
+static std::atomic<int> ring_nr;
+static std::atomic<uint64_t> lost_nr;
+static thread_local trace_ring *my_ring;
+// past TRACE_THREAD_MAX, don't try to claim a slot on every event
+static thread_local bool my_ring_denied;
+// events are dropped while trace_export() reads the rings
+static std::atomic<bool> export_running;
+
+static std::mutex name_mtx;
+static std::unordered_map<int64_t, std::string> names;
+
+static size_t ring_size(void) {
+    static size_t size = [] {
+        const char *env = getenv("LLAMA_PIPELINE_TRACE_EVENTS");
+        return env && atol(env) > 0 ? (size_t)atol(env) : (size_t)TRACE_EVENTS_DEFAULT;
+    }();
+    return size;
+}
+
+static trace_ring *get_ring(void) {
+    if (my_ring || my_ring_denied)
+        return my_ring;
+    int index = ring_nr.load();
+    do {
+        if (index >= TRACE_THREAD_MAX) {
+            my_ring_denied = true;
+            return NULL;
+        }
+    } while (!ring_nr.compare_exchange_weak(index, index + 1));
+    auto ring = new trace_ring;
+    ring->tid = gettid();
+    ring->worker = pipeline_get_thread_class() == PIPELINE_THREAD_WORKER;
+    ring->records.resize(ring_size());
+    rings[index].store(ring, std::memory_order_release);
+    my_ring = ring;
+    return ring;
+}
+
+void trace_name(int64_t sched_info, const char *name) {
+    if (!trace_enabled())
+        return;
+    std::lock_guard<std::mutex> _(name_mtx);
+    names[sched_info] = name;
+}
+
+void trace_event(trace_kind kind, int64_t sched_info, int64_t start, int64_t end, size_t bytes) {
+    if (!trace_enabled())
+        return;
+    auto ring = get_ring();
+    if (!ring) {
+        lost_nr.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // pairs with trace_export(): either it sees writing or we see export_running
+    ring->writing.store(true);
+    if (!export_running.load()) {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        ring->records[head % ring->records.size()] = {start, end, sched_info, bytes, kind};
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+    ring->writing.store(false, std::memory_order_release);
+}
+
+void trace_export(void) {
+    if (!trace_enabled())
+        return;
+    static const char *kind_names[] = {"alloc", "io", "decrypt", "wait", "relayout"};
+
+    FILE *file = fopen(trace_path, "w");
+    if (!file) {
+        printf("%s: cannot open %s\n", __func__, trace_path);
+        return;
+    }
+    int nr = std::min(ring_nr.load(), TRACE_THREAD_MAX);
+    // stop the writers, the records are plain memory
+    export_running.store(true);
+    // only the rings seen here were waited for
+    std::vector<trace_ring *> snap(nr);
+    for (int i = 0; i < nr; i++) {
+        snap[i] = rings[i].load(std::memory_order_acquire);
+        while (snap[i] && snap[i]->writing.load(std::memory_order_acquire))
+            sched_yield();
+    }
+    // chrome wants small timestamps, start at the first event
+    int64_t base = INT64_MAX;
+    for (int i = 0; i < nr; i++) {
+        auto ring = snap[i];
+        if (!ring)
+            continue;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        for (uint64_t j = head - std::min<uint64_t>(head, ring->records.size()); j < head; j++)
+            base = std::min(base, ring->records[j % ring->records.size()].start);
+    }
+
+    std::lock_guard<std::mutex> _(name_mtx);
+    size_t event_nr = 0;
+    uint64_t overwritten = 0;
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first_ring = true;
+    for (int i = 0; i < nr; i++) {
+        auto ring = snap[i];
+        if (!ring)
+            continue;
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                first_ring ? "" : ",\n", ring->tid, ring->worker ? "pipeline worker" : "compute", ring->tid);
+        first_ring = false;
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head - std::min<uint64_t>(head, ring->records.size());
+        overwritten += first;
+        for (uint64_t j = first; j < head; j++) {
+            auto &rec = ring->records[j % ring->records.size()];
+            auto iter = names.find(rec.sched_info);
+            const char *name = iter != names.end() ? iter->second.c_str() : "?";
+            int layer = (int)(rec.sched_info >> 32);
+            if (rec.kind == TRACE_IO) {
+                // requests overlap on the thread that reaps them, use async slices
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"io\",\"ph\":\"b\",\"id\":%lu,\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%ld,\"args\":{\"layer\":%d,\"bytes\":%zu}}",
+                        name, event_nr, ring->tid, rec.start - base, layer, rec.bytes);
+                fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"io\",\"ph\":\"e\",\"id\":%lu,\"pid\":1,\"tid\":%d,\"ts\":%ld}",
+                        name, event_nr, ring->tid, rec.end - base);
+            } else {
+                fprintf(file, ",\n{\"name\":\"%s %s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                        "\"ts\":%ld,\"dur\":%ld,\"args\":{\"layer\":%d,\"bytes\":%zu}}",
+                        kind_names[rec.kind], name, kind_names[rec.kind], ring->tid, rec.start - base,
+                        rec.end - rec.start, layer, rec.bytes);
+            }
+            event_nr++;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    export_running.store(false);
+    printf("%s: %zu events to %s", __func__, event_nr, trace_path);
+    if (overwritten || lost_nr)
+        printf(", %lu overwritten, %lu lost to thread limit", overwritten, lost_nr.load());
+    printf("\n");
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Timeline of the weight pipeline. Every alloc, decrypt and relayout task, every io
+// request from launch to completion and every wait in use_param_tensor is
+// recorded in a per-thread ring, then written out as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev).
+//
+//   LLAMA_PIPELINE_TRACE=file.json    record and export to file.json
+//   LLAMA_PIPELINE_TRACE_EVENTS=N     events kept per thread (default 65536),
+//                                     older ones are overwritten
+//
+// With the variable unset recording is a single branch per event.
+
+enum trace_kind {
+    TRACE_ALLOC,
+    TRACE_IO,
+    TRACE_DECRYPT,
+    TRACE_WAIT,
+    TRACE_RELAYOUT,
+};
+
+extern bool pipeline_trace_on;
+
+static inline bool trace_enabled(void) {
+    return pipeline_trace_on;
+}
+
+// label the events of the pipeline with sched_info
+void trace_name(int64_t sched_info, const char *name);
+void trace_event(trace_kind kind, int64_t sched_info, int64_t start, int64_t end, size_t bytes);
+// write everything recorded so far to the trace file
+void trace_export(void);
@@ -0,0 +1,92 @@
+// Shares MUL_MATs between the CPU threads and a fake accelerator that is much
+// slower than them, checks every result and that the learned split moved most
+// of the rows to the CPU.
+
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#ifdef GGML_USE_RKNPURE
+extern void ggml_backend_rknpure_set_strawman(bool strawman);
+#endif
+
+static const int M = 32;
+static const int K = 256;
+static const int N = 512;
+
+int main(int argc, char ** argv) {
+    int n_iter = argc > 1 ? atoi(argv[1]) : 20;
+    int n_threads = argc > 2 ? atoi(argv[2]) : 4;
+
+    // read by the first ggml_init
+    setenv("GGML_MUL_MAT_SPLIT", "auto", 1);
+    setenv("GGML_FAKE_ACCEL_GFLOPS", "0.5", 1);
+
+#ifdef GGML_USE_RKNPURE
+    // keep the mul_mat off the NPU so the fake accelerator gets it
+    ggml_backend_rknpure_set_strawman(true);
+#endif
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 4 * ggml_tensor_overhead() + ggml_graph_overhead() + 4 * 1024 * 1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F16, K, N);
+    ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, K, M);
+    ggml_tensor * out = ggml_mul_mat(ctx, b, a);
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> B((size_t)N * K);
+    for (size_t i = 0; i < B.size(); i++) {
+        ((ggml_fp16_t *)b->data)[i] = ggml_fp32_to_fp16(dist(rng));
+        B[i] = ggml_fp16_to_fp32(((ggml_fp16_t *)b->data)[i]);
+    }
+
+    int failed = 0;
+    for (int it = 0; it < n_iter; it++) {
+        float * A = (float *)a->data;
+        for (int i = 0; i < M * K; i++) {
+            A[i] = dist(rng);
+        }
+
+        ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+        double err = 0.0, norm = 0.0;
+        for (int i = 0; i < M; i++) {
+            for (int j = 0; j < N; j++) {
+                // the CPU rounds src1 to fp16 as well
+                double ref = 0.0;
+                for (int t = 0; t < K; t++) {
+                    ref += (double)ggml_fp16_to_fp32(ggml_fp32_to_fp16(A[i * K + t])) * B[(size_t)j * K + t];
+                }
+                double x = ((float *)out->data)[i * N + j];
+                err += (x - ref) * (x - ref);
+                norm += ref * ref;
+            }
+        }
+        if (err / norm > 1e-10) {
+            fprintf(stderr, "error: iteration %d: nmse %g\n", it, err / norm);
+            failed++;
+        }
+    }
+
+    const float share = ggml_mul_mat_split_share(M, K, N, GGML_TYPE_F16);
+    printf("%d iterations, %d failed, accelerator share %.3f\n", n_iter, failed, share);
+    if (share <= 0.0f || share >= 0.5f) {
+        fprintf(stderr, "error: the accelerator is the slower side but got a share of %.3f\n", share);
+        failed++;
+    }
+
+    ggml_free(ctx);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,61 @@
+// Pushes batches of jobs through the NPU job queue, more than a ring holds,
+// and checks that each ran exactly once, on its core, before the wait
+// returned.
+
+#include "npu_jobq.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+struct test_job {
+    int core;
+    std::atomic<int> runs;
+    std::atomic<int> wrong_core;
+};
+
+static void run_job(void * arg, int core) {
+    auto job = (test_job *)arg;
+    if (job->core != core) {
+        job->wrong_core++;
+    }
+    job->runs++;
+}
+
+static void poll(void) {
+    std::this_thread::yield();
+}
+
+int main(int argc, char ** argv) {
+    int n_batches = argc > 1 ? atoi(argv[1]) : 100;
+    const int n_cores = 3;
+
+    int failed = 0;
+    for (int n_submitters : { n_cores, 2 * n_cores + 1 }) {
+        npu_jobq * q = npu_jobq_create(n_cores, n_submitters, nullptr, 0, 0);
+        for (int batch = 0; batch < n_batches; batch++) {
+            std::vector<test_job> jobs(1 + batch * 7 % 1000);
+            for (size_t i = 0; i < jobs.size(); i++) {
+                jobs[i].core = i % n_cores;
+                jobs[i].runs = 0;
+                jobs[i].wrong_core = 0;
+                npu_jobq_push(q, jobs[i].core, { run_job, &jobs[i] });
+            }
+            // both ways of waiting
+            npu_jobq_wait(q, batch % 2 ? poll : nullptr);
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (jobs[i].runs != 1 || jobs[i].wrong_core) {
+                    fprintf(stderr, "error: %d submitters, batch %d, job %zu ran %d times, %d on the wrong core\n",
+                            n_submitters, batch, i, jobs[i].runs.load(), jobs[i].wrong_core.load());
+                    failed++;
+                }
+            }
+        }
+        npu_jobq_dump(q);
+        npu_jobq_destroy(q);
+    }
+    printf("%d batches, %d failed\n", n_batches, failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,208 @@
+// Runs the NPU matmul task lists through the CPU simulator for random shapes
+// and tilings, split and packed the way ggml-rknpu-re.cpp does it, and checks
+// the result against ggml_mul_mat.
+
+#include "ggml.h"
+#include "npu_matmul.h"
+#include "npu_relayout.h"
+#include "npu_sim.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#ifdef GGML_USE_RKNPURE
+extern void ggml_backend_rknpure_set_strawman(bool strawman);
+#endif
+
+// emulated addresses of the three buffers of a tile
+static const uint32_t INPUT_DMA  = 0x10000000;
+static const uint32_t WEIGHT_DMA = 0x20000000;
+static const uint32_t OUTPUT_DMA = 0x30000000;
+
+struct sim_case {
+    bool fp16;
+    int m, k, n;
+    // tile shape
+    int M, K, N;
+};
+
+static int partition(int num, int max, int align) {
+    int div = (num + max - 1) / max;
+    return ((num + div - 1) / div + align - 1) / align * align;
+}
+
+// C = A * B^T on the CPU backend
+static std::vector<float> ggml_reference(const sim_case & c, const void * B, const std::vector<float> & A) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 4 * ggml_tensor_overhead() + ggml_graph_overhead() + 16 * 1024 * 1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+    ggml_tensor * b = ggml_new_tensor_2d(ctx, c.fp16 ? GGML_TYPE_F16 : GGML_TYPE_Q8_0, c.k, c.n);
+    ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, c.k, c.m);
+    memcpy(b->data, B, ggml_nbytes(b));
+    memcpy(a->data, A.data(), ggml_nbytes(a));
+    ggml_tensor * out = ggml_mul_mat(ctx, b, a);
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+    std::vector<float> C((float *)out->data, (float *)out->data + (size_t)c.m * c.n);
+    ggml_free(ctx);
+    return C;
+}
+
+// 0 if the case passed, 1 if it failed, -1 if gen_matmul rejected the tile shape
+static int run_case(const sim_case & c, std::mt19937 & rng) {
+    const int esize = c.fp16 ? 2 : 1;
+    // channels per 16 byte atom of the input
+    const int c2 = c.fp16 ? 8 : 16;
+
+    uint64_t tasks[112];
+    matmul_params_t params = {};
+    params.m = c.M;
+    params.k = c.K;
+    params.n = c.N;
+    params.input_dma = INPUT_DMA;
+    params.weights_dma = WEIGHT_DMA;
+    params.output_dma = OUTPUT_DMA;
+    params.tasks = tasks;
+    params.fp32tofp16 = 0;
+    if ((c.fp16 ? gen_matmul_fp16(&params) : gen_matmul_int8(&params)) != 0) {
+        return -1;
+    }
+
+    // int8 operands are exact: q8_0 weights with a delta of 1, and inputs that
+    // quantize to themselves because every block of 32 reaches +-127
+    std::vector<float> A((size_t)c.m * c.k);
+    std::vector<uint8_t> B;
+    if (c.fp16) {
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (auto & x : A) {
+            x = dist(rng);
+        }
+        B.resize((size_t)c.n * c.k * sizeof(ggml_fp16_t));
+        for (size_t i = 0; i < (size_t)c.n * c.k; i++) {
+            ((ggml_fp16_t *)B.data())[i] = ggml_fp32_to_fp16(dist(rng));
+        }
+    } else {
+        for (size_t i = 0; i < A.size(); i++) {
+            A[i] = i % 32 == 0 ? (rng() % 2 ? 127.0f : -127.0f) : (float)((int)(rng() % 255) - 127);
+        }
+        const size_t block_size = sizeof(ggml_fp16_t) + 32;
+        B.resize((size_t)c.n * c.k / 32 * block_size);
+        for (size_t b = 0; b < B.size() / block_size; b++) {
+            ggml_fp16_t d = ggml_fp32_to_fp16(1.0f);
+            memcpy(&B[b * block_size], &d, sizeof(d));
+            for (int t = 0; t < 32; t++) {
+                B[b * block_size + sizeof(d) + t] = (uint8_t)(int8_t)((int)(rng() % 255) - 127);
+            }
+        }
+    }
+
+    std::vector<uint8_t> input((size_t)c.M * c.K * esize);
+    std::vector<uint8_t> weight((size_t)c.N * c.K * esize);
+    std::vector<uint8_t> output((size_t)c.M * c.N * 4);
+    npu_sim_mem mems[] = {
+        { INPUT_DMA,  input.data(),  input.size()  },
+        { WEIGHT_DMA, weight.data(), weight.size() },
+        { OUTPUT_DMA, output.data(), output.size() },
+    };
+
+    std::vector<float> C((size_t)c.m * c.n, 0.0f);
+    for (int mm = 0; mm < c.m; mm += c.M) {
+        for (int nn = 0; nn < c.n; nn += c.N) {
+            for (int kk = 0; kk < c.k; kk += c.K) {
+                // same as rknpu2_matmul_pre1
+                std::fill(input.begin(), input.end(), 0);
+                for (int i = 0; i < c.M && mm + i < c.m; i++) {
+                    for (int j = 0; j < c.K && kk + j < c.k; j++) {
+                        float x = A[(size_t)(mm + i) * c.k + kk + j];
+                        int pos = feature_data(c.K, c.M, 1, c2, j + 1, i + 1, 1);
+                        if (c.fp16) {
+                            ((ggml_fp16_t *)input.data())[pos] = ggml_fp32_to_fp16(x);
+                        } else {
+                            ((int8_t *)input.data())[pos] = (int8_t)x;
+                        }
+                    }
+                }
+                if (c.fp16) {
+                    npu_pack_fp16_tile((uint16_t *)weight.data(), (const uint16_t *)B.data(), c.k, c.n, c.K, c.N, kk, nn);
+                } else {
+                    npu_pack_q8_0_tile((int8_t *)weight.data(), B.data(), c.k, c.n, c.K, c.N, kk, nn, 1.0f);
+                }
+
+                std::fill(output.begin(), output.end(), 0xcd);
+                const char * err = NULL;
+                if (npu_sim_run(tasks, 112, mems, 3, &err) != 0) {
+                    fprintf(stderr, "error: simulating tile (%d, %d, %d): %s\n", mm, nn, kk, err);
+                    return 1;
+                }
+
+                // same as rknpu2_matmul_post
+                for (int i = 0; i < c.M && mm + i < c.m; i++) {
+                    for (int j = 0; j < c.N && nn + j < c.n; j += 4) {
+                        for (int t = 0; t < 4; t++) {
+                            size_t pos = (size_t)c.M * j + i * 4 + t;
+                            C[(size_t)(mm + i) * c.n + nn + j + t] += c.fp16 ? ((float *)output.data())[pos]
+                                                                             : (float)((int32_t *)output.data())[pos];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<float> ref = ggml_reference(c, B.data(), A);
+    double err = 0.0, norm = 0.0;
+    for (size_t i = 0; i < C.size(); i++) {
+        err += (C[i] - ref[i]) * (C[i] - ref[i]);
+        norm += ref[i] * ref[i];
+    }
+    // the int8 sums are exact integers on both sides
+    const double max_nmse = c.fp16 ? 1e-7 : 0.0;
+    if (err / std::max(norm, 1e-30) > max_nmse) {
+        fprintf(stderr, "error: %s m=%d k=%d n=%d in %dx%dx%d tiles: nmse %g\n",
+                c.fp16 ? "fp16" : "int8", c.m, c.k, c.n, c.M, c.K, c.N, err / norm);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    int n_cases = argc > 1 ? atoi(argv[1]) : 200;
+    unsigned seed = argc > 2 ? (unsigned)atoi(argv[2]) : 1234;
+
+#ifdef GGML_USE_RKNPURE
+    // the reference must come from the CPU, not from the NPU under test
+    ggml_backend_rknpure_set_strawman(true);
+#endif
+
+    std::mt19937 rng(seed);
+    int failed = 0, rejected = 0;
+    for (int i = 0; i < n_cases; i++) {
+        sim_case c;
+        c.fp16 = rng() % 2;
+        c.m = 1 + rng() % 96;
+        c.k = 32 * (1 + rng() % 16);
+        c.n = 32 * (1 + rng() % 8);
+        // tile limits like matmul_kernel's, scaled down so edge tiles are common
+        c.M = partition(c.m, 1 + rng() % c.m, 1);
+        c.K = partition(c.k, 32 * (1 + rng() % (c.k / 32)), 32);
+        c.N = partition(c.n, 32 * (1 + rng() % (c.n / 32)), 32);
+
+        int ret = run_case(c, rng);
+        if (ret < 0) {
+            rejected++;
+        } else {
+            failed += ret;
+        }
+    }
+    printf("%d cases, %d failed, %d tile shapes rejected by gen_matmul\n", n_cases, failed, rejected);
+    return failed ? 1 : 0;
+}
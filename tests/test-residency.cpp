@@ -0,0 +1,52 @@
+// Without LLAMA_RESIDENCY_MB nothing survives a request: every finished
+// pipeline, pinned ones included, has to come back from
+// residency_next_request, while one still in flight is left alone.
+
+#include "residency.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+// finished pipelines have no stage left, in flight ones are still allocating
+static std::shared_ptr<Pipeline> make_pipeline(bool finished) {
+    auto alloc = finished ? nullptr : std::make_shared<AllocStage>(0, 4096);
+    return std::make_shared<Pipeline>(alloc, nullptr, nullptr, nullptr, nullptr);
+}
+
+int main(void) {
+    unsetenv("LLAMA_RESIDENCY_MB");
+
+    std::vector<std::shared_ptr<Pipeline>> finished;
+    for (int i = 0; i < 4; i++) {
+        finished.push_back(make_pipeline(true));
+        residency_register(finished.back(), 1 << 20);
+    }
+    auto in_flight = make_pipeline(false);
+    residency_register(in_flight, 1 << 20);
+    residency_pin(finished[0].get());
+
+    int failed = 0;
+    for (int request = 0; request < 3; request++) {
+        // the in flight one and an unused one are never consumed
+        residency_use(finished[2].get());
+        residency_use(finished[0].get());
+        residency_use(finished[1].get());
+
+        auto evicted = residency_next_request();
+        for (auto &pipeline : finished) {
+            if (std::find(evicted.begin(), evicted.end(), pipeline) == evicted.end()) {
+                fprintf(stderr, "error: request %d kept a finished pipeline\n", request);
+                failed++;
+            }
+        }
+        if (std::find(evicted.begin(), evicted.end(), in_flight) != evicted.end()) {
+            fprintf(stderr, "error: request %d rolled back a pipeline in flight\n", request);
+            failed++;
+        }
+    }
+    printf("%d failed\n", failed);
+    return failed ? 1 : 0;
+}